@@ -0,0 +1,167 @@
+#include "affinity.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <atomic>
+
+// mbind的内存策略，和<numaif.h>中的定义一致
+// 这里直接用系统调用，就不需要额外链接libnuma了
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+static bool huge_pages = false;     // alloc_on_node是否使用大页
+// 开启大页之后分配的内存中，预留的大页、透明大页、普通页（madvise失败）各有多少字节
+enum { PAGES_RESERVED, PAGES_TRANSPARENT, PAGES_NORMAL, PAGE_KINDS };
+static std::atomic< size_t > huge_bytes[ PAGE_KINDS ];
+
+
+// 解析CPU列表字符串，格式类似于 "0-3,8,10-11"
+bool parse_cpu_list( const char* text, std::vector<int>& cpus ) {
+    cpus.clear();
+    const char* p = text;
+    while( *p != '\0' ) {
+        char* end = NULL;
+        long first = strtol( p, &end, 10 );
+        if( end == p || first < 0 ) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if( *p == '-' ) {   // 是一个范围，例如 0-3
+            ++p;
+            last = strtol( p, &end, 10 );
+            if( end == p || last < first ) {
+                return false;
+            }
+            p = end;
+        }
+        for( long cpu = first; cpu <= last; ++cpu ) {
+            cpus.push_back( (int)cpu );
+        }
+        if( *p == ',' ) {
+            ++p;
+        } else if( *p != '\0' ) {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+// 将线程tid绑定到cpu上
+bool bind_thread_to_cpu( pthread_t tid, int cpu ) {
+    if( cpu < 0 || cpu >= CPU_SETSIZE ) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    return pthread_setaffinity_np( tid, sizeof( set ), &set ) == 0;
+}
+
+// 获取cpu所属的NUMA节点号
+// sysfs中 /sys/devices/system/cpu/cpuN/ 目录下有一个名为nodeX的链接，X即为节点号
+int numa_node_of_cpu( int cpu ) {
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/sys/devices/system/cpu/cpu%d", cpu );
+    DIR* dir = opendir( path );
+    if( !dir ) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent* entry;
+    while( ( entry = readdir( dir ) ) != NULL ) {
+        if( strncmp( entry->d_name, "node", 4 ) == 0 ) {
+            node = atoi( entry->d_name + 4 );
+            break;
+        }
+    }
+    closedir( dir );
+    return node;
+}
+
+void set_huge_pages( bool on ) {
+    huge_pages = on;
+}
+
+bool huge_pages_enabled() {
+    return huge_pages;
+}
+
+size_t node_alloc_size( size_t size ) {
+    return huge_pages ? ( size + HUGE_PAGE_SIZE - 1 ) & ~( HUGE_PAGE_SIZE - 1 ) : size;
+}
+
+// 用大页映射size（已经按大页对齐）字节的匿名内存，失败返回MAP_FAILED
+static void* map_huge( size_t size ) {
+    // 预留的大页：mmap时就从vm.nr_hugepages中扣除，不够时直接失败（不加MAP_NORESERVE，否则要到访问时才SIGBUS）
+    void* addr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    if( addr != MAP_FAILED ) {
+        huge_bytes[ PAGES_RESERVED ] += size;
+        return addr;
+    }
+    // 透明大页：多映射2MB，截掉首尾，得到一段2MB对齐的内存，内核在第一次访问时才能直接分配整个大页
+    char* raw = ( char* )mmap( NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    if( raw == MAP_FAILED ) {
+        return MAP_FAILED;
+    }
+    char* aligned = ( char* )( ( ( size_t )raw + HUGE_PAGE_SIZE - 1 ) & ~( HUGE_PAGE_SIZE - 1 ) );
+    if( aligned > raw ) {
+        munmap( raw, aligned - raw );
+    }
+    munmap( aligned + size, raw + HUGE_PAGE_SIZE - aligned );
+    if( madvise( aligned, size, MADV_HUGEPAGE ) != 0 ) {
+        huge_bytes[ PAGES_NORMAL ] += size;
+    } else {
+        huge_bytes[ PAGES_TRANSPARENT ] += size;
+    }
+    return aligned;
+}
+
+void print_huge_pages() {
+    if( !huge_pages ) {
+        return;
+    }
+    printf( "huge pages: %.1f MB in reserved 2MB pages (MAP_HUGETLB), %.1f MB in transparent huge pages, "
+            "%.1f MB in normal pages (madvise failed)\n", huge_bytes[ PAGES_RESERVED ] / 1048576.0,
+            huge_bytes[ PAGES_TRANSPARENT ] / 1048576.0, huge_bytes[ PAGES_NORMAL ] / 1048576.0 );
+}
+
+// 在NUMA节点node上分配size字节的内存
+// 先用mmap拿到一段匿名映射，然后用mbind设置这段内存优先从node节点分配物理页，
+// 物理页在第一次被访问时才真正分配，所以不会一次性占用大量内存
+void* alloc_on_node( size_t size, int node ) {
+    size = node_alloc_size( size );
+    void* addr;
+    if( huge_pages ) {
+        addr = map_huge( size );
+    } else {
+        addr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    }
+    if( addr == MAP_FAILED ) {
+        return NULL;
+    }
+    if( node >= 0 && node < (int)( sizeof( unsigned long ) * 8 ) ) {
+        unsigned long nodemask = 1UL << node;
+        // mbind失败并不影响正确性，只是内存不一定在本地节点上
+        if( syscall( SYS_mbind, addr, size, MPOL_PREFERRED, &nodemask, sizeof( nodemask ) * 8, 0 ) != 0 ) {
+            printf( "mbind to node %d failed, using default policy\n", node );
+        }
+    }
+    return addr;
+}
+
+// 释放alloc_on_node分配的内存
+void free_on_node( void* addr, size_t size ) {
+    if( addr ) {
+        munmap( addr, node_alloc_size( size ) );    // 预留的大页必须按大页大小整个释放
+    }
+}
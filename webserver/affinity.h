@@ -0,0 +1,42 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+// CPU亲和性与NUMA相关的辅助函数
+// 双路服务器上，线程如果被内核在不同的核、不同的CPU插槽之间来回迁移，
+// 会导致缓存失效和跨节点的远程内存访问，所以这里提供：
+// 1. 把线程绑定到指定CPU上
+// 2. 查询某个CPU所属的NUMA节点
+// 3. 在指定的NUMA节点上分配内存（用于存放http_conn数组及其读写缓冲区）
+// 4. 可选地用2MB的大页分配这些内存（以及文件缓存、资源包），减少TLB未命中
+
+#include <vector>
+#include <stddef.h>
+#include <pthread.h>
+
+// 解析CPU列表字符串，格式类似于 "0-3,8,10-11"，解析成功返回true
+bool parse_cpu_list( const char* text, std::vector<int>& cpus );
+
+// 将线程tid绑定到cpu上，成功返回true
+bool bind_thread_to_cpu( pthread_t tid, int cpu );
+
+// 获取cpu所属的NUMA节点号，查询不到（比如非NUMA机器）时返回-1
+int numa_node_of_cpu( int cpu );
+
+// 在NUMA节点node上分配size字节的内存（按页对齐，内容为0）
+// node为-1时表示不指定节点，失败返回NULL
+void* alloc_on_node( size_t size, int node );
+// 释放alloc_on_node分配的内存
+void free_on_node( void* addr, size_t size );
+// 申请size字节时alloc_on_node实际分配的大小（开启大页时按大页大小向上取整）
+size_t node_alloc_size( size_t size );
+
+// 开启后，alloc_on_node按2MB大页分配：先尝试预留的大页（MAP_HUGETLB，需要 sysctl vm.nr_hugepages=N），
+// 预留的大页不够时退回透明大页（2MB对齐之后madvise(MADV_HUGEPAGE)）
+// 只能在启动时、分配任何内存之前设置
+void set_huge_pages( bool on );
+bool huge_pages_enabled();
+// 打印开启大页以来alloc_on_node分配的内存各用了哪种页（预留的大页、透明大页、普通页）
+// alloc_on_node本身不打印（运行时文件缓存也会分配），启动完成时打印一次，收到SIGUSR2时也会打印
+void print_huge_pages();
+
+#endif
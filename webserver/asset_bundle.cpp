@@ -0,0 +1,393 @@
+#include "asset_bundle.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "affinity.h"
+
+// 资源包文件的魔数
+static const char PACK_MAGIC[ 8 ] = { 'W', 'S', 'P', 'A', 'C', 'K', '1', '\0' };
+
+// 打包时的一个文件
+struct pack_item {
+    std::string url;
+    std::string header;
+    std::string body;
+};
+
+// 根据文件扩展名确定Content-Type
+static const char* content_type_of( const std::string& url ) {
+    static const char* const types[][ 2 ] = {
+        { ".html", "text/html" }, { ".htm", "text/html" }, { ".css", "text/css" },
+        { ".js", "application/javascript" }, { ".json", "application/json" },
+        { ".txt", "text/plain" }, { ".jpg", "image/jpeg" }, { ".jpeg", "image/jpeg" },
+        { ".png", "image/png" }, { ".gif", "image/gif" }, { ".ico", "image/x-icon" },
+        { ".svg", "image/svg+xml" },
+    };
+    for( size_t i = 0; i < sizeof( types ) / sizeof( types[ 0 ] ); ++i ) {
+        size_t n = strlen( types[ i ][ 0 ] );
+        if( url.size() >= n && strcasecmp( url.c_str() + url.size() - n, types[ i ][ 0 ] ) == 0 ) {
+            return types[ i ][ 1 ];
+        }
+    }
+    return "application/octet-stream";
+}
+
+// 读取整个文件的内容
+static bool read_file( const std::string& path, std::string& body ) {
+    int fd = open( path.c_str(), O_RDONLY );
+    if( fd < 0 ) {
+        return false;
+    }
+    char buf[ 65536 ];
+    int n;
+    while( ( n = read( fd, buf, sizeof( buf ) ) ) > 0 ) {
+        body.append( buf, n );
+    }
+    close( fd );
+    return n == 0;
+}
+
+// 递归地收集目录dir下的文件，url_prefix是dir对应的url
+// 和do_request一样，只收集对其他用户可读的普通文件
+static void collect( const std::string& dir, const std::string& url_prefix, std::vector< pack_item >& items ) {
+    DIR* d = opendir( dir.c_str() );
+    if( !d ) {
+        return;
+    }
+    struct dirent* entry;
+    while( ( entry = readdir( d ) ) != NULL ) {
+        if( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 ) {
+            continue;
+        }
+        std::string path = dir + "/" + entry->d_name;
+        std::string url = url_prefix + "/" + entry->d_name;
+        struct stat st;
+        if( stat( path.c_str(), &st ) < 0 ) {
+            continue;
+        }
+        if( S_ISDIR( st.st_mode ) ) {
+            collect( path, url, items );
+        } else if( S_ISREG( st.st_mode ) && ( st.st_mode & S_IROTH ) ) {
+            pack_item item;
+            item.url = url;
+            if( !read_file( path, item.body ) ) {
+                printf( "pack: read %s failed\n", path.c_str() );
+                continue;
+            }
+            char header[ 256 ];
+            snprintf( header, sizeof( header ), "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\nContent-Type:%s\r\n",
+                      ( unsigned long )item.body.size(), content_type_of( url ) );
+            item.header = header;
+            items.push_back( item );
+        }
+    }
+    closedir( d );
+}
+
+// 向上对齐到8字节
+static size_t align8( size_t n ) {
+    return ( n + 7 ) & ~( size_t )7;
+}
+
+
+asset_bundle::asset_bundle() : m_base( NULL ), m_size( 0 ), m_allocated( false ), m_header( NULL ),
+        m_disp( NULL ), m_slot( NULL ), m_entries( NULL ) {
+}
+
+asset_bundle::~asset_bundle() {
+    release();
+}
+
+// 带种子的FNV-1a哈希
+uint32_t asset_bundle::hash( const char* key, int len, uint32_t seed ) {
+    uint32_t h = 2166136261u ^ ( seed * 16777619u );
+    for( int i = 0; i < len; ++i ) {
+        h ^= ( unsigned char )key[ i ];
+        h *= 16777619u;
+    }
+    return h ^ ( h >> 15 );
+}
+
+// 把doc_root目录下的文件打包进内存
+// 完美哈希用"哈希-偏移"法构造：先把url按哈希分到若干个桶里，然后从大桶到小桶，
+// 为每个桶找一个偏移量（作为第二次哈希的种子），使桶里所有url都落到哈希表中互不相同的空位上
+bool asset_bundle::build( const char* doc_root ) {
+    std::vector< pack_item > items;
+    collect( doc_root, "", items );
+    if( items.empty() ) {
+        return false;
+    }
+
+    uint32_t count = items.size();
+    uint32_t buckets = count / 2 + 1;
+    uint32_t slots = count + count / 4 + 1;
+    std::vector< uint32_t > disp;
+    std::vector< uint32_t > slot;
+    bool done = false;
+    while( !done ) {
+        disp.assign( buckets, 0 );
+        slot.assign( slots, 0 );
+        std::vector< std::vector< uint32_t > > bucket( buckets );
+        for( uint32_t i = 0; i < count; ++i ) {
+            bucket[ hash( items[ i ].url.data(), items[ i ].url.size(), 0 ) % buckets ].push_back( i );
+        }
+        std::vector< uint32_t > order( buckets );
+        for( uint32_t b = 0; b < buckets; ++b ) {
+            order[ b ] = b;
+        }
+        std::sort( order.begin(), order.end(), [ &bucket ]( uint32_t x, uint32_t y ) {
+            return bucket[ x ].size() > bucket[ y ].size();
+        } );
+        done = true;
+        for( uint32_t k = 0; k < buckets && done; ++k ) {
+            const std::vector< uint32_t >& keys = bucket[ order[ k ] ];
+            if( keys.empty() ) {
+                break;
+            }
+            bool placed = false;
+            for( uint32_t d = 1; d < ( 1u << 16 ) && !placed; ++d ) {
+                std::vector< uint32_t > pos;
+                placed = true;
+                for( size_t j = 0; j < keys.size(); ++j ) {
+                    uint32_t p = hash( items[ keys[ j ] ].url.data(), items[ keys[ j ] ].url.size(), d ) % slots;
+                    if( slot[ p ] != 0 || std::find( pos.begin(), pos.end(), p ) != pos.end() ) {
+                        placed = false;
+                        break;
+                    }
+                    pos.push_back( p );
+                }
+                if( placed ) {
+                    disp[ order[ k ] ] = d;
+                    for( size_t j = 0; j < keys.size(); ++j ) {
+                        slot[ pos[ j ] ] = keys[ j ] + 1;
+                    }
+                }
+            }
+            if( !placed ) {
+                // 找不到合适的偏移量，把哈希表放大一些重新构造
+                done = false;
+                slots = slots + slots / 2 + 1;
+            }
+        }
+    }
+
+    // 计算资源包的总大小
+    size_t table_off = sizeof( pack_header );
+    size_t entry_off = align8( table_off + sizeof( uint32_t ) * ( buckets + slots ) );
+    size_t data_off = entry_off + sizeof( pack_entry ) * count;
+    size_t size = data_off;
+    for( uint32_t i = 0; i < count; ++i ) {
+        size += items[ i ].url.size() + items[ i ].header.size() + items[ i ].body.size();
+    }
+
+    // 在一块匿名映射中生成资源包（开启大页时是大页），完成后设置为只读
+    char* base = ( char* )alloc_on_node( size, -1 );
+    if( !base ) {
+        return false;
+    }
+    pack_header* header = ( pack_header* )base;
+    memcpy( header->magic, PACK_MAGIC, sizeof( PACK_MAGIC ) );
+    header->count = count;
+    header->buckets = buckets;
+    header->slots = slots;
+    header->reserved = 0;
+    header->total_size = size;
+    memcpy( base + table_off, &disp[ 0 ], sizeof( uint32_t ) * buckets );
+    memcpy( base + table_off + sizeof( uint32_t ) * buckets, &slot[ 0 ], sizeof( uint32_t ) * slots );
+    pack_entry* entries = ( pack_entry* )( base + entry_off );
+    size_t off = data_off;
+    for( uint32_t i = 0; i < count; ++i ) {
+        const pack_item& item = items[ i ];
+        entries[ i ].url_off = off;
+        entries[ i ].url_len = item.url.size();
+        memcpy( base + off, item.url.data(), item.url.size() );
+        off += item.url.size();
+        entries[ i ].header_off = off;
+        entries[ i ].header_len = item.header.size();
+        memcpy( base + off, item.header.data(), item.header.size() );
+        off += item.header.size();
+        entries[ i ].body_off = off;
+        entries[ i ].body_len = item.body.size();
+        memcpy( base + off, item.body.data(), item.body.size() );
+        off += item.body.size();
+    }
+    mprotect( base, node_alloc_size( size ), PROT_READ );
+
+    release();
+    if( !attach( base, size ) ) {
+        free_on_node( base, size );
+        return false;
+    }
+    m_allocated = true;
+    return true;
+}
+
+// 把资源包保存成文件
+bool asset_bundle::save( const char* pack_path ) const {
+    if( !m_base ) {
+        return false;
+    }
+    int fd = open( pack_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 ) {
+        return false;
+    }
+    size_t written = 0;
+    while( written < m_size ) {
+        ssize_t n = write( fd, m_base + written, m_size - written );
+        if( n <= 0 ) {
+            close( fd );
+            return false;
+        }
+        written += n;
+    }
+    close( fd );
+    return true;
+}
+
+// 开启大页时把资源包文件读入大页内存中（文件的映射只能用普通页）
+static char* read_into_huge_pages( int fd, size_t size ) {
+    char* base = ( char* )alloc_on_node( size, -1 );
+    if( !base ) {
+        return NULL;
+    }
+    size_t done = 0;
+    while( done < size ) {
+        ssize_t n = read( fd, base + done, size - done );
+        if( n <= 0 ) {
+            free_on_node( base, size );
+            return NULL;
+        }
+        done += n;
+    }
+    mprotect( base, node_alloc_size( size ), PROT_READ );
+    return base;
+}
+
+// 加载资源包文件：启动时只需要一次mmap
+// 加上MAP_POPULATE，把文件内容一次性读入内存，之后处理请求时就不会缺页了
+bool asset_bundle::load( const char* pack_path ) {
+    int fd = open( pack_path, O_RDONLY );
+    if( fd < 0 ) {
+        return false;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) < 0 || st.st_size < ( off_t )sizeof( pack_header ) ) {
+        close( fd );
+        return false;
+    }
+    if( huge_pages_enabled() ) {
+        char* base = read_into_huge_pages( fd, st.st_size );
+        close( fd );
+        if( !base ) {
+            return false;
+        }
+        release();
+        if( !attach( base, st.st_size ) ) {
+            free_on_node( base, st.st_size );
+            return false;
+        }
+        m_allocated = true;
+        return true;
+    }
+    char* base = ( char* )mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0 );
+    close( fd );
+    if( base == MAP_FAILED ) {
+        return false;
+    }
+    release();
+    if( !attach( base, st.st_size ) ) {
+        munmap( base, st.st_size );
+        return false;
+    }
+    return true;
+}
+
+// 检查资源包的内容是否完整，并设置各个指针
+bool asset_bundle::attach( char* base, size_t size ) {
+    const pack_header* header = ( const pack_header* )base;
+    if( memcmp( header->magic, PACK_MAGIC, sizeof( PACK_MAGIC ) ) != 0 || header->total_size != size
+            || header->buckets == 0 || header->slots == 0 ) {
+        return false;
+    }
+    size_t table_off = sizeof( pack_header );
+    size_t entry_off = align8( table_off + sizeof( uint32_t ) * ( ( size_t )header->buckets + header->slots ) );
+    size_t data_off = entry_off + sizeof( pack_entry ) * ( size_t )header->count;
+    if( data_off > size ) {
+        return false;
+    }
+    const pack_entry* entries = ( const pack_entry* )( base + entry_off );
+    for( uint32_t i = 0; i < header->count; ++i ) {
+        if( entries[ i ].url_off + entries[ i ].url_len > size
+                || entries[ i ].header_off + entries[ i ].header_len > size
+                || entries[ i ].body_off + entries[ i ].body_len > size ) {
+            return false;
+        }
+    }
+    const uint32_t* slot = ( const uint32_t* )( base + table_off ) + header->buckets;
+    for( uint32_t i = 0; i < header->slots; ++i ) {
+        if( slot[ i ] > header->count ) {
+            return false;
+        }
+    }
+    m_base = base;
+    m_size = size;
+    m_header = header;
+    m_disp = ( const uint32_t* )( base + table_off );
+    m_slot = slot;
+    m_entries = entries;
+    return true;
+}
+
+void asset_bundle::release() {
+    if( m_base && m_allocated ) {
+        free_on_node( m_base, m_size );
+    } else if( m_base ) {
+        munmap( m_base, m_size );
+    }
+    m_base = NULL;
+    m_size = 0;
+    m_allocated = false;
+    m_header = NULL;
+    m_disp = NULL;
+    m_slot = NULL;
+    m_entries = NULL;
+}
+
+// 查找url：算出所在的桶，用桶的偏移量算出在哈希表中的位置，再比较一次url确认
+bool asset_bundle::find( const char* url, int len, asset& out ) const {
+    if( !m_base ) {
+        return false;
+    }
+    uint32_t d = m_disp[ hash( url, len, 0 ) % m_header->buckets ];
+    if( d == 0 ) {
+        return false;
+    }
+    uint32_t idx = m_slot[ hash( url, len, d ) % m_header->slots ];
+    if( idx == 0 ) {
+        return false;
+    }
+    const pack_entry& e = m_entries[ idx - 1 ];
+    if( ( int )e.url_len != len || memcmp( m_base + e.url_off, url, len ) != 0 ) {
+        return false;
+    }
+    out.url = m_base + e.url_off;
+    out.url_len = e.url_len;
+    out.header = m_base + e.header_off;
+    out.header_len = e.header_len;
+    out.body = m_base + e.body_off;
+    out.body_len = e.body_len;
+    return true;
+}
+
+// 资源数量
+uint32_t asset_bundle::count() const {
+    return m_header ? m_header->count : 0;
+}
@@ -0,0 +1,82 @@
+#ifndef ASSET_BUNDLE_H
+#define ASSET_BUNDLE_H
+
+// 静态资源包类
+// 网站的资源目录一般很小而且不会变化，这个类在启动时把整个资源目录打包进一块连续的只读内存（或者直接mmap
+// 一个事先打好的资源包文件），并建立一个从url到资源的完美哈希表。
+// 查找一个url只需要算两次哈希、比较一次字符串，不需要任何系统调用；
+// 每个资源的响应行和Content-Length、Content-Type响应头也事先生成好了，处理请求时直接拷贝即可。
+//
+// 资源包的内存布局（资源包文件也是同样的格式）：
+//   pack_header                        文件头
+//   uint32_t disp[ buckets ]           每个桶的偏移量（哈希-偏移法构造完美哈希）
+//   uint32_t slot[ slots ]             哈希表，值为资源下标+1，0表示空位
+//   pack_entry entry[ count ]          资源表
+//   数据区                              url、预先生成的响应头、文件内容
+
+#include <stddef.h>
+#include <stdint.h>
+
+class asset_bundle {
+public:
+    // 一个资源：url、预先生成的响应头（响应行 + Content-Length + Content-Type）和文件内容
+    struct asset {
+        const char* url;
+        int url_len;
+        const char* header;
+        int header_len;
+        const char* body;
+        size_t body_len;
+    };
+
+public:
+    asset_bundle();
+    ~asset_bundle();
+
+    // 把doc_root目录下所有对其他用户可读的普通文件打包进内存，成功返回true
+    bool build( const char* doc_root );
+    // 把资源包保存成文件，之后可以用load直接加载
+    bool save( const char* pack_path ) const;
+    // 加载（mmap）资源包文件，成功返回true；开启了大页时把文件读入大页内存中
+    bool load( const char* pack_path );
+
+    // 查找url（长度为len，不需要以'\0'结尾），找不到返回false
+    bool find( const char* url, int len, asset& out ) const;
+    // 资源数量
+    uint32_t count() const;
+
+private:
+    struct pack_header {
+        char magic[ 8 ];        // "WSPACK1"
+        uint32_t count;         // 资源数量
+        uint32_t buckets;       // 桶的数量
+        uint32_t slots;         // 哈希表的大小
+        uint32_t reserved;
+        uint64_t total_size;    // 整个资源包的大小
+    };
+    struct pack_entry {
+        uint64_t url_off;
+        uint64_t header_off;
+        uint64_t body_off;
+        uint64_t body_len;
+        uint32_t url_len;
+        uint32_t header_len;
+    };
+
+    // 带种子的FNV-1a哈希
+    static uint32_t hash( const char* key, int len, uint32_t seed );
+    // 检查资源包的内容是否完整，并设置下面的各个指针
+    bool attach( char* base, size_t size );
+    void release();
+
+private:
+    char* m_base;               // 资源包所在的内存（只读）
+    size_t m_size;              // 资源包的大小
+    bool m_allocated;           // m_base是alloc_on_node分配的（build生成的，或者读入大页内存的资源包文件），否则是文件的映射
+    const pack_header* m_header;
+    const uint32_t* m_disp;
+    const uint32_t* m_slot;
+    const pack_entry* m_entries;
+};
+
+#endif
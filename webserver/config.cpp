@@ -0,0 +1,485 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <atomic>
+#include "affinity.h"
+#include "http_conn.h"
+
+// 网站的根目录，定义在http_conn.cpp中
+extern const char* doc_root;
+
+// 每一项的名字、默认值和允许的范围
+struct config_item {
+    const char* name;
+    int def;
+    int min;
+    int max;
+};
+static const config_item items[ server_config::ITEMS ] = {
+    { "threads",      8,     1,    1024 },      // 工作线程数（-e开启弹性线程池时为初始线程数）
+    { "queue_size",   10000, 1,    10000000 },  // 请求队列中最多等待的任务数
+    { "read_buffer",  2048,  1024, 1 << 20 },   // 每个连接的读缓冲区大小（请求行和请求头必须能放下）
+    { "write_buffer", 1024,  512,  1 << 20 },   // 每个连接的写缓冲区大小（响应行和响应头）
+    { "max_fd",       65536, 64,   1 << 24 },   // 最大的文件描述符个数（同时也是最大连接数）
+    { "max_events",   10000, 1,    1 << 20 },   // 每轮epoll_wait最多返回的事件数
+    { "warm_budget_mb", 256, 0,    1 << 20 },   // 启动时按热点文件清单（-M）预热的文件总大小上限（MB）
+    { "manifest_interval", 60, 1,  86400 },     // 每隔多少秒保存一次热点文件清单
+};
+
+
+server_config::server_config() : m_doc_root_source( "default" ), m_auto_tune( AUTO_OFF ) {
+    for( int i = 0; i < ITEMS; ++i ) {
+        m_values[i] = -1;
+        m_source[i] = "default";
+    }
+}
+
+bool server_config::set( const char* key, const char* value ) {
+    if( strcmp( key, "doc_root" ) == 0 ) {
+        std::string dir( value );
+        while( dir.size() > 1 && dir[ dir.size() - 1 ] == '/' ) {
+            dir.erase( dir.size() - 1 );    // url以/开头，根目录不要以/结尾
+        }
+        // 目标文件的完整路径（根目录 + url）放在FILENAME_LEN大小的数组中，根目录太长时url就放不下了
+        if( dir.empty() || dir.size() >= ( size_t )http_conn::FILENAME_LEN / 2 ) {
+            printf( "bad doc_root: %s\n", value );
+            return false;
+        }
+        m_doc_root = dir;
+        m_doc_root_source = "config";
+        return true;
+    }
+    if( strcmp( key, "auto_tune" ) == 0 ) {
+        if( strcmp( value, "off" ) == 0 ) {
+            m_auto_tune = AUTO_OFF;
+        } else if( strcmp( value, "on" ) == 0 ) {
+            m_auto_tune = AUTO_ON;
+        } else if( strcmp( value, "calibrate" ) == 0 ) {
+            m_auto_tune = AUTO_CALIBRATE;
+        } else {
+            printf( "bad auto_tune: %s (off, on or calibrate)\n", value );
+            return false;
+        }
+        return true;
+    }
+    for( int i = 0; i < ITEMS; ++i ) {
+        if( strcmp( key, items[i].name ) == 0 ) {
+            char* end;
+            errno = 0;
+            long v = strtol( value, &end, 10 );
+            // 允许k、m后缀（缓冲区大小常用）
+            if( *end == 'k' || *end == 'K' ) {
+                v *= 1024;
+                ++end;
+            } else if( *end == 'm' || *end == 'M' ) {
+                v *= 1024 * 1024;
+                ++end;
+            }
+            if( errno || end == value || *end || v < items[i].min || v > items[i].max ) {
+                printf( "bad %s: %s (%d-%d)\n", key, value, items[i].min, items[i].max );
+                return false;
+            }
+            m_values[i] = v;
+            m_source[i] = "config";
+            return true;
+        }
+    }
+    printf( "unknown config key: %s\n", key );
+    return false;
+}
+
+bool server_config::load( const char* file ) {
+    FILE* fp = fopen( file, "r" );
+    if( !fp ) {
+        printf( "open config file %s failed: %s\n", file, strerror( errno ) );
+        return false;
+    }
+    char line[ 512 ];
+    int lineno = 0;
+    bool ok = true;
+    while( ok && fgets( line, sizeof( line ), fp ) ) {
+        ++lineno;
+        // 去掉注释和首尾的空白
+        char* p = strchr( line, '#' );
+        if( p ) {
+            *p = '\0';
+        }
+        char* key = line + strspn( line, " \t\r\n" );
+        char* end = key + strlen( key );
+        while( end > key && strchr( " \t\r\n", end[-1] ) ) {
+            *--end = '\0';
+        }
+        if( *key == '\0' ) {
+            continue;
+        }
+        char* eq = strchr( key, '=' );
+        if( !eq ) {
+            printf( "%s:%d: expected key = value\n", file, lineno );
+            ok = false;
+            break;
+        }
+        char* value = eq + 1 + strspn( eq + 1, " \t" );
+        do {
+            *eq-- = '\0';
+        } while( eq >= key && ( *eq == ' ' || *eq == '\t' ) );
+        if( !set( key, value ) ) {
+            printf( "%s:%d: invalid line\n", file, lineno );
+            ok = false;
+        }
+    }
+    fclose( fp );
+    return ok;
+}
+
+// 可以使用的CPU数量：本进程的CPU亲和性掩码中的CPU数，再受cgroup v2的CPU配额（cpu.max）限制
+static int usable_cpus( int& quota_cpus ) {
+    cpu_set_t set;
+    int cpus = 0;
+    if( sched_getaffinity( 0, sizeof( set ), &set ) == 0 ) {
+        cpus = CPU_COUNT( &set );
+    }
+    if( cpus <= 0 ) {
+        cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    }
+    quota_cpus = 0;
+    FILE* fp = fopen( "/sys/fs/cgroup/cpu.max", "r" );
+    if( fp ) {
+        char quota[ 32 ];
+        long period = 0;
+        // 格式：配额 周期（微秒），没有限制时配额为max
+        if( fscanf( fp, "%31s %ld", quota, &period ) == 2 && strcmp( quota, "max" ) != 0 && period > 0 ) {
+            quota_cpus = ( atol( quota ) + period - 1 ) / period;
+        }
+        fclose( fp );
+    }
+    if( quota_cpus > 0 && quota_cpus < cpus ) {
+        cpus = quota_cpus;
+    }
+    return cpus > 0 ? cpus : 1;
+}
+
+// NUMA节点的数量（/sys/devices/system/node/online的格式和CPU列表相同，比如0-1）
+static int numa_nodes() {
+    FILE* fp = fopen( "/sys/devices/system/node/online", "r" );
+    if( !fp ) {
+        return 1;
+    }
+    char text[ 128 ] = "";
+    std::vector< int > nodes;
+    if( fgets( text, sizeof( text ), fp ) ) {
+        text[ strcspn( text, "\n" ) ] = '\0';
+        parse_cpu_list( text, nodes );
+    }
+    fclose( fp );
+    return nodes.empty() ? 1 : ( int )nodes.size();
+}
+
+// 可以使用的内存：物理内存，再受cgroup v2的内存上限（memory.max）限制
+static unsigned long long usable_memory() {
+    unsigned long long mem = ( unsigned long long )sysconf( _SC_PHYS_PAGES ) * sysconf( _SC_PAGE_SIZE );
+    FILE* fp = fopen( "/sys/fs/cgroup/memory.max", "r" );
+    if( fp ) {
+        char limit[ 32 ];
+        if( fscanf( fp, "%31s", limit ) == 1 && strcmp( limit, "max" ) != 0 ) {
+            unsigned long long v = strtoull( limit, NULL, 10 );
+            if( v > 0 && v < mem ) {
+                mem = v;
+            }
+        }
+        fclose( fp );
+    }
+    return mem;
+}
+
+// 不超过v的最大的2的幂
+static int floor_pow2( long long v ) {
+    int p = 1;
+    while( ( long long )p * 2 <= v && p < ( 1 << 30 ) ) {
+        p *= 2;
+    }
+    return p;
+}
+
+static int clamp( long long v, int lo, int hi ) {
+    return v < lo ? lo : ( v > hi ? hi : ( int )v );
+}
+
+void server_config::tune( size_t conn_size ) {
+    int quota_cpus = 0;
+    int cpus = usable_cpus( quota_cpus );
+    int nodes = numa_nodes();
+    unsigned long long mem = usable_memory();
+
+    // 文件描述符：把软限制提高到硬限制，连接数不超过它
+    struct rlimit rl;
+    int nofile = 1024;
+    if( getrlimit( RLIMIT_NOFILE, &rl ) == 0 ) {
+        rlim_t soft = rl.rlim_cur;
+        if( rl.rlim_cur < rl.rlim_max ) {
+            rl.rlim_cur = rl.rlim_max;
+            if( setrlimit( RLIMIT_NOFILE, &rl ) != 0 ) {
+                rl.rlim_cur = soft;
+            }
+        }
+        nofile = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > ( rlim_t )items[ MAX_FD ].max
+                 ? items[ MAX_FD ].max : ( int )rl.rlim_cur;
+        if( rl.rlim_cur != soft ) {
+            printf( "auto-tune: open files limit raised from %llu to %llu\n", ( unsigned long long )soft,
+                    ( unsigned long long )rl.rlim_cur );
+        }
+    }
+    printf( "auto-tune: %d usable cpus%s, %d numa node(s), %.1f GB memory\n", cpus,
+            quota_cpus > 0 ? " (cgroup quota)" : "", nodes, mem / 1073741824.0 );
+
+    // 工作线程：每个可用的CPU一个；校准时取吞吐量不再增长的线程数
+    if( m_values[ THREADS ] < 0 ) {
+        int threads = cpus;
+        m_source[ THREADS ] = "auto";
+        if( m_auto_tune == AUTO_CALIBRATE ) {
+            int knee = calibrate_threads( cpus * 2 );
+            if( knee > 0 ) {
+                threads = knee;
+                m_source[ THREADS ] = "calibrated";
+            }
+        }
+        m_values[ THREADS ] = clamp( threads, 1, items[ THREADS ].max );
+    }
+
+    // 连接相关的内存（http_conn数组和读写缓冲区）最多用可用内存的1/4
+    unsigned long long budget = mem / 4;
+    if( m_values[ MAX_FD ] < 0 ) {
+        unsigned long long min_conn = conn_size + items[ READ_BUFFER ].def + items[ WRITE_BUFFER ].def;
+        unsigned long long by_mem = budget / min_conn;
+        m_values[ MAX_FD ] = clamp( nofile < ( long long )by_mem ? nofile : by_mem, items[ MAX_FD ].min, items[ MAX_FD ].max );
+        m_source[ MAX_FD ] = "auto";
+    }
+    // 读写缓冲区：连接数确定之后，每个连接能分到的内存的2/3给读缓冲区（能接收更长的请求头，更少的read调用），
+    // 1/3给写缓冲区，都取2的幂，限制在默认值和16KB/4KB之间
+    long long per_conn = ( long long )( budget / m_values[ MAX_FD ] ) - ( long long )conn_size;
+    if( m_values[ READ_BUFFER ] < 0 ) {
+        m_values[ READ_BUFFER ] = clamp( floor_pow2( per_conn * 2 / 3 ), items[ READ_BUFFER ].def, 16384 );
+        m_source[ READ_BUFFER ] = "auto";
+    }
+    if( m_values[ WRITE_BUFFER ] < 0 ) {
+        m_values[ WRITE_BUFFER ] = clamp( floor_pow2( per_conn / 3 ), items[ WRITE_BUFFER ].def, 4096 );
+        m_source[ WRITE_BUFFER ] = "auto";
+    }
+    // 请求队列：每个线程1024个任务，不超过连接数（每个连接最多只有一个任务在排队）
+    if( m_values[ QUEUE_SIZE ] < 0 ) {
+        long long q = ( long long )m_values[ THREADS ] * 1024;
+        m_values[ QUEUE_SIZE ] = clamp( q < m_values[ MAX_FD ] ? q : m_values[ MAX_FD ], 1, items[ QUEUE_SIZE ].max );
+        m_source[ QUEUE_SIZE ] = "auto";
+    }
+    // 每轮epoll_wait的事件数：每个工作线程128个，一轮收集的任务足够所有线程忙一阵子，
+    // 再多只会推迟下一轮对新连接和写事件的处理
+    if( m_values[ MAX_EVENTS ] < 0 ) {
+        m_values[ MAX_EVENTS ] = clamp( ( long long )m_values[ THREADS ] * 128, 512, items[ MAX_EVENTS ].def );
+        m_source[ MAX_EVENTS ] = "auto";
+    }
+}
+
+void server_config::finish( size_t conn_size ) {
+    if( m_auto_tune != AUTO_OFF ) {
+        tune( conn_size );
+    }
+    for( int i = 0; i < ITEMS; ++i ) {
+        if( m_values[i] < 0 ) {
+            m_values[i] = items[i].def;
+        }
+    }
+    if( m_doc_root.empty() ) {
+        m_doc_root = ::doc_root;
+    }
+    struct stat st;
+    if( stat( m_doc_root.c_str(), &st ) != 0 || !S_ISDIR( st.st_mode ) ) {
+        printf( "warning: doc_root %s is not a directory\n", m_doc_root.c_str() );
+    }
+    printf( "config:" );
+    for( int i = 0; i < ITEMS; ++i ) {
+        printf( " %s=%d(%s)", items[i].name, m_values[i], m_source[i] );
+    }
+    printf( " doc_root=%s(%s)\n", m_doc_root.c_str(), m_doc_root_source );
+    fflush( stdout );
+}
+
+
+// ---------------- 回环校准
+// 每个线程在自己的一对回环TCP连接上做“64字节请求、512字节响应”的乒乓（一个线程同时扮演两端），
+// 测量一段时间内所有线程完成的次数。这个负载和处理小请求一样，主要花在系统调用和协议栈上，
+// 线程数超过实际能用的CPU（cgroup配额、超线程的兄弟核）之后总吞吐量就不再增长了
+
+static const int CALIBRATE_MS = 80;     // 每个线程数测量的时间
+
+struct calibrate_worker {
+    int client;
+    int server;
+    long long rounds;
+    std::atomic< int >* start;      // 0：等待，1：开始，-1：放弃
+};
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( long long )ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 读满n字节
+static bool read_full( int fd, char* buf, int n ) {
+    while( n > 0 ) {
+        int r = recv( fd, buf, n, 0 );
+        if( r <= 0 ) {
+            return false;
+        }
+        buf += r;
+        n -= r;
+    }
+    return true;
+}
+
+static void* calibrate_run( void* arg ) {
+    calibrate_worker* w = ( calibrate_worker* )arg;
+    char request[ 64 ];
+    char response[ 512 ];
+    memset( request, 'q', sizeof( request ) );
+    memset( response, 'r', sizeof( response ) );
+    int go;
+    while( ( go = w->start->load( std::memory_order_acquire ) ) == 0 ) {
+        sched_yield();
+    }
+    if( go < 0 ) {
+        return NULL;
+    }
+    long long deadline = now_ns() + CALIBRATE_MS * 1000000LL;
+    long long rounds = 0;
+    while( true ) {
+        if( send( w->client, request, sizeof( request ), 0 ) != sizeof( request )
+                || !read_full( w->server, request, sizeof( request ) )
+                || send( w->server, response, sizeof( response ), 0 ) != sizeof( response )
+                || !read_full( w->client, response, sizeof( response ) ) ) {
+            break;
+        }
+        // 每64次检查一次时间
+        if( ( ++rounds & 63 ) == 0 && now_ns() >= deadline ) {
+            break;
+        }
+    }
+    w->rounds = rounds;
+    return NULL;
+}
+
+// 用threads个线程测量，返回每秒完成的次数，失败返回-1
+// 先建立好所有的连接、创建好所有的线程，再让它们同时开始
+static double loopback_rate( int listenfd, const sockaddr_in& addr, int threads ) {
+    std::vector< calibrate_worker > workers( threads );
+    std::vector< pthread_t > tids;
+    std::atomic< int > start( 0 );
+    bool ok = true;
+    for( int i = 0; i < threads; ++i ) {
+        workers[i].server = -1;
+        workers[i].rounds = 0;
+        workers[i].start = &start;
+        workers[i].client = socket( AF_INET, SOCK_STREAM, 0 );
+    }
+    for( int i = 0; i < threads && ok; ++i ) {
+        if( workers[i].client < 0 || connect( workers[i].client, ( const sockaddr* )&addr, sizeof( addr ) ) != 0
+                || ( workers[i].server = accept( listenfd, NULL, NULL ) ) < 0 ) {
+            ok = false;
+            break;
+        }
+        int one = 1;
+        setsockopt( workers[i].client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+        setsockopt( workers[i].server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    }
+    for( int i = 0; i < threads && ok; ++i ) {
+        pthread_t tid;
+        if( pthread_create( &tid, NULL, calibrate_run, &workers[i] ) != 0 ) {
+            ok = false;
+            break;
+        }
+        tids.push_back( tid );
+    }
+    long long begin = now_ns();
+    start.store( ok ? 1 : -1, std::memory_order_release );
+    long long total = 0;
+    for( size_t i = 0; i < tids.size(); ++i ) {
+        pthread_join( tids[i], NULL );
+        total += workers[i].rounds;
+    }
+    double rate = ok ? total * 1e9 / ( now_ns() - begin ) : -1;
+    for( int i = 0; i < threads; ++i ) {
+        if( workers[i].client >= 0 ) {
+            close( workers[i].client );
+        }
+        if( workers[i].server >= 0 ) {
+            close( workers[i].server );
+        }
+    }
+    return rate;
+}
+
+// 从1个线程开始，每次加倍（最后一次为max_threads），找到吞吐量不再明显增长的线程数：
+// 取达到最大吞吐量90%的最少线程数，失败返回-1
+int server_config::calibrate_threads( int max_threads ) {
+    int listenfd = socket( AF_INET, SOCK_STREAM, 0 );
+    sockaddr_in addr;
+    socklen_t len = sizeof( addr );
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    addr.sin_port = 0;      // 随便一个空闲端口
+    if( listenfd < 0 || bind( listenfd, ( sockaddr* )&addr, sizeof( addr ) ) != 0
+            || listen( listenfd, 1024 ) != 0 || getsockname( listenfd, ( sockaddr* )&addr, &len ) != 0 ) {
+        printf( "calibration: loopback socket failed: %s\n", strerror( errno ) );
+        if( listenfd >= 0 ) {
+            close( listenfd );
+        }
+        return -1;
+    }
+    if( max_threads > 64 ) {
+        max_threads = 64;
+    }
+    std::vector< int > counts;
+    std::vector< double > rates;
+    double best = 0;
+    for( int t = 1; ; t = t * 2 < max_threads ? t * 2 : max_threads ) {
+        double rate = loopback_rate( listenfd, addr, t );
+        if( rate < 0 ) {
+            break;
+        }
+        printf( "calibration: %d thread(s) %.0f round trips/s\n", t, rate );
+        counts.push_back( t );
+        rates.push_back( rate );
+        if( rate > best ) {
+            best = rate;
+        }
+        // 加倍线程之后吞吐量没有增长，再多线程也不会更快了
+        if( t >= max_threads || ( rates.size() > 1 && rate < rates[ rates.size() - 2 ] * 1.05 ) ) {
+            break;
+        }
+    }
+    close( listenfd );
+    if( counts.empty() ) {
+        return -1;
+    }
+    for( size_t i = 0; i < counts.size(); ++i ) {
+        if( rates[i] >= best * 0.9 ) {
+            printf( "calibration: throughput stops scaling at %d thread(s)\n", counts[i] );
+            return counts[i];
+        }
+    }
+    return counts.back();
+}
@@ -0,0 +1,51 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// 服务器的配置：线程数、请求队列长度、读写缓冲区大小、最大连接数、每轮epoll_wait的事件数和资源目录
+// 以前这些都是编译时的常量或者构造函数的默认参数，换一台机器就要改代码重新编译。
+//
+// 配置的来源（后面的覆盖前面的）：
+//   1. 默认值（和以前的常量相同）
+//   2. 自动调优（-a，或者配置文件中auto_tune = on）：启动时查看CPU数量（包括cgroup的CPU配额）、NUMA节点、
+//      RLIMIT_NOFILE和内存大小，算出合适的值；auto_tune = calibrate（-A）时再用几百毫秒做一次回环校准，
+//      测量线程数增加到多少时吞吐量不再增长（能发现cgroup配额、超线程等看不出来的限制）
+//   3. 配置文件（-C file，每行 key = value，#开头的行是注释）和命令行（-S key=value、-t、-d），按出现的顺序
+// 只有没有明确设置的值才会被自动调优，最终的值和它的来源在启动时打印出来。
+
+#include <stddef.h>
+#include <string>
+
+class server_config {
+public:
+    enum AUTO_TUNE { AUTO_OFF = 0, AUTO_ON, AUTO_CALIBRATE };
+
+    // 可以配置的整数项（顺序和config.cpp中的表一致）
+    enum ITEM { THREADS = 0, QUEUE_SIZE, READ_BUFFER, WRITE_BUFFER, MAX_FD, MAX_EVENTS, WARM_BUDGET_MB, MANIFEST_INTERVAL, ITEMS };
+
+public:
+    server_config();
+
+    // 读取配置文件，出错时打印出错的行并返回false
+    bool load( const char* file );
+    // 设置一项配置（key = value），名字或者值不合法时打印原因并返回false
+    bool set( const char* key, const char* value );
+    // 命令行参数都处理完之后调用：按需自动调优，其余没有设置的项使用默认值，然后打印最终的配置
+    // conn_size为每个连接除了读写缓冲区之外占用的内存（sizeof(http_conn)），用于按内存大小限制连接数
+    void finish( size_t conn_size );
+
+    int get( ITEM item ) const { return m_values[ item ]; }
+    const char* doc_root() const { return m_doc_root.c_str(); }
+
+private:
+    void tune( size_t conn_size );
+    int calibrate_threads( int max_threads );
+
+private:
+    int m_values[ ITEMS ];          // -1表示还没有设置
+    const char* m_source[ ITEMS ];  // 每一项的来源：default、auto、config
+    std::string m_doc_root;
+    const char* m_doc_root_source;
+    int m_auto_tune;
+};
+
+#endif
@@ -0,0 +1,373 @@
+#include "file_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include "affinity.h"
+
+// 缓存中的一段文件内容。缓存本身持有一个引用，每个正在使用它的响应各持有一个引用
+struct file_cache::content {
+    char* addr;                 // 文件内容的拷贝
+    arena_chunk* chunk;         // 所在的大页内存块，不在大页内存块中时为NULL
+    std::atomic< int > refs;
+};
+
+// 文件的大小、修改时间或者inode和加入缓存时不同，就认为文件变了
+static bool same_file( const struct stat& a, const struct stat& b ) {
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size &&
+           a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+file_cache::file_cache() : m_total_size( 0 ), m_arena( false ), m_current( NULL ), m_allocating( 0 ), m_lock( "file_cache" ) {
+}
+
+// 析构时释放所有缓存的文件内容（和大页内存块）
+// 服务器退出时才析构，不再有响应引用这些内容
+file_cache::~file_cache() {
+    std::unordered_map< std::string, entry >::iterator it;
+    for( it = m_entries.begin(); it != m_entries.end(); ++it ) {
+        if( !it->second.data->chunk ) {
+            free( it->second.data->addr );
+        }
+        delete it->second.data;
+    }
+    for( size_t i = 0; i < m_chunks.size(); ++i ) {
+        free_on_node( m_chunks[i]->base, ARENA_CHUNK );
+        delete m_chunks[i];
+    }
+}
+
+// 查找path对应的文件
+bool file_cache::lookup( const char* path, char*& addr, struct stat& st, content*& ref, bool revalidate ) {
+    std::string key( path );
+    time_t now = time( NULL );
+    m_lock.lock();
+    std::unordered_map< std::string, entry >::iterator it = m_entries.find( key );
+    if( it == m_entries.end() ) {
+        m_lock.unlock();
+        return false;
+    }
+    if( now - it->second.checked >= REVALIDATE_INTERVAL ) {
+        if( !revalidate ) {
+            m_lock.unlock();
+            return false;
+        }
+        // 很久没有检查了，和磁盘上的文件比较一下（stat放在锁外面）
+        struct stat cached = it->second.st;
+        m_lock.unlock();
+        struct stat current;
+        bool unchanged = stat( path, &current ) == 0 && same_file( cached, current );
+        m_lock.lock();
+        it = m_entries.find( key );
+        if( it == m_entries.end() ) {
+            m_lock.unlock();
+            return false;
+        }
+        if( !unchanged ) {
+            retire( it );
+            m_lock.unlock();
+            return false;
+        }
+        it->second.checked = now;
+    }
+    addr = it->second.data->addr;
+    st = it->second.st;
+    ref = it->second.data;
+    ref->refs.fetch_add( 1, std::memory_order_relaxed );
+    ++it->second.hits;
+    m_lock.unlock();
+    return true;
+}
+
+// 只判断path是否在缓存中，并且最近检查过
+bool file_cache::contains( const char* path ) {
+    time_t now = time( NULL );
+    m_lock.lock();
+    std::unordered_map< std::string, entry >::iterator it = m_entries.find( path );
+    bool found = it != m_entries.end() && now - it->second.checked < REVALIDATE_INTERVAL;
+    m_lock.unlock();
+    return found;
+}
+
+// 释放一个引用，最后一个引用释放时释放内容
+// 缓存自己持有一个引用，所以走到这里的内容一定已经从缓存中删除了
+void file_cache::release( content* ref ) {
+    if( ref->refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+        if( ref->chunk ) {
+            m_lock.lock();
+            destroy( ref );
+            m_lock.unlock();
+        } else {
+            destroy( ref );
+        }
+    }
+}
+
+// 大页内存块中的内容不单独释放，只是计数
+void file_cache::destroy( content* data ) {
+    if( data->chunk ) {
+        put_chunk( data->chunk );
+    } else {
+        free( data->addr );
+    }
+    delete data;
+}
+
+// 块中的内容全部释放之后，整块从头重新使用
+// （不munmap：release可能在主线程中调用，块的数量本身也有上限）
+void file_cache::put_chunk( arena_chunk* chunk ) {
+    if( --chunk->live == 0 ) {
+        chunk->used = 0;
+        if( chunk != m_current ) {
+            m_free_chunks.push_back( chunk );
+        }
+    }
+}
+
+// 从当前的大页内存块中预留一段（按缓存行对齐），拷贝在锁外面进行
+// 当前块不够时换一块：优先用已经空出来的块，没有的话分配一块；文件不超过MAX_FILE_SIZE，一块一定放得下。
+// 分配新块要mmap（预留的大页还要在内核中清零2MB），放在锁外面，不让所有访问缓存的线程都等着
+bool file_cache::reserve( const char* path, off_t size, char*& copy, arena_chunk*& chunk ) {
+    size_t need = ( size + 63 ) & ~( size_t )63;
+    m_lock.lock();
+    while( m_total_size + size <= MAX_TOTAL_SIZE && !m_entries.count( path ) ) {
+        if( m_current && m_current->used + need <= ARENA_CHUNK ) {
+            chunk = m_current;
+            copy = chunk->base + chunk->used;
+            chunk->used += need;
+            ++chunk->live;
+            m_lock.unlock();
+            return true;
+        }
+        if( !m_free_chunks.empty() ) {
+            // 换下来的块里还有内容（空的块在used归零时就可以继续用了，不会走到这里），等它们都释放之后再回到空闲列表
+            m_current = m_free_chunks.back();
+            m_free_chunks.pop_back();
+            continue;
+        }
+        if( m_chunks.size() + m_allocating >= MAX_CHUNKS ) {
+            break;
+        }
+        ++m_allocating;
+        m_lock.unlock();
+        char* base = ( char* )alloc_on_node( ARENA_CHUNK, -1 );
+        m_lock.lock();
+        --m_allocating;
+        if( !base ) {
+            break;
+        }
+        arena_chunk* fresh = new arena_chunk;
+        fresh->base = base;
+        fresh->used = 0;
+        fresh->live = 0;
+        m_chunks.push_back( fresh );
+        m_free_chunks.push_back( fresh );
+    }
+    // 缓存满了，或者别的线程已经把这个文件加进来了，或者分配不到内存
+    m_lock.unlock();
+    return false;
+}
+
+// 从缓存中删除一项，它的大小马上从总大小中减去，内容在最后一个引用释放时才释放
+void file_cache::retire( std::unordered_map< std::string, entry >::iterator it ) {
+    content* data = it->second.data;
+    m_total_size -= it->second.st.st_size;
+    m_entries.erase( it );
+    if( data->refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+        destroy( data );    // 已经持有锁
+    }
+}
+
+// 尝试把已经映射好的文件加入缓存
+bool file_cache::insert( const char* path, char*& addr, const struct stat& st, content** ref ) {
+    if( st.st_size > MAX_FILE_SIZE ) {
+        // 文件太大不缓存，但记下它的大小（每个请求都会走到这里，顺便计数）
+        m_lock.lock();
+        std::unordered_map< std::string, size_hint >::iterator hint = m_size_hints.find( path );
+        if( hint != m_size_hints.end() ) {
+            hint->second.size = st.st_size;
+            ++hint->second.hits;
+        } else if( m_size_hints.size() < MAX_SIZE_HINTS ) {
+            size_hint h;
+            h.size = st.st_size;
+            h.hits = 1;
+            m_size_hints[ path ] = h;
+        }
+        m_lock.unlock();
+        return false;
+    }
+    if( addr == NULL || addr == MAP_FAILED || st.st_size <= 0 ) {
+        return false;
+    }
+    // 拷贝在锁外面进行（MAP_POPULATE映射的小文件，只是内存拷贝）：不用大页时拷贝到malloc的内存中，
+    // 用大页时先在锁里预留一段大页内存
+    char* copy = NULL;
+    arena_chunk* chunk = NULL;
+    if( m_arena ) {
+        if( !reserve( path, st.st_size, copy, chunk ) ) {
+            return false;
+        }
+    } else {
+        copy = ( char* )malloc( st.st_size );
+        if( !copy ) {
+            return false;
+        }
+    }
+    memcpy( copy, addr, st.st_size );
+    m_lock.lock();
+    if( m_total_size + st.st_size > MAX_TOTAL_SIZE || m_entries.count( path ) ) {
+        // 缓存满了，或者别的线程已经把这个文件加进来了
+        if( chunk ) {
+            put_chunk( chunk );
+        } else {
+            free( copy );
+        }
+        m_lock.unlock();
+        return false;
+    }
+    entry e;
+    e.data = new content;
+    e.data->addr = copy;
+    e.data->chunk = chunk;
+    e.data->refs.store( ref ? 2 : 1, std::memory_order_relaxed );   // 缓存的引用，加上调用者的引用
+    e.st = st;
+    e.checked = time( NULL );
+    e.hits = 1;     // 加入缓存的这次请求
+    m_entries[ path ] = e;
+    if( ref ) {
+        *ref = e.data;
+    }
+    m_total_size += st.st_size;
+    m_lock.unlock();
+    munmap( addr, st.st_size );
+    addr = copy;
+    return true;
+}
+
+// 查询path对应文件的大小
+bool file_cache::size_of( const char* path, off_t& size ) {
+    std::string key( path );
+    m_lock.lock();
+    std::unordered_map< std::string, entry >::iterator it = m_entries.find( key );
+    if( it != m_entries.end() ) {
+        size = it->second.st.st_size;   // 可能已经过期，只是估计
+        m_lock.unlock();
+        return true;
+    }
+    std::unordered_map< std::string, size_hint >::iterator hint = m_size_hints.find( key );
+    if( hint != m_size_hints.end() ) {
+        size = hint->second.size;
+        m_lock.unlock();
+        return true;
+    }
+    m_lock.unlock();
+    return false;
+}
+
+static bool more_hits( const std::pair< std::string, unsigned long >& a,
+                       const std::pair< std::string, unsigned long >& b ) {
+    return a.second > b.second;
+}
+
+// 在锁里只拷贝出所有的路径和次数，排序放在锁外面
+void file_cache::hottest( size_t n, std::vector< std::pair< std::string, unsigned long > >& out ) {
+    out.clear();
+    m_lock.lock();
+    out.reserve( m_entries.size() + m_size_hints.size() );
+    std::unordered_map< std::string, entry >::iterator it;
+    for( it = m_entries.begin(); it != m_entries.end(); ++it ) {
+        out.push_back( std::make_pair( it->first, it->second.hits ) );
+    }
+    std::unordered_map< std::string, size_hint >::iterator hint;
+    for( hint = m_size_hints.begin(); hint != m_size_hints.end(); ++hint ) {
+        out.push_back( std::make_pair( hint->first, hint->second.hits ) );
+    }
+    m_lock.unlock();
+    if( out.size() > n ) {
+        std::partial_sort( out.begin(), out.begin() + n, out.end(), more_hits );
+        out.resize( n );
+    } else {
+        std::sort( out.begin(), out.end(), more_hits );
+    }
+}
+
+void file_cache::add_hits( const char* path, unsigned long n ) {
+    m_lock.lock();
+    std::unordered_map< std::string, entry >::iterator it = m_entries.find( path );
+    if( it != m_entries.end() ) {
+        it->second.hits += n;
+    } else {
+        std::unordered_map< std::string, size_hint >::iterator hint = m_size_hints.find( path );
+        if( hint != m_size_hints.end() ) {
+            hint->second.hits += n;
+        }
+    }
+    m_lock.unlock();
+}
+
+// 获取path所在目录的修改时间
+struct timespec file_cache::dir_mtime_of( const char* path ) {
+    struct timespec none = { -1, 0 };
+    const char* slash = strrchr( path, '/' );
+    if( !slash ) {
+        return none;
+    }
+    std::string dir( path, slash == path ? 1 : slash - path );
+    struct stat st;
+    if( stat( dir.c_str(), &st ) < 0 ) {
+        return none;
+    }
+    return st.st_mtim;
+}
+
+// 记录一个不存在的路径
+void file_cache::insert_missing( const char* path ) {
+    missing m;
+    m.dir_mtime = dir_mtime_of( path );     // stat放在锁外面
+    m.expires = time( NULL ) + MISSING_TTL;
+    m_lock.lock();
+    if( m_missing.size() >= MAX_MISSING ) {
+        // 记录满了，随便删掉一条（unordered_map的第一个元素相当于随机的一个）
+        m_missing.erase( m_missing.begin() );
+    }
+    m_missing[ path ] = m;
+    m_lock.unlock();
+}
+
+// 判断path是否已知不存在
+bool file_cache::is_missing( const char* path, bool revalidate ) {
+    std::string key( path );
+    time_t now = time( NULL );
+    m_lock.lock();
+    std::unordered_map< std::string, missing >::iterator it = m_missing.find( key );
+    if( it == m_missing.end() ) {
+        m_lock.unlock();
+        return false;
+    }
+    if( now < it->second.expires ) {
+        m_lock.unlock();
+        return true;
+    }
+    struct timespec old_mtime = it->second.dir_mtime;
+    m_lock.unlock();
+    if( !revalidate ) {
+        return false;
+    }
+
+    // 记录过期了，看看所在目录有没有变化
+    struct timespec mtime = dir_mtime_of( path );
+    bool unchanged = mtime.tv_sec == old_mtime.tv_sec && mtime.tv_nsec == old_mtime.tv_nsec;
+    m_lock.lock();
+    it = m_missing.find( key );
+    if( it != m_missing.end() ) {
+        if( unchanged ) {
+            it->second.expires = now + MISSING_TTL;
+        } else {
+            m_missing.erase( it );
+        }
+    }
+    m_lock.unlock();
+    return unchanged;
+}
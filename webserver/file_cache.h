@@ -0,0 +1,126 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+// 文件缓存类
+// 把经常被请求的小文件的内容拷贝一份保存下来，所有连接共享，
+// 命中缓存时不需要再调用open、mmap，也就不会阻塞在磁盘上，
+// 主线程可以据此判断一个请求能否直接在主线程中处理（见http_conn::can_process_inline）
+//
+// 缓存的内容会过期：每个缓存项最多每REVALIDATE_INTERVAL秒stat一次文件，
+// 文件的大小、修改时间或者inode变了（被修改、替换或删除）就从缓存中删除，下一个请求重新读文件。
+// 保存的是拷贝而不是文件的映射，文件被截短时正在发送的响应也不会因为访问映射而收到SIGBUS。
+// 被删除的缓存项可能还有响应在发送，所以每段内容带一个引用计数，最后一个引用释放时才释放内存。
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <time.h>
+#include <sys/stat.h>
+#include "locker.h"
+
+class file_cache {
+public:
+    static const off_t MAX_FILE_SIZE = 1 << 20;      // 单个文件超过1MB就不缓存
+    static const off_t MAX_TOTAL_SIZE = 64 << 20;    // 缓存的文件总大小上限64MB
+    static const size_t MAX_SIZE_HINTS = 4096;       // 最多记住多少个因为太大而没有缓存的文件的大小
+    static const size_t MAX_MISSING = 16384;         // 最多记住多少个不存在的路径
+    static const int MISSING_TTL = 5;                // 不存在的路径的有效期（秒）
+    static const size_t ARENA_CHUNK = 2 << 20;       // 开启大页时，缓存的文件内容拷贝到这么大的内存块中（一个大页）
+    static const size_t MAX_CHUNKS = MAX_TOTAL_SIZE / ARENA_CHUNK;  // 开启大页时最多分配多少个内存块
+    static const int REVALIDATE_INTERVAL = 1;        // 缓存项每隔多少秒和磁盘上的文件比较一次
+
+    // 缓存中的一段文件内容，lookup和insert返回给调用者，用完之后调用release
+    struct content;
+
+public:
+    file_cache();
+    ~file_cache();
+
+    // 查找path对应的文件，命中时返回true，并通过addr和st传出缓存的内容和文件状态，通过ref传出内容的引用
+    // 距离上次检查超过REVALIDATE_INTERVAL秒时会stat一次文件，文件变了就删除缓存项并返回false；
+    // revalidate为false时不stat，需要检查的缓存项直接当作没有命中（不会有任何系统调用，供主线程使用）
+    bool lookup( const char* path, char*& addr, struct stat& st, content*& ref, bool revalidate = true );
+    // 只判断path是否在缓存中，并且最近检查过（不会有任何系统调用，供主线程使用）
+    bool contains( const char* path );
+    // 尝试把已经映射好的文件加入缓存，成功时返回true：文件内容被拷贝到缓存中，原来的映射被释放，
+    // addr改为指向拷贝；ref不为NULL时传出拷贝的引用（调用者用完之后release）
+    // 缓存中的文件只在磁盘上的文件变了时才被删除，缓存满了之后新的文件就不再加入
+    // 开启了大页时，拷贝放在缓存的大页内存中
+    bool insert( const char* path, char*& addr, const struct stat& st, content** ref = NULL );
+    // 释放lookup或insert传出的引用
+    void release( content* ref );
+    // ---- 请求次数（用于热点文件清单，见warm_start）
+    // 缓存中的文件每次命中、太大而没有缓存的文件每次被请求都会计数
+    // 按请求次数从多到少取出最多n个文件的完整路径和请求次数
+    void hottest( size_t n, std::vector< std::pair< std::string, unsigned long > >& out );
+    // 给path对应的文件（缓存中的或者记下了大小的）加上n次请求（启动时用上次保存的次数作为初值）
+    void add_hits( const char* path, unsigned long n );
+
+    // 缓存的文件内容改为拷贝到大页内存中（alloc_on_node分配，见set_huge_pages），而不是保留文件的映射，
+    // 这样所有缓存的小文件只占用很少几个TLB项。启动时、加入任何文件之前调用
+    void use_huge_pages() { m_arena = true; }
+    // 查询path对应文件的大小，缓存中的文件，以及因为太大而没有缓存的文件都能查到
+    // 用于在处理请求之前估计响应的大小
+    bool size_of( const char* path, off_t& size );
+
+    // ---- 不存在的路径（负缓存）
+    // 扫描器和有问题的客户端会大量请求不存在的路径，每次都stat一遍并不值得，
+    // 所以记住这些路径，在有效期内直接回复404；过期之后检查它所在目录的修改时间，
+    // 目录没有变化（没有新建、删除、改名文件）就继续有效，否则删除该记录
+    // 记录一个不存在的路径（会stat一次它所在的目录）
+    void insert_missing( const char* path );
+    // 判断path是否已知不存在。revalidate为true时，过期的记录会通过stat所在目录重新确认（可能访问磁盘），
+    // 为false时只看有效期，不会有任何系统调用（供主线程使用）
+    bool is_missing( const char* path, bool revalidate );
+
+private:
+    struct entry {
+        content* data;      // 缓存的文件内容
+        struct stat st;     // 加入缓存时文件的状态信息（大小，以及用来判断文件有没有变的修改时间和inode）
+        time_t checked;     // 上次和磁盘上的文件比较的时间
+        unsigned long hits; // 命中的次数
+    };
+    // 太大而没有缓存的文件
+    struct size_hint {
+        off_t size;
+        unsigned long hits; // 被请求的次数
+    };
+
+    std::unordered_map< std::string, entry > m_entries;    // 文件的完整路径 -> 缓存项
+    std::unordered_map< std::string, size_hint > m_size_hints; // 太大而没有缓存的文件的完整路径 -> 文件大小
+
+    // 不存在的路径的记录：有效期，以及记录时所在目录的修改时间（目录也不存在时tv_sec为-1）
+    // 修改时间要精确到纳秒：同一秒内先记录了不存在、之后文件才被创建时，按秒比较会认为目录没有变化
+    struct missing {
+        time_t expires;
+        struct timespec dir_mtime;
+    };
+    std::unordered_map< std::string, missing > m_missing;  // 不存在的路径 -> 记录
+    // 获取path所在目录的修改时间，目录不存在时返回的tv_sec为-1
+    static struct timespec dir_mtime_of( const char* path );
+    // 从缓存中删除一项（调用时持有锁），内容在最后一个引用释放时才释放
+    void retire( std::unordered_map< std::string, entry >::iterator it );
+    // 释放已经没有引用的内容；在大页内存块中的内容调用时要持有锁
+    void destroy( content* data );
+
+    // 大页内存块：从头往后依次切出文件内容，块中的内容全部释放之后整块从头重新使用
+    struct arena_chunk {
+        char* base;
+        size_t used;        // 已经切出去的字节数
+        int live;           // 还没有释放的内容的个数
+    };
+    // 在大页内存块中为path的size字节内容预留一段（不拷贝），缓存满了、已经有这个文件或者分配不到内存时返回false
+    bool reserve( const char* path, off_t size, char*& copy, arena_chunk*& chunk );
+    // 块中的一段内容释放了（调用时持有锁）
+    void put_chunk( arena_chunk* chunk );
+
+    off_t m_total_size;                                     // 缓存中的文件总大小（被删除的缓存项不再计入）
+    bool m_arena;                                           // 文件内容是否拷贝到大页内存中
+    std::vector< arena_chunk* > m_chunks;                   // 分配过的所有大页内存块（最多MAX_CHUNKS个）
+    std::vector< arena_chunk* > m_free_chunks;              // 内容已经全部释放、可以重新使用的块
+    arena_chunk* m_current;                                 // 正在从中切出内容的块
+    size_t m_allocating;                                    // 正在锁外面分配的块数（算在MAX_CHUNKS之内）
+    locker m_lock;                                          // 主线程和工作线程都会访问缓存，需要加锁
+};
+
+#endif
@@ -0,0 +1,796 @@
+#include "h2_session.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "http_conn.h"
+
+// 定义在http_conn.cpp中
+extern const char* doc_root;
+extern const char* error_400_form;
+extern const char* error_403_form;
+extern const char* error_404_form;
+extern const char* error_429_form;
+extern const char* error_500_form;
+
+// 帧类型
+enum { FRAME_DATA = 0, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS, FRAME_PUSH_PROMISE,
+       FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION };
+// 帧标志
+enum { FLAG_END_STREAM = 0x1, FLAG_ACK = 0x1, FLAG_END_HEADERS = 0x4, FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20 };
+// 错误码
+enum { ERR_NO_ERROR = 0, ERR_PROTOCOL = 1, ERR_INTERNAL = 2, ERR_FLOW_CONTROL = 3, ERR_FRAME_SIZE = 6,
+       ERR_REFUSED_STREAM = 7, ERR_COMPRESSION = 9, ERR_ENHANCE_YOUR_CALM = 11 };
+// SETTINGS参数
+enum { SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH, SETTINGS_MAX_CONCURRENT_STREAMS,
+       SETTINGS_INITIAL_WINDOW_SIZE, SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE };
+
+// 客户端的连接前言
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const int PREFACE_LEN = sizeof( PREFACE ) - 1;
+
+static uint32_t get_u32( const uint8_t* p ) {
+    return ( ( uint32_t )p[0] << 24 ) | ( ( uint32_t )p[1] << 16 ) | ( ( uint32_t )p[2] << 8 ) | p[3];
+}
+
+static void put_u32( char* p, uint32_t v ) {
+    p[0] = ( char )( v >> 24 );
+    p[1] = ( char )( v >> 16 );
+    p[2] = ( char )( v >> 8 );
+    p[3] = ( char )v;
+}
+
+// 生成9字节的帧头
+static void frame_header( std::string& out, uint32_t len, uint8_t type, uint8_t flags, uint32_t stream_id ) {
+    char h[ h2_session::FRAME_HEADER_SIZE ];
+    h[0] = ( char )( len >> 16 );
+    h[1] = ( char )( len >> 8 );
+    h[2] = ( char )len;
+    h[3] = ( char )type;
+    h[4] = ( char )flags;
+    put_u32( h + 5, stream_id & 0x7fffffff );
+    out.append( h, sizeof( h ) );
+}
+
+// base64url解码（HTTP2-Settings头部），不需要填充
+static bool base64url_decode( const char* text, std::string& out ) {
+    uint32_t acc = 0;
+    int bits = 0;
+    for( const char* p = text; *p && *p != '='; ++p ) {
+        int v;
+        char c = *p;
+        if( c >= 'A' && c <= 'Z' ) v = c - 'A';
+        else if( c >= 'a' && c <= 'z' ) v = c - 'a' + 26;
+        else if( c >= '0' && c <= '9' ) v = c - '0' + 52;
+        else if( c == '-' || c == '+' ) v = 62;
+        else if( c == '_' || c == '/' ) v = 63;
+        else return false;
+        acc = ( acc << 6 ) | v;
+        bits += 6;
+        if( bits >= 8 ) {
+            bits -= 8;
+            out.push_back( ( char )( acc >> bits ) );
+        }
+    }
+    return true;
+}
+
+
+h2_session::body::~body() {
+    if( map ) {
+        munmap( map, map_len );
+    }
+    if( cached ) {
+        http_conn::m_file_cache.release( cached );
+    }
+}
+
+h2_session::h2_session( int sockfd, client_slot* slot )
+    : m_sockfd( sockfd ), m_client_slot( slot ), m_in_len( 0 ), m_preface_ok( false ), m_closing( false ), m_failed( false ),
+      m_last_stream( 0 ), m_continuation( 0 ), m_conn_window( DEFAULT_WINDOW ),
+      m_initial_window( DEFAULT_WINDOW ), m_peer_max_frame( MAX_FRAME_SIZE ), m_out_bytes( 0 ) {
+}
+
+h2_session::~h2_session() {
+}
+
+// 我们的SETTINGS：限制并发流的数量和头部列表的大小，其余都用默认值
+void h2_session::start() {
+    char payload[ 12 ];
+    payload[0] = 0;
+    payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put_u32( payload + 2, MAX_CONCURRENT_STREAMS );
+    payload[6] = 0;
+    payload[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    put_u32( payload + 8, MAX_HEADER_LIST_SIZE );
+    send_frame( FRAME_SETTINGS, 0, 0, payload, sizeof( payload ) );
+}
+
+bool h2_session::upgrade( const char* method, const char* path, const char* settings ) {
+    out_item item;
+    item.head = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    item.ptr = NULL;
+    item.len = 0;
+    item.sent = 0;
+    m_out_bytes += item.head.size();
+    m_out.push_back( item );
+    start();
+
+    // HTTP2-Settings相当于客户端的第一个SETTINGS帧
+    std::string payload;
+    if( !settings || !base64url_decode( settings, payload )
+            || on_settings( ( const uint8_t* )payload.data(), payload.size() ) != ERR_NO_ERROR ) {
+        return false;
+    }
+    // 升级前的请求就是流1，请求已经完整了（升级请求不能有请求体）
+    m_last_stream = 1;
+    stream& s = m_streams[ 1 ];
+    s.window = m_initial_window;
+    s.end_stream = true;
+    header_list headers;
+    headers.push_back( std::make_pair( std::string( ":method" ), std::string( method ) ) );
+    headers.push_back( std::make_pair( std::string( ":path" ), std::string( path ) ) );
+    handle_request( 1, headers );
+    return true;
+}
+
+bool h2_session::feed( const char* data, int len ) {
+    if( len > INPUT_BUFFER_SIZE - m_in_len ) {
+        return false;
+    }
+    memcpy( m_in + m_in_len, data, len );
+    m_in_len += len;
+    return true;
+}
+
+bool h2_session::read() {
+    while( m_in_len < INPUT_BUFFER_SIZE ) {
+        int n = recv( m_sockfd, m_in + m_in_len, INPUT_BUFFER_SIZE - m_in_len, 0 );
+        if( n < 0 ) {
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                break;
+            }
+            return false;
+        } else if( n == 0 ) {
+            return false;
+        }
+        m_in_len += n;
+    }
+    return true;
+}
+
+bool h2_session::process() {
+    if( m_failed ) {
+        m_in_len = 0;
+        return flush();
+    }
+    int pos = 0;
+    if( !m_preface_ok ) {
+        int n = m_in_len < PREFACE_LEN ? m_in_len : PREFACE_LEN;
+        if( memcmp( m_in, PREFACE, n ) != 0 ) {
+            return false;
+        }
+        if( m_in_len < PREFACE_LEN ) {
+            return flush();
+        }
+        m_preface_ok = true;
+        pos = PREFACE_LEN;
+    }
+
+    // 逐个处理完整的帧
+    // 出错时on_frame会发送GOAWAY并返回false，之后的数据都不再处理
+    while( m_in_len - pos >= FRAME_HEADER_SIZE ) {
+        const uint8_t* h = ( const uint8_t* )m_in + pos;
+        uint32_t len = ( ( uint32_t )h[0] << 16 ) | ( h[1] << 8 ) | h[2];
+        if( len > ( uint32_t )MAX_FRAME_SIZE ) {
+            send_goaway( ERR_FRAME_SIZE );
+            break;
+        }
+        if( m_in_len - pos < FRAME_HEADER_SIZE + ( int )len ) {
+            break;
+        }
+        if( !on_frame( h[3], h[4], get_u32( h + 5 ) & 0x7fffffff, h + FRAME_HEADER_SIZE, len ) ) {
+            break;
+        }
+        pos += FRAME_HEADER_SIZE + len;
+    }
+    // 没处理的部分移到输入缓冲区的开头
+    memmove( m_in, m_in + pos, m_in_len - pos );
+    m_in_len -= pos;
+    return flush();
+}
+
+bool h2_session::on_frame( uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len ) {
+    // 头部块必须连续：HEADERS之后只能是同一个流的CONTINUATION
+    if( m_continuation && ( type != FRAME_CONTINUATION || stream_id != m_continuation ) ) {
+        send_goaway( ERR_PROTOCOL );
+        return false;
+    }
+    switch( type ) {
+        case FRAME_DATA: {
+            // 不接受请求体，直接丢弃，但要把连接的接收窗口还给对方；
+            // 对方还没结束这个流的话流的接收窗口也要还，否则请求体超过初始窗口（64KB）之后对方就发不动了
+            // （我们的响应可能已经发完、流已经删除了，但对方还在发请求体，所以不看m_streams）
+            if( stream_id == 0 ) {
+                send_goaway( ERR_PROTOCOL );
+                return false;
+            }
+            if( len > 0 ) {
+                char inc[ 4 ];
+                put_u32( inc, len );
+                send_frame( FRAME_WINDOW_UPDATE, 0, 0, inc, 4 );
+                if( !( flags & FLAG_END_STREAM ) && stream_id <= m_last_stream ) {
+                    send_frame( FRAME_WINDOW_UPDATE, 0, stream_id, inc, 4 );
+                }
+            }
+            return true;
+        }
+        case FRAME_HEADERS: {
+            if( stream_id == 0 || !( stream_id & 1 ) || stream_id <= m_last_stream ) {
+                send_goaway( ERR_PROTOCOL );
+                return false;
+            }
+            m_last_stream = stream_id;
+            // 去掉填充和优先级信息（优先级忽略，各个流轮流发送）
+            size_t pad = 0;
+            if( flags & FLAG_PADDED ) {
+                if( len < 1 ) {
+                    send_goaway( ERR_PROTOCOL );
+                    return false;
+                }
+                pad = payload[0];
+                ++payload;
+                --len;
+            }
+            if( flags & FLAG_PRIORITY ) {
+                if( len < 5 ) {
+                    send_goaway( ERR_PROTOCOL );
+                    return false;
+                }
+                payload += 5;
+                len -= 5;
+            }
+            if( pad > len ) {
+                send_goaway( ERR_PROTOCOL );
+                return false;
+            }
+            len -= pad;
+            if( len > MAX_HEADER_LIST_SIZE ) {
+                send_goaway( ERR_ENHANCE_YOUR_CALM );
+                return false;
+            }
+            if( m_streams.size() >= MAX_CONCURRENT_STREAMS ) {
+                // 拒绝这个流，但头部块还是要解码的，否则动态表就和对方不一致了（简单起见，要求头部块只有一个帧）
+                header_list ignored;
+                bool too_large;
+                if( !( flags & FLAG_END_HEADERS ) ) {
+                    send_goaway( ERR_PROTOCOL );
+                    return false;
+                }
+                if( !m_decoder.decode( payload, len, ignored, 0, too_large ) ) {
+                    send_goaway( ERR_COMPRESSION );
+                    return false;
+                }
+                send_rst( stream_id, ERR_REFUSED_STREAM );
+                return true;
+            }
+            stream& s = m_streams[ stream_id ];
+            s.window = m_initial_window;
+            s.end_stream = flags & FLAG_END_STREAM;
+            s.block.assign( ( const char* )payload, len );
+            if( !( flags & FLAG_END_HEADERS ) ) {
+                m_continuation = stream_id;
+                return true;
+            }
+            return on_headers_done( stream_id );
+        }
+        case FRAME_CONTINUATION: {
+            std::map< uint32_t, stream >::iterator it = m_streams.find( stream_id );
+            if( !m_continuation || it == m_streams.end() ) {
+                send_goaway( ERR_PROTOCOL );
+                return false;
+            }
+            // 不带END_HEADERS的CONTINUATION可以一直发下去，头部块不能无限增长
+            if( it->second.block.size() + len > MAX_HEADER_LIST_SIZE ) {
+                send_goaway( ERR_ENHANCE_YOUR_CALM );
+                return false;
+            }
+            it->second.block.append( ( const char* )payload, len );
+            if( !( flags & FLAG_END_HEADERS ) ) {
+                return true;
+            }
+            m_continuation = 0;
+            return on_headers_done( stream_id );
+        }
+        case FRAME_RST_STREAM: {
+            // 对方取消了这个流，正在发送的响应体也不用再发了
+            std::map< uint32_t, stream >::iterator it = m_streams.find( stream_id );
+            if( it != m_streams.end() ) {
+                m_streams.erase( it );
+            }
+            return true;
+        }
+        case FRAME_SETTINGS: {
+            if( flags & FLAG_ACK ) {
+                return true;
+            }
+            if( stream_id != 0 ) {
+                send_goaway( ERR_PROTOCOL );
+                return false;
+            }
+            uint32_t error = on_settings( payload, len );
+            if( error != ERR_NO_ERROR ) {
+                send_goaway( error );
+                return false;
+            }
+            send_frame( FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0 );
+            return true;
+        }
+        case FRAME_PUSH_PROMISE: {
+            // 客户端不能推送
+            send_goaway( ERR_PROTOCOL );
+            return false;
+        }
+        case FRAME_PING: {
+            if( len != 8 ) {
+                send_goaway( ERR_FRAME_SIZE );
+                return false;
+            }
+            if( !( flags & FLAG_ACK ) ) {
+                send_frame( FRAME_PING, FLAG_ACK, 0, ( const char* )payload, len );
+            }
+            return true;
+        }
+        case FRAME_GOAWAY: {
+            // 对方不再发送新的请求，已经在处理的流发送完之后关闭连接
+            m_closing = true;
+            return true;
+        }
+        case FRAME_WINDOW_UPDATE: {
+            if( len != 4 ) {
+                send_goaway( ERR_FRAME_SIZE );
+                return false;
+            }
+            uint32_t inc = get_u32( payload ) & 0x7fffffff;
+            // 增量为0是协议错误：连接上的是连接错误，流上的是流错误
+            if( inc == 0 ) {
+                if( stream_id == 0 ) {
+                    send_goaway( ERR_PROTOCOL );
+                    return false;
+                }
+                send_rst( stream_id, ERR_PROTOCOL );
+                m_streams.erase( stream_id );
+                return true;
+            }
+            if( stream_id == 0 ) {
+                m_conn_window += inc;
+                if( m_conn_window > 0x7fffffff ) {
+                    send_goaway( ERR_FLOW_CONTROL );
+                    return false;
+                }
+                return true;
+            }
+            std::map< uint32_t, stream >::iterator it = m_streams.find( stream_id );
+            if( it != m_streams.end() ) {
+                if( ( int64_t )it->second.window + inc > 0x7fffffff ) {
+                    send_rst( stream_id, ERR_FLOW_CONTROL );
+                    m_streams.erase( it );
+                    return true;
+                }
+                it->second.window += inc;
+                make_ready( stream_id, it->second );
+            }
+            return true;
+        }
+        default:
+            // PRIORITY和未知类型的帧都忽略
+            return true;
+    }
+}
+
+uint32_t h2_session::on_settings( const uint8_t* payload, size_t len ) {
+    if( len % 6 != 0 ) {
+        return ERR_FRAME_SIZE;
+    }
+    for( size_t i = 0; i < len; i += 6 ) {
+        uint16_t id = ( payload[i] << 8 ) | payload[i + 1];
+        uint32_t value = get_u32( payload + i + 2 );
+        if( id == SETTINGS_INITIAL_WINDOW_SIZE ) {
+            if( value > 0x7fffffff ) {
+                return ERR_FLOW_CONTROL;
+            }
+            // 初始窗口的变化要作用到所有已经存在的流上，任何一个流的窗口超过2^31-1都是连接错误
+            int64_t delta = ( int64_t )value - m_initial_window;
+            m_initial_window = value;
+            std::map< uint32_t, stream >::iterator it;
+            for( it = m_streams.begin(); it != m_streams.end(); ++it ) {
+                int64_t window = it->second.window + delta;
+                if( window > 0x7fffffff ) {
+                    return ERR_FLOW_CONTROL;
+                }
+                it->second.window = ( int32_t )window;
+                make_ready( it->first, it->second );
+            }
+        } else if( id == SETTINGS_MAX_FRAME_SIZE ) {
+            if( value < ( uint32_t )MAX_FRAME_SIZE || value > 0xffffff ) {
+                return ERR_PROTOCOL;
+            }
+            m_peer_max_frame = value;
+        }
+        // 其他参数和我们无关：我们不推送，编码响应头时也不使用动态表
+    }
+    return ERR_NO_ERROR;
+}
+
+bool h2_session::on_headers_done( uint32_t stream_id ) {
+    stream& s = m_streams[ stream_id ];
+    header_list headers;
+    bool too_large;
+    if( !m_decoder.decode( ( const uint8_t* )s.block.data(), s.block.size(), headers, MAX_HEADER_LIST_SIZE, too_large ) ) {
+        send_goaway( ERR_COMPRESSION );
+        return false;
+    }
+    std::string().swap( s.block );
+    // 一个连接上可以开任意多个流，所以每个流都要取令牌（升级前的那个请求已经在http_conn中取过了）；
+    // 取不到时只拒绝这个流，回复429
+    if( m_client_slot && !http_conn::m_limiter.allow_request( m_client_slot ) ) {
+        body_ptr resp( new body );
+        resp->owned = error_429_form;
+        resp->data = resp->owned.data();
+        resp->len = resp->owned.size();
+        respond( stream_id, 429, "text/html", "", resp );
+        return true;
+    }
+    if( too_large ) {
+        // 头部列表超过了我们通告的上限，只拒绝这个请求（头部块已经完整解码，连接还可以继续用）
+        body_ptr resp( new body );
+        resp->owned = "Request header fields too large.\n";
+        resp->data = resp->owned.data();
+        resp->len = resp->owned.size();
+        respond( stream_id, 431, "text/html", "", resp );
+        return true;
+    }
+    handle_request( stream_id, headers );
+    return true;
+}
+
+void h2_session::handle_request( uint32_t stream_id, const header_list& headers ) {
+    std::string method, path;
+    for( size_t i = 0; i < headers.size(); ++i ) {
+        if( headers[i].first == ":method" ) {
+            method = headers[i].second;
+        } else if( headers[i].first == ":path" ) {
+            path = headers[i].second;
+        }
+    }
+    if( method.empty() || path.empty() || path[0] != '/' ) {
+        send_rst( stream_id, ERR_PROTOCOL );
+        m_streams.erase( stream_id );
+        return;
+    }
+
+    body_ptr resp( new body );
+    std::string type = "text/html";
+    std::string extra;
+    int status;
+
+    std::string_view url( path );
+    std::string_view route_path = url.substr( 0, url.find( '?' ) );
+    const request_handler* h = http_conn::m_router.find( method, route_path );
+    if( h ) {
+        // 注册的处理函数：请求视图指向解码出的头部，响应体拷贝到一起发送
+        request_view view;
+        view.method = method;
+        view.path = route_path;
+        view.query = route_path.size() < url.size() ? url.substr( route_path.size() + 1 ) : std::string_view();
+        view.version = "HTTP/2";
+        view.header_count = 0;
+        for( size_t i = 0; i < headers.size() && view.header_count < request_view::MAX_HEADERS; ++i ) {
+            if( headers[i].first[0] != ':' ) {
+                view.headers[ view.header_count ].name = headers[i].first;
+                view.headers[ view.header_count ].value = headers[i].second;
+                ++view.header_count;
+            }
+        }
+        response_builder builder;
+        try {
+            ( *h )( view, builder );
+            status = builder.status_code();
+            type = builder.type();
+            struct iovec iov[ response_builder::MAX_SEGMENTS ];
+            int n = builder.fill_iov( iov );
+            for( int i = 0; i < n; ++i ) {
+                resp->owned.append( ( const char* )iov[i].iov_base, iov[i].iov_len );
+            }
+            extra = builder.extra_headers();
+        } catch( ... ) {
+            printf( "handler for %s threw\n", path.c_str() );
+            status = 500;
+            resp->owned = error_500_form;
+        }
+    } else if( method != "GET" ) {
+        status = 400;
+        resp->owned = error_400_form;
+    } else {
+        status = resolve_file( path, resp, type );
+        if( status != 200 ) {
+            resp->owned = status == 403 ? error_403_form : status == 404 ? error_404_form
+                        : status == 400 ? error_400_form : error_500_form;
+        }
+    }
+    if( !resp->data ) {
+        resp->data = resp->owned.data();
+        resp->len = resp->owned.size();
+    }
+    respond( stream_id, status, type, extra, resp );
+}
+
+int h2_session::resolve_file( const std::string& path, body_ptr& resp, std::string& type ) {
+    // 开启了资源包时只在资源包中查找
+    if( http_conn::m_bundle ) {
+        asset_bundle::asset a;
+        if( !http_conn::m_bundle->find( path.data(), path.size(), a ) ) {
+            return 404;
+        }
+        // 预先生成的响应头中有Content-Type
+        std::string_view header( a.header, a.header_len );
+        size_t p = header.find( "Content-Type:" );
+        if( p != std::string_view::npos ) {
+            size_t begin = p + 13;
+            type = std::string( header.substr( begin, header.find( '\r', begin ) - begin ) );
+        }
+        resp->data = a.body;
+        resp->len = a.body_len;
+        return 200;
+    }
+
+    std::string real_file = std::string( doc_root ) + path;
+    if( real_file.size() >= ( size_t )http_conn::FILENAME_LEN ) {
+        return 404;
+    }
+    char* addr;
+    struct stat st;
+    if( http_conn::m_file_cache.lookup( real_file.c_str(), addr, st, resp->cached ) ) {
+        resp->data = addr;
+        resp->len = st.st_size;
+        return 200;
+    }
+    if( http_conn::m_file_cache.is_missing( real_file.c_str(), true ) ) {
+        return 404;
+    }
+    if( stat( real_file.c_str(), &st ) < 0 ) {
+        if( errno == ENOENT || errno == ENOTDIR ) {
+            http_conn::m_file_cache.insert_missing( real_file.c_str() );
+        }
+        return 404;
+    }
+    if( !( st.st_mode & S_IROTH ) ) {
+        return 403;
+    }
+    if( S_ISDIR( st.st_mode ) ) {
+        return 400;
+    }
+    if( st.st_size == 0 ) {
+        resp->data = "";
+        resp->len = 0;
+        return 200;
+    }
+    int fd = open( real_file.c_str(), O_RDONLY );
+    if( fd < 0 ) {
+        return 404;
+    }
+    int flags = MAP_PRIVATE;
+    if( st.st_size <= http_conn::PREFAULT_SIZE ) {
+        flags |= MAP_POPULATE;
+    }
+    addr = ( char* )mmap( 0, st.st_size, PROT_READ, flags, fd, 0 );
+    close( fd );
+    if( addr == MAP_FAILED ) {
+        return 500;
+    }
+    if( st.st_size > http_conn::PREFAULT_SIZE ) {
+        madvise( addr, st.st_size, MADV_WILLNEED );
+    }
+    // 小文件加入缓存（之后归缓存所有），否则在响应发送完之后munmap
+    if( !http_conn::m_file_cache.insert( real_file.c_str(), addr, st, &resp->cached ) ) {
+        resp->map = addr;
+        resp->map_len = st.st_size;
+    }
+    resp->data = addr;
+    resp->len = st.st_size;
+    return 200;
+}
+
+void h2_session::respond( uint32_t stream_id, int status, const std::string& type, const std::string& extra, body_ptr resp ) {
+    std::string block;
+    hpack_encode_status( block, status );
+    char len[ 24 ];
+    int n = snprintf( len, sizeof( len ), "%lu", ( unsigned long )resp->len );
+    hpack_encode_header( block, 28, NULL, len, n );                       // content-length
+    hpack_encode_header( block, 31, NULL, type.data(), type.size() );     // content-type
+    // 处理函数添加的响应头，格式为 "Name: value\r\n"，HTTP/2要求名字是小写的
+    size_t pos = 0;
+    while( pos < extra.size() ) {
+        size_t eol = extra.find( "\r\n", pos );
+        if( eol == std::string::npos || eol == pos ) {
+            break;
+        }
+        size_t colon = extra.find( ':', pos );
+        if( colon != std::string::npos && colon < eol ) {
+            std::string name = extra.substr( pos, colon - pos );
+            for( size_t i = 0; i < name.size(); ++i ) {
+                name[i] = tolower( name[i] );
+            }
+            size_t v = colon + 1;
+            while( v < eol && extra[v] == ' ' ) {
+                ++v;
+            }
+            hpack_encode_header( block, 0, name.c_str(), extra.data() + v, eol - v );
+        }
+        pos = eol + 2;
+    }
+
+    // 头部块超过对方能接受的帧大小时，用CONTINUATION帧接着发
+    bool empty = resp->len == 0;
+    size_t off = 0;
+    uint8_t type_byte = FRAME_HEADERS;
+    do {
+        size_t chunk = block.size() - off < m_peer_max_frame ? block.size() - off : m_peer_max_frame;
+        uint8_t flags = 0;
+        if( off + chunk == block.size() ) {
+            flags |= FLAG_END_HEADERS;
+        }
+        if( type_byte == FRAME_HEADERS && empty ) {
+            flags |= FLAG_END_STREAM;
+        }
+        send_frame( type_byte, flags, stream_id, block.data() + off, chunk );
+        off += chunk;
+        type_byte = FRAME_CONTINUATION;
+    } while( off < block.size() );
+
+    if( empty ) {
+        m_streams.erase( stream_id );
+        return;
+    }
+    stream& s = m_streams[ stream_id ];
+    s.resp = resp;
+    s.sent = 0;
+    make_ready( stream_id, s );
+}
+
+void h2_session::make_ready( uint32_t stream_id, stream& s ) {
+    if( s.resp && !s.queued && s.window > 0 && s.sent < s.resp->len ) {
+        s.queued = true;
+        m_ready.push_back( stream_id );
+    }
+}
+
+// 轮流给各个流生成DATA帧，每次最多一个帧，这样大文件和小文件的响应交替发送，小文件不用等大文件发完
+void h2_session::schedule() {
+    while( !m_ready.empty() && m_out_bytes < OUTPUT_HIGH_WATER && m_conn_window > 0 ) {
+        uint32_t id = m_ready.front();
+        m_ready.pop_front();
+        std::map< uint32_t, stream >::iterator it = m_streams.find( id );
+        if( it == m_streams.end() ) {
+            continue;   // 流已经被对方取消了
+        }
+        stream& s = it->second;
+        s.queued = false;
+        size_t n = s.resp->len - s.sent;
+        if( n > m_peer_max_frame ) n = m_peer_max_frame;
+        if( ( int64_t )n > s.window ) n = s.window;
+        if( ( int64_t )n > m_conn_window ) n = m_conn_window;
+        bool last = s.sent + n == s.resp->len;
+
+        out_item item;
+        frame_header( item.head, n, FRAME_DATA, last ? FLAG_END_STREAM : 0, id );
+        item.data = s.resp;
+        item.ptr = s.resp->data + s.sent;
+        item.len = n;
+        item.sent = 0;
+        m_out_bytes += item.head.size() + n;
+        m_out.push_back( item );
+
+        s.sent += n;
+        s.window -= n;
+        m_conn_window -= n;
+        if( last ) {
+            m_streams.erase( it );
+        } else {
+            make_ready( id, s );    // 窗口还没用完就排到队尾，等下一轮
+        }
+    }
+}
+
+bool h2_session::flush() {
+    while( true ) {
+        schedule();
+        if( m_out.empty() ) {
+            return true;
+        }
+        struct iovec iov[ MAX_IOV ];
+        int count = 0;
+        for( size_t i = 0; i < m_out.size() && count + 2 <= MAX_IOV; ++i ) {
+            out_item& item = m_out[i];
+            size_t head_len = item.head.size();
+            if( item.sent < head_len ) {
+                iov[ count ].iov_base = ( void* )( item.head.data() + item.sent );
+                iov[ count ].iov_len = head_len - item.sent;
+                ++count;
+            }
+            size_t data_sent = item.sent > head_len ? item.sent - head_len : 0;
+            if( item.len > data_sent ) {
+                iov[ count ].iov_base = ( void* )( item.ptr + data_sent );
+                iov[ count ].iov_len = item.len - data_sent;
+                ++count;
+            }
+        }
+        ssize_t n = writev( m_sockfd, iov, count );
+        if( n < 0 ) {
+            if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return true;    // 等待EPOLLOUT
+            }
+            if( errno == EINTR ) {
+                continue;
+            }
+            return false;
+        }
+        m_out_bytes -= n;
+        // 去掉已经发送完的项，最后一项可能只发送了一部分
+        while( n > 0 ) {
+            out_item& item = m_out.front();
+            size_t left = item.head.size() + item.len - item.sent;
+            if( ( size_t )n < left ) {
+                item.sent += n;
+                break;
+            }
+            n -= left;
+            m_out.pop_front();
+        }
+    }
+}
+
+bool h2_session::want_write() const {
+    return !m_out.empty();
+}
+
+bool h2_session::finished() const {
+    return m_closing && m_out.empty() && m_streams.empty();
+}
+
+void h2_session::send_frame( uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, size_t len ) {
+    out_item item;
+    frame_header( item.head, len, type, flags, stream_id );
+    if( len > 0 ) {
+        item.head.append( payload, len );
+    }
+    item.ptr = NULL;
+    item.len = 0;
+    item.sent = 0;
+    m_out_bytes += item.head.size();
+    m_out.push_back( item );
+}
+
+// 连接级别的错误：告诉对方最后处理的流，然后关闭连接，没发完的响应也不再发送
+void h2_session::send_goaway( uint32_t error ) {
+    char payload[ 8 ];
+    put_u32( payload, m_last_stream );
+    put_u32( payload + 4, error );
+    send_frame( FRAME_GOAWAY, 0, 0, payload, sizeof( payload ) );
+    m_closing = true;
+    m_failed = true;
+    m_streams.clear();
+    m_ready.clear();
+}
+
+void h2_session::send_rst( uint32_t stream_id, uint32_t error ) {
+    char payload[ 4 ];
+    put_u32( payload, error );
+    send_frame( FRAME_RST_STREAM, 0, stream_id, payload, sizeof( payload ) );
+}
@@ -0,0 +1,140 @@
+#ifndef H2_SESSION_H
+#define H2_SESSION_H
+
+// HTTP/2明文（h2c）会话
+// 浏览器对每个HTTP/1.1服务器要开6个以上的连接才能并行请求，每个连接都要占用一个http_conn、一次握手和一个epoll注册。
+// HTTP/2在一个连接上用多个流（stream）并行传输多个请求和响应，一个连接就够了。
+//
+// 一个连接切换到HTTP/2之后（客户端直接发送连接前言，或者通过Upgrade: h2c升级），
+// http_conn就把读写都交给这个类：
+//   主线程：read() 从socket读数据到输入缓冲区；write() 在socket可写时继续发送
+//   工作线程：process() 解析收到的帧，处理完整的请求（和HTTP/1.1一样，从资源包、文件缓存或者磁盘获取文件，
+//            或者交给注册的处理函数），然后尽量发送
+// 响应体以DATA帧发送，数据直接指向文件的内存映射（writev，不拷贝）；
+// 各个流轮流发送，每次最多一个帧，并遵守对方的流量控制窗口，大文件不会阻塞同一连接上的小请求。
+// 目前不接受请求体（DATA帧直接丢弃，但会归还连接和流的接收窗口），也不使用服务器推送。
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <map>
+#include <deque>
+#include <memory>
+#include "hpack.h"
+#include "file_cache.h"
+
+struct client_slot;
+
+class h2_session {
+public:
+    static const int FRAME_HEADER_SIZE = 9;
+    static const int MAX_FRAME_SIZE = 16384;            // 我们接受的最大帧（SETTINGS_MAX_FRAME_SIZE的默认值）
+    static const int INPUT_BUFFER_SIZE = 2 * ( FRAME_HEADER_SIZE + MAX_FRAME_SIZE );
+    static const uint32_t MAX_CONCURRENT_STREAMS = 100; // 同时处理的流的最大数量
+    static const size_t OUTPUT_HIGH_WATER = 64 * 1024;  // 输出队列中没发出去的数据超过这个量，就先不生成新的DATA帧
+    static const int32_t DEFAULT_WINDOW = 65535;        // 流量控制窗口的初始大小
+    static const size_t MAX_HEADER_LIST_SIZE = 16384;   // 通告给对方的SETTINGS_MAX_HEADER_LIST_SIZE：解码后的头部列表的上限，
+                                                        // 压缩的头部块（HEADERS + CONTINUATION）也不能超过这个大小
+    static const int MAX_IOV = 64;                      // 每次writev最多的内存块数量
+
+public:
+    // slot为这个连接的客户端IP在限流表中的槽（见client_limiter），不限流时为NULL
+    h2_session( int sockfd, client_slot* slot );
+    ~h2_session();
+
+    // 客户端直接发送了连接前言（已知对方支持HTTP/2），发送我们的SETTINGS
+    void start();
+    // 通过Upgrade: h2c升级：先回复101，再发送我们的SETTINGS，升级前的那个请求作为流1处理
+    // settings为请求中HTTP2-Settings头部的值（base64url编码的SETTINGS帧内容）
+    bool upgrade( const char* method, const char* path, const char* settings );
+    // 把以HTTP/1.1方式读到、还没有处理的数据交给会话
+    bool feed( const char* data, int len );
+
+    // 主线程调用：从socket读数据到输入缓冲区，对方关闭连接或出错时返回false
+    bool read();
+    // 工作线程调用：解析收到的帧、处理请求，然后尽量发送，需要关闭连接时返回false
+    bool process();
+    // 发送输出队列中的数据（必要时生成新的DATA帧），出错时返回false
+    bool flush();
+    // 输出队列中还有数据没发出去（socket写缓冲区满了），需要等待EPOLLOUT
+    bool want_write() const;
+    // 会话已经结束（发送或收到了GOAWAY，并且该发的都发完了），可以关闭连接
+    bool finished() const;
+
+private:
+    // 响应体的数据，由流和引用它的DATA帧共享，最后一个引用释放时才munmap
+    struct body {
+        const char* data;
+        size_t len;
+        char* map;              // 需要munmap的映射（文件缓存和资源包中的数据不归我们所有，为NULL）
+        size_t map_len;
+        file_cache::content* cached;    // data属于文件缓存时对缓存内容的引用，最后释放
+        std::string owned;      // 错误信息、处理函数生成的响应等，data指向这里
+        body() : data( NULL ), len( 0 ), map( NULL ), map_len( 0 ), cached( NULL ) {}
+        ~body();
+    };
+    typedef std::shared_ptr< body > body_ptr;
+
+    struct stream {
+        int32_t window;         // 对方给这个流的发送窗口
+        std::string block;      // 正在接收的头部块（HEADERS + CONTINUATION）
+        bool end_stream;        // HEADERS是否带END_STREAM（没有请求体）
+        body_ptr resp;          // 响应体，为空表示还没有响应
+        size_t sent;            // 响应体中已经生成DATA帧的字节数
+        bool queued;            // 是否在m_ready中
+        stream() : window( DEFAULT_WINDOW ), end_stream( false ), sent( 0 ), queued( false ) {}
+    };
+
+    // 输出队列中的一项：一个完整的帧（或者升级时的101响应）
+    struct out_item {
+        std::string head;       // 帧头，控制帧和HEADERS帧的内容也放在这里
+        body_ptr data;          // DATA帧的数据所属的响应体，保证发送完之前数据有效
+        const char* ptr;        // DATA帧的数据
+        size_t len;
+        size_t sent;            // 已经发送的字节数（head和数据合在一起计算）
+    };
+
+    // 生成一个帧放入输出队列，payload被拷贝
+    void send_frame( uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, size_t len );
+    void send_goaway( uint32_t error );
+    void send_rst( uint32_t stream_id, uint32_t error );
+    // 处理一个完整的帧
+    bool on_frame( uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len );
+    // 处理SETTINGS帧的参数，返回错误码（ERR_NO_ERROR表示没有错误）
+    uint32_t on_settings( const uint8_t* payload, size_t len );
+    // 一个流的头部块接收完整了，解码并处理请求
+    bool on_headers_done( uint32_t stream_id );
+    // 处理一个请求：生成响应头放入输出队列，响应体交给DATA帧的调度
+    void handle_request( uint32_t stream_id, const header_list& headers );
+    // 获取目标文件作为响应体，返回状态码（与http_conn::do_request/do_file_io的处理一致）
+    int resolve_file( const std::string& path, body_ptr& resp, std::string& type );
+    // 发送响应头，并安排发送响应体
+    void respond( uint32_t stream_id, int status, const std::string& type, const std::string& extra, body_ptr resp );
+    // 轮流给各个流生成DATA帧，直到输出队列足够多或者窗口用完
+    void schedule();
+    void make_ready( uint32_t stream_id, stream& s );
+
+private:
+    int m_sockfd;
+    client_slot* m_client_slot;         // 每个新的流从这个IP的令牌桶中取一个令牌，和HTTP/1.1的每个请求一样
+    char m_in[ INPUT_BUFFER_SIZE ];     // 输入缓冲区
+    int m_in_len;
+    bool m_preface_ok;                  // 是否已经收到客户端的连接前言
+    bool m_closing;                     // 已经发送或收到GOAWAY，不再处理新的请求
+    bool m_failed;                      // 出错了（已经发送GOAWAY），不再处理收到的任何帧
+    uint32_t m_last_stream;             // 收到的最大的流标识符
+    uint32_t m_continuation;            // 正在等待CONTINUATION帧的流，0表示没有
+
+    hpack_decoder m_decoder;
+    std::map< uint32_t, stream > m_streams;
+    std::deque< uint32_t > m_ready;     // 有响应体要发送、并且窗口未用完的流，轮流发送
+
+    int64_t m_conn_window;              // 对方给整个连接的发送窗口
+    int32_t m_initial_window;           // 对方设置的流的初始窗口大小
+    uint32_t m_peer_max_frame;          // 对方能接受的最大帧
+
+    std::deque< out_item > m_out;       // 输出队列
+    size_t m_out_bytes;                 // 输出队列中还没发送的字节数
+};
+
+#endif
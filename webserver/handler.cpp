@@ -0,0 +1,136 @@
+#include "handler.h"
+
+#include <strings.h>
+
+
+// 查找请求头，名字忽略大小写
+std::string_view request_view::find_header( std::string_view name ) const {
+    for( int i = 0; i < header_count; ++i ) {
+        if( headers[i].name.size() == name.size()
+                && strncasecmp( headers[i].name.data(), name.data(), name.size() ) == 0 ) {
+            return headers[i].value;
+        }
+    }
+    return std::string_view();
+}
+
+
+response_builder::response_builder() {
+    reset();
+}
+
+void response_builder::reset() {
+    m_status = 200;
+    m_reason = "OK";
+    m_type = "text/plain";
+    m_headers.clear();
+    m_headers_done = false;
+    m_owned.clear();
+    m_segment_count = 0;
+    m_length = 0;
+}
+
+void response_builder::status( int code, const char* reason ) {
+    m_status = code;
+    m_reason = reason;
+}
+
+void response_builder::content_type( const char* type ) {
+    m_type = type;
+}
+
+void response_builder::header( std::string_view name, std::string_view value ) {
+    m_headers.append( name.data(), name.size() );
+    m_headers.append( ": " );
+    m_headers.append( value.data(), value.size() );
+    m_headers.append( "\r\n" );
+}
+
+// 拷贝一段响应体，和上一块拷贝的数据相邻时直接合并，不占用新的块
+bool response_builder::write( std::string_view data ) {
+    if( data.empty() ) {
+        return true;
+    }
+    segment* last = m_segment_count > 0 ? &m_segments[ m_segment_count - 1 ] : NULL;
+    if( last && last->owned ) {
+        last->len += data.size();
+    } else {
+        if( m_segment_count >= MAX_SEGMENTS ) {
+            return false;
+        }
+        segment& s = m_segments[ m_segment_count++ ];
+        s.owned = true;
+        s.ptr = NULL;
+        s.off = m_owned.size();
+        s.len = data.size();
+    }
+    m_owned.append( data.data(), data.size() );
+    m_length += data.size();
+    return true;
+}
+
+// 引用一段响应体，不拷贝
+bool response_builder::write_ref( const void* data, size_t len ) {
+    if( len == 0 ) {
+        return true;
+    }
+    if( m_segment_count >= MAX_SEGMENTS ) {
+        return false;
+    }
+    segment& s = m_segments[ m_segment_count++ ];
+    s.owned = false;
+    s.ptr = ( const char* )data;
+    s.off = 0;
+    s.len = len;
+    m_length += len;
+    return true;
+}
+
+const std::string& response_builder::extra_headers() {
+    if( !m_headers_done ) {
+        m_headers.append( "\r\n" );
+        m_headers_done = true;
+    }
+    return m_headers;
+}
+
+int response_builder::fill_iov( struct iovec* iov ) const {
+    for( int i = 0; i < m_segment_count; ++i ) {
+        const segment& s = m_segments[i];
+        iov[i].iov_base = ( void* )( s.owned ? m_owned.data() + s.off : s.ptr );
+        iov[i].iov_len = s.len;
+    }
+    return m_segment_count;
+}
+
+
+void router::add( const char* method, const char* path, request_handler h ) {
+    route r;
+    r.method = method;
+    r.path = path;
+    r.prefix = !r.path.empty() && r.path[ r.path.size() - 1 ] == '*';
+    if( r.prefix ) {
+        r.path.erase( r.path.size() - 1 );
+    }
+    r.h = h;
+    m_routes.push_back( r );
+}
+
+const request_handler* router::find( std::string_view method, std::string_view path ) const {
+    const route* best = NULL;
+    for( size_t i = 0; i < m_routes.size(); ++i ) {
+        const route& r = m_routes[i];
+        if( r.method != "*" && r.method != method ) {
+            continue;
+        }
+        if( !r.prefix ) {
+            if( r.path == path ) {
+                return &r.h;
+            }
+        } else if( path.substr( 0, r.path.size() ) == r.path
+                   && ( !best || r.path.size() > best->path.size() ) ) {
+            best = &r;
+        }
+    }
+    return best ? &best->h : NULL;
+}
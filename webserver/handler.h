@@ -0,0 +1,115 @@
+#ifndef HANDLER_H
+#define HANDLER_H
+
+// 动态请求处理接口
+// 除了把url映射到文件之外，还可以把某个url（路由）注册给一个C++函数，由它直接生成响应，
+// 这样一些简单的动态接口（健康检查、状态查询等）就不需要另外起一个服务器了。
+//
+// 处理函数拿到的是请求的只读视图request_view，其中的各个字段都直接指向连接的读缓冲区，没有任何拷贝；
+// 响应通过response_builder生成，响应体可以拷贝一份（write），也可以直接引用调用者的内存（write_ref），
+// 引用的内存最终作为iovec交给writev发送，同样没有拷贝。
+//
+// 路由在main函数中、服务器开始处理请求之前注册，之后只读，所以查找时不需要加锁。
+
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <sys/uio.h>
+
+// 请求的只读视图，只在处理函数执行期间有效
+struct request_view {
+    static const int MAX_HEADERS = 32;      // 最多记录多少个请求头，多出来的忽略
+
+    struct header {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    std::string_view method;                // 请求方法，例如 GET
+    std::string_view path;                  // url中?之前的部分，例如 /api/items
+    std::string_view query;                 // url中?之后的部分（不含?），没有时为空
+    std::string_view version;               // 协议版本，例如 HTTP/1.1
+    std::string_view body;                  // 请求体，没有时为空
+    header headers[ MAX_HEADERS ];
+    int header_count;
+
+    // 查找请求头（名字忽略大小写），找不到返回空
+    std::string_view find_header( std::string_view name ) const;
+};
+
+// 响应生成器
+class response_builder {
+public:
+    static const int MAX_SEGMENTS = 8;      // 响应体最多由多少块内存组成
+
+public:
+    response_builder();
+
+    // 响应行，默认是 200 OK
+    void status( int code, const char* reason );
+    // Content-Type，默认是 text/plain
+    void content_type( const char* type );
+    // 添加一个响应头（会拷贝一份），Content-Length和Connection由服务器添加，不需要处理函数设置
+    void header( std::string_view name, std::string_view value );
+    // 添加一段响应体，拷贝一份，适合临时生成的小块数据
+    bool write( std::string_view data );
+    // 添加一段响应体，不拷贝，只记录地址和长度；data在响应发送完之前必须一直有效（比如静态数据）
+    bool write_ref( const void* data, size_t len );
+    // 清空，准备生成下一个响应
+    void reset();
+
+    int status_code() const { return m_status; }
+    const char* reason() const { return m_reason; }
+    const char* type() const { return m_type; }
+    size_t content_length() const { return m_length; }
+    // 添加的响应头（每个以\r\n结尾），再加上表示响应头结束的空行
+    const std::string& extra_headers();
+    // 把响应体的各块内存填入iov，返回块数
+    int fill_iov( struct iovec* iov ) const;
+
+private:
+    // 一块响应体：引用的内存（owned为false），或者m_owned中的一段（owned为true，ptr无意义）
+    struct segment {
+        bool owned;
+        const char* ptr;
+        size_t off;
+        size_t len;
+    };
+
+    int m_status;
+    const char* m_reason;
+    const char* m_type;
+    std::string m_headers;                  // 添加的响应头
+    bool m_headers_done;                    // m_headers末尾是否已经加上了空行
+    std::string m_owned;                    // write拷贝的数据都放在这里，segment中只记录偏移量（string扩容后地址会变）
+    segment m_segments[ MAX_SEGMENTS ];
+    int m_segment_count;
+    size_t m_length;                        // 响应体的总长度
+};
+
+// 请求处理函数
+typedef std::function< void( const request_view&, response_builder& ) > request_handler;
+
+// 路由表：请求方法 + 路径 -> 处理函数
+class router {
+public:
+    // 注册一个路由。path以*结尾时表示前缀匹配，例如 /api/*；method为"*"时匹配所有方法
+    void add( const char* method, const char* path, request_handler h );
+    // 查找处理函数，先找完全匹配的路由，再找最长的前缀匹配，都没有时返回NULL
+    const request_handler* find( std::string_view method, std::string_view path ) const;
+    bool empty() const { return m_routes.empty(); }
+
+private:
+    struct route {
+        std::string method;
+        std::string path;       // 前缀匹配时不含末尾的*
+        bool prefix;
+        request_handler h;
+    };
+    // 路由一般只有几个到几十个，顺序查找比哈希表（需要先构造std::string）更快
+    std::vector< route > m_routes;
+};
+
+#endif
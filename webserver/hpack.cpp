@@ -0,0 +1,315 @@
+#include "hpack.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+// 静态表（RFC 7541 附录A），下标0不用
+static const char* const static_table[][ 2 ] = {
+    { "", "" },
+    { ":authority", "" }, { ":method", "GET" },
+    { ":method", "POST" }, { ":path", "/" },
+    { ":path", "/index.html" }, { ":scheme", "http" },
+    { ":scheme", "https" }, { ":status", "200" },
+    { ":status", "204" }, { ":status", "206" },
+    { ":status", "304" }, { ":status", "400" },
+    { ":status", "404" }, { ":status", "500" },
+    { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" }, { "accept-ranges", "" },
+    { "accept", "" }, { "access-control-allow-origin", "" },
+    { "age", "" }, { "allow", "" },
+    { "authorization", "" }, { "cache-control", "" },
+    { "content-disposition", "" }, { "content-encoding", "" },
+    { "content-language", "" }, { "content-length", "" },
+    { "content-location", "" }, { "content-range", "" },
+    { "content-type", "" }, { "cookie", "" },
+    { "date", "" }, { "etag", "" },
+    { "expect", "" }, { "expires", "" },
+    { "from", "" }, { "host", "" },
+    { "if-match", "" }, { "if-modified-since", "" },
+    { "if-none-match", "" }, { "if-range", "" },
+    { "if-unmodified-since", "" }, { "last-modified", "" },
+    { "link", "" }, { "location", "" },
+    { "max-forwards", "" }, { "proxy-authenticate", "" },
+    { "proxy-authorization", "" }, { "range", "" },
+    { "referer", "" }, { "refresh", "" },
+    { "retry-after", "" }, { "server", "" },
+    { "set-cookie", "" }, { "strict-transport-security", "" },
+    { "transfer-encoding", "" }, { "user-agent", "" },
+    { "vary", "" }, { "via", "" },
+    { "www-authenticate", "" },
+};
+static const uint64_t STATIC_TABLE_SIZE = 61;
+
+// 哈夫曼编码（RFC 7541 附录B）中每个符号的编码长度，最后一个是EOS（256）
+// 这是一个范式哈夫曼编码：按（长度，符号）排序后，编码值依次加1（长度增加时左移），
+// 所以只需要长度就能还原出编码，解码时按长度逐位比较即可，不需要保存整张编码表
+static const uint8_t huffman_code_len[ 257 ] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// 范式哈夫曼解码用到的表：每种长度的第一个编码、编码数量，以及按（长度，符号）排序的符号
+struct huffman_table {
+    uint32_t first_code[ 31 ];
+    uint16_t count[ 31 ];
+    uint16_t offset[ 31 ];
+    uint16_t symbols[ 257 ];
+
+    huffman_table() {
+        memset( count, 0, sizeof( count ) );
+        for( int s = 0; s < 257; ++s ) {
+            ++count[ huffman_code_len[ s ] ];
+        }
+        uint32_t code = 0;
+        uint16_t off = 0;
+        for( int len = 1; len <= 30; ++len ) {
+            code = ( code + ( len > 1 ? count[ len - 1 ] : 0 ) ) << 1;
+            first_code[ len ] = code;
+            offset[ len ] = off;
+            off += count[ len ];
+        }
+        uint16_t next[ 31 ];
+        memcpy( next, offset, sizeof( next ) );
+        for( int len = 1; len <= 30; ++len ) {
+            for( int s = 0; s < 257; ++s ) {
+                if( huffman_code_len[ s ] == len ) {
+                    symbols[ next[ len ]++ ] = s;
+                }
+            }
+        }
+    }
+};
+static const huffman_table huffman;
+
+
+bool hpack_decode_int( const uint8_t*& p, const uint8_t* end, int prefix, uint64_t& value ) {
+    if( p >= end ) {
+        return false;
+    }
+    uint64_t mask = ( 1u << prefix ) - 1;
+    value = *p++ & mask;
+    if( value < mask ) {
+        return true;
+    }
+    // 超出前缀的部分，每个字节7位，最高位为1表示后面还有
+    int shift = 0;
+    while( p < end ) {
+        uint8_t b = *p++;
+        value += ( uint64_t )( b & 0x7f ) << shift;
+        if( !( b & 0x80 ) ) {
+            return true;
+        }
+        shift += 7;
+        if( shift > 56 ) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool hpack_huffman_decode( const uint8_t* data, size_t len, std::string& out ) {
+    uint32_t code = 0;
+    int bits = 0;
+    for( size_t i = 0; i < len; ++i ) {
+        for( int b = 7; b >= 0; --b ) {
+            code = ( code << 1 ) | ( ( data[ i ] >> b ) & 1 );
+            ++bits;
+            if( bits > 30 ) {
+                return false;
+            }
+            if( code - huffman.first_code[ bits ] < huffman.count[ bits ] ) {
+                uint16_t sym = huffman.symbols[ huffman.offset[ bits ] + code - huffman.first_code[ bits ] ];
+                if( sym == 256 ) {
+                    return false;   // 数据中不能出现EOS
+                }
+                out.push_back( ( char )sym );
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+    // 末尾的填充必须是EOS编码的前缀（全1），且不超过7位
+    return bits < 8 && code == ( 1u << bits ) - 1;
+}
+
+bool hpack_decode_string( const uint8_t*& p, const uint8_t* end, std::string& out ) {
+    if( p >= end ) {
+        return false;
+    }
+    bool huffman_coded = *p & 0x80;
+    uint64_t len;
+    if( !hpack_decode_int( p, end, 7, len ) || len > ( uint64_t )( end - p ) ) {
+        return false;
+    }
+    out.clear();
+    bool ok = true;
+    if( huffman_coded ) {
+        ok = hpack_huffman_decode( p, len, out );
+    } else {
+        out.assign( ( const char* )p, len );
+    }
+    p += len;
+    return ok;
+}
+
+
+hpack_decoder::hpack_decoder() : m_size( 0 ), m_max_size( DEFAULT_TABLE_SIZE ) {
+}
+
+bool hpack_decoder::lookup( uint64_t index, std::string& name, std::string& value ) const {
+    if( index == 0 ) {
+        return false;
+    }
+    if( index <= STATIC_TABLE_SIZE ) {
+        name = static_table[ index ][ 0 ];
+        value = static_table[ index ][ 1 ];
+        return true;
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if( index >= m_table.size() ) {
+        return false;
+    }
+    name = m_table[ index ].first;
+    value = m_table[ index ].second;
+    return true;
+}
+
+void hpack_decoder::evict( size_t size ) {
+    while( m_size > size && !m_table.empty() ) {
+        m_size -= m_table.back().first.size() + m_table.back().second.size() + 32;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::insert( const std::string& name, const std::string& value ) {
+    size_t entry_size = name.size() + value.size() + 32;
+    if( entry_size > m_max_size ) {
+        // 比整个动态表还大的表项，插入的结果是清空动态表
+        evict( 0 );
+        return;
+    }
+    evict( m_max_size - entry_size );
+    m_table.push_front( std::make_pair( name, value ) );
+    m_size += entry_size;
+}
+
+// 头部列表还没超过上限时，追加一个头部
+static void append_header( header_list& out, const std::string& name, const std::string& value,
+                           size_t& list_size, size_t max_list_size, bool& too_large ) {
+    list_size += name.size() + value.size() + 32;
+    if( list_size > max_list_size ) {
+        too_large = true;
+    }
+    if( !too_large ) {
+        out.push_back( std::make_pair( name, value ) );
+    }
+}
+
+bool hpack_decoder::decode( const uint8_t* data, size_t len, header_list& out, size_t max_list_size, bool& too_large ) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    std::string name, value;
+    size_t list_size = 0;
+    too_large = false;
+    while( p < end ) {
+        uint8_t b = *p;
+        uint64_t index;
+        if( b & 0x80 ) {
+            // 1xxxxxxx：索引的头部
+            if( !hpack_decode_int( p, end, 7, index ) || !lookup( index, name, value ) ) {
+                return false;
+            }
+            append_header( out, name, value, list_size, max_list_size, too_large );
+            continue;
+        }
+        if( ( b & 0xe0 ) == 0x20 ) {
+            // 001xxxxx：动态表大小更新，不能超过我们在SETTINGS中通告的大小
+            if( !hpack_decode_int( p, end, 5, index ) || index > DEFAULT_TABLE_SIZE ) {
+                return false;
+            }
+            m_max_size = index;
+            evict( m_max_size );
+            continue;
+        }
+        // 01xxxxxx：字面量，加入动态表；0000xxxx / 0001xxxx：字面量，不加入动态表
+        bool indexing = ( b & 0xc0 ) == 0x40;
+        if( !hpack_decode_int( p, end, indexing ? 6 : 4, index ) ) {
+            return false;
+        }
+        if( index == 0 ) {
+            if( !hpack_decode_string( p, end, name ) ) {
+                return false;
+            }
+        } else if( !lookup( index, name, value ) ) {
+            return false;
+        }
+        if( !hpack_decode_string( p, end, value ) ) {
+            return false;
+        }
+        if( indexing ) {
+            insert( name, value );
+        }
+        append_header( out, name, value, list_size, max_list_size, too_large );
+    }
+    return true;
+}
+
+
+void hpack_encode_status( std::string& out, int status ) {
+    // 静态表中:status的几个值
+    static const int indexed[][ 2 ] = { { 200, 8 }, { 204, 9 }, { 206, 10 }, { 304, 11 },
+                                        { 400, 12 }, { 404, 13 }, { 500, 14 } };
+    for( size_t i = 0; i < sizeof( indexed ) / sizeof( indexed[ 0 ] ); ++i ) {
+        if( indexed[ i ][ 0 ] == status ) {
+            out.push_back( ( char )( 0x80 | indexed[ i ][ 1 ] ) );
+            return;
+        }
+    }
+    char text[ 16 ];
+    int n = snprintf( text, sizeof( text ), "%d", status );
+    hpack_encode_header( out, 8, NULL, text, n );
+}
+
+// 编码一个整数，first为第一个字节中前缀之外的高位
+static void encode_int( std::string& out, uint8_t first, int prefix, uint64_t value ) {
+    uint64_t mask = ( 1u << prefix ) - 1;
+    if( value < mask ) {
+        out.push_back( ( char )( first | value ) );
+        return;
+    }
+    out.push_back( ( char )( first | mask ) );
+    value -= mask;
+    while( value >= 0x80 ) {
+        out.push_back( ( char )( 0x80 | ( value & 0x7f ) ) );
+        value >>= 7;
+    }
+    out.push_back( ( char )value );
+}
+
+void hpack_encode_header( std::string& out, int name_index, const char* name, const char* value, size_t value_len ) {
+    // 0000xxxx：不加入动态表的字面量
+    encode_int( out, 0x00, 4, name_index );
+    if( name_index == 0 ) {
+        size_t name_len = strlen( name );
+        encode_int( out, 0x00, 7, name_len );
+        out.append( name, name_len );
+    }
+    encode_int( out, 0x00, 7, value_len );
+    out.append( value, value_len );
+}
@@ -0,0 +1,58 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+// HTTP/2的头部压缩（HPACK，RFC 7541）
+// 解码器完整实现了静态表、动态表和哈夫曼编码；
+// 编码器只用到静态表和不加索引的字面量（不维护动态表，也不做哈夫曼编码），
+// 服务器的响应头只有寥寥几个，这样已经足够，而且不需要为每个连接保存编码状态
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <utility>
+
+typedef std::vector< std::pair< std::string, std::string > > header_list;
+
+class hpack_decoder {
+public:
+    static const size_t DEFAULT_TABLE_SIZE = 4096;     // 动态表的默认大小（SETTINGS_HEADER_TABLE_SIZE的默认值）
+
+public:
+    hpack_decoder();
+
+    // 解码一个完整的头部块（HEADERS及其后的CONTINUATION帧的内容拼起来），解码出的头部追加到out中
+    // 数据有误时返回false，此时连接必须以COMPRESSION_ERROR关闭
+    // 解码出的头部列表的大小（每个头部按名字长度 + 值长度 + 32计算）超过max_list_size时，
+    // 后面的头部不再追加到out中、too_large置为true，但整个头部块仍然会解码完，动态表和对方保持一致
+    // （几个字节的索引就能引用动态表中很长的头部，不限制的话一个小小的头部块能解码出几十MB）
+    bool decode( const uint8_t* data, size_t len, header_list& out, size_t max_list_size, bool& too_large );
+
+private:
+    // 按索引查找头部（1~61为静态表，62及以后为动态表）
+    bool lookup( uint64_t index, std::string& name, std::string& value ) const;
+    // 插入动态表，必要时淘汰最早的表项
+    void insert( const std::string& name, const std::string& value );
+    // 淘汰表项，直到动态表的大小不超过size
+    void evict( size_t size );
+
+private:
+    std::deque< std::pair< std::string, std::string > > m_table;   // 动态表，最新插入的在最前面
+    size_t m_size;          // 动态表当前的大小（每个表项按名字长度 + 值长度 + 32计算）
+    size_t m_max_size;      // 动态表当前的大小上限（由编码方通过动态表大小更新指令设置）
+};
+
+// 解码一个带前缀的整数，prefix为前缀的位数（1~8），成功时p指向整数之后的位置
+bool hpack_decode_int( const uint8_t*& p, const uint8_t* end, int prefix, uint64_t& value );
+// 解码一个字符串（可能是哈夫曼编码的）
+bool hpack_decode_string( const uint8_t*& p, const uint8_t* end, std::string& out );
+// 哈夫曼解码
+bool hpack_huffman_decode( const uint8_t* data, size_t len, std::string& out );
+
+// 编码:status伪头部，200、204、206、304、400、404、500直接使用静态表的索引
+void hpack_encode_status( std::string& out, int status );
+// 编码一个不加索引的字面量头部，name_index为名字在静态表中的索引（0表示名字也用字面量）
+void hpack_encode_header( std::string& out, int name_index, const char* name, const char* value, size_t value_len );
+
+#endif
@@ -1,14 +1,22 @@
 #include "http_conn.h"
+#include <sys/eventfd.h>
+#include <ctype.h>
+#include <openssl/err.h>
 
-// 网站的根目录（就是网站资源的路径）
+// 网站的根目录（就是网站资源的路径），可以在配置文件或者命令行中修改（doc_root，-d）
 const char* doc_root = "/home/ljchen/webserver/resources";
 
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
+const char* ok_201_title = "Created";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "You are sending requests too fast, please retry later.\n";
+const char* error_431_title = "Request Header Fields Too Large";
+const char* error_431_form = "The request headers are too large to be forwarded.\n";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
@@ -16,11 +24,53 @@ const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
 
 // ----- 静态变量的值必须初始化
-// 所有的客户数，所有http_conn共用一个m_user_count
-int http_conn::m_user_count = 0;
+// 所有的客户数，所有http_conn共用一个m_user_count（单独占一个缓存行，见http_conn.h）
+cacheline_padded< int > http_conn::m_user_count = { 0 };
 // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
 // 在main函数中，这个值会被重新赋值为创建出来的epollfd
 int http_conn::m_epollfd = -1;
+// 默认不记录连接的来源CPU，在main函数中根据命令行参数开启
+bool http_conn::m_steering = false;
+// 404的响应内容是固定的，事先生成好完整的响应（保持连接和不保持连接两种），
+// 大量请求不存在的资源时，直接拷贝即可，不需要每次格式化
+static std::string build_not_found( bool linger ) {
+    char buf[ 512 ];
+    snprintf( buf, sizeof( buf ), "HTTP/1.1 404 %s\r\nContent-Length: %d\r\nContent-Type:%s\r\nConnection: %s\r\n\r\n%s",
+              error_404_title, ( int )strlen( error_404_form ), "text/html", linger ? "keep-alive" : "close", error_404_form );
+    return buf;
+}
+static const std::string not_found_keep_alive = build_not_found( true );
+static const std::string not_found_close = build_not_found( false );
+
+// 所有连接共享的文件缓存
+file_cache http_conn::m_file_cache;
+// 高优先级请求的url前缀，在main函数中根据命令行参数设置
+std::vector< std::string > http_conn::m_priority_prefixes;
+// I/O线程池，默认不开启，在main函数中根据命令行参数创建
+threadpool< http_conn::io_task >* http_conn::m_io_pool = NULL;
+// 资源包，默认不开启，在main函数中根据命令行参数创建
+asset_bundle* http_conn::m_bundle = NULL;
+// 上传目录，默认不支持上传，在main函数中根据命令行参数设置
+const char* http_conn::m_upload_dir = NULL;
+// 动态请求处理函数的路由表，在main函数中注册
+router http_conn::m_router;
+// 默认不支持HTTP/2，在main函数中根据命令行参数设置
+bool http_conn::m_h2c_enabled = false;
+// TLS上下文，在main函数中根据命令行参数创建
+tls_context* http_conn::m_tls = NULL;
+// WebSocket端点，在main函数中注册
+std::map< std::string, ws_endpoint, std::less<> > http_conn::m_ws_endpoints;
+// 反向代理路由，默认没有，在main函数中根据命令行参数配置
+std::vector< proxy_route > http_conn::m_proxy_routes;
+// 按客户端IP限流，默认不限制，在main函数中根据命令行参数配置
+client_limiter http_conn::m_limiter;
+// 工作线程交还给主线程关闭的连接：无锁的栈（多个工作线程压入，主线程一次取走全部），和通知主线程的eventfd
+int http_conn::m_done_fd = -1;
+// 读写缓冲区的大小，在main函数中根据配置设置（分配缓冲区之前）
+int http_conn::m_read_buffer_size = 2048;
+int http_conn::m_write_buffer_size = 1024;
+// 栈顶被所有工作线程CAS修改，单独占一个缓存行，不影响工作线程读取上面这些只读的配置
+static cacheline_padded< std::atomic< http_conn* > > done_head = { { NULL } };
 
 
 // -----------------------------------------------
@@ -60,8 +110,8 @@ int http_conn::m_epollfd = -1;
 // http_conn::HTTP_CODE http_conn::parse_request_line(char* text);
 // // 解析HTTP请求的一个头部信息
 // http_conn::HTTP_CODE http_conn::parse_headers(char* text);
-// // 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-// http_conn::HTTP_CODE http_conn::parse_content( char* text );
+// // 解析请求体，边读边保存，不需要等请求体全部读入读缓冲区
+// http_conn::HTTP_CODE http_conn::parse_content();
 // // 解析一行，判断依据\r\n（就是从状态机了）
 // http_conn::LINE_STATE http_conn::parse_line();
 // // 当得到一个完整、正确的HTTP请求时，我们就分析目标文件的属性，
@@ -169,42 +219,89 @@ void modfd(int epollfd, int fd, int ev) {
     epoll_event event;
     event.data.fd = fd;
     event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
-    epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
+    // 接受连接时马上读取了请求的连接还没有注册到epoll中（见http_conn::init），第一次重新注册时再加入
+    if ( epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event ) != 0 && errno == ENOENT ) {
+        epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
+    }
 }
 
 
 // 关闭连接
 void http_conn::close_conn() {
     if(m_sockfd != -1) {
+        WS_PROBE1( close, m_sockfd );
+        discard_body();  // 没有接收完的请求体不再需要了
+        delete m_h2;
+        m_h2 = NULL;
+        delete m_ws;     // 退订所有频道，之后广播者不会再访问这个连接
+        m_ws = NULL;
+        delete m_proxy;  // 还没转发完的上游连接也一起关闭
+        m_proxy = NULL;
+        unmap();         // 还没发送完的文件
+        if ( m_ssl ) {
+            tls_close( m_ssl );  // 先发送close_notify，再关闭socket
+            m_ssl = NULL;
+        }
         removefd(m_epollfd, m_sockfd);
+        if ( m_client_slot ) {
+            m_limiter.release( m_client_slot );  // 这个IP的连接数减1
+            m_client_slot = NULL;
+        }
         m_sockfd = -1;   // 置为-1即表示该http_conn没有用了
-        m_user_count--; // 关闭一个连接，将客户总数量-1
+        m_user_count.value--; // 关闭一个连接，将客户总数量-1
     }
 }
 
 
 // 初始化连接,外部调用初始化套接字地址
 // 这个函数其实进行了http_conn类的初始化工作
-void http_conn::init(int sockfd, const sockaddr_in& addr){
+void http_conn::init(int sockfd, const sockaddr_in& addr, client_slot* slot, bool watch){
     m_sockfd = sockfd;
     m_address = addr;
+    m_client_slot = slot;
+    m_io_task.conn = this;
+    m_body_fd = -1;
+    m_h2 = NULL;
+    m_ws = NULL;
+    m_proxy = NULL;
+    m_ssl = m_tls ? m_tls->accept( sockfd ) : NULL;
     
     // 设置端口复用
     int reuse = 1;
     setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
 
+    // 记录该连接的数据是在哪个CPU上收到的，之后把任务交给这个CPU上的工作线程处理，
+    // 这样处理请求时，网卡中断和协议栈刚刚处理过的数据还在这个CPU的缓存中
+    m_incoming_cpu = -1;
+    if( m_steering ) {
+        socklen_t len = sizeof( m_incoming_cpu );
+        if( getsockopt( m_sockfd, SOL_SOCKET, SO_INCOMING_CPU, &m_incoming_cpu, &len ) != 0 ) {
+            m_incoming_cpu = -1;
+        }
+    }
+
     // 将新连接进来的sockfd加入到epoll对象中
-    addfd( m_epollfd, sockfd, true );
+    // 主线程接受连接后马上读取请求时先不注册：读到了请求就直接处理，处理完重新注册事件时（modfd）才加入epoll，
+    // 这样短连接从接受到关闭都不需要epoll_ctl；没有读到数据时再调用watch()注册
+    if ( watch ) {
+        addfd( m_epollfd, sockfd, true );
+    } else {
+        setnonblocking( sockfd );
+    }
 
     // 更新m_user_count
     // 此处m_user_count不用考虑互斥问题和数据同步问题
-    // 因为m_user_count只有主线程进行操作，工作线程不会操作m_user_count
+    // 因为m_user_count只有主线程进行操作，工作线程不会操作m_user_count（关闭连接也交还给主线程，见hand_back）
     // 主线程只有一个，当然不用考虑互斥同步问题了
-    m_user_count++; 
+    m_user_count.value++; 
     init(); // 初始化连接的其他数据
 }
 
 
+void http_conn::watch() {
+    addfd( m_epollfd, m_sockfd, true );
+}
+
 // 初始化连接的其他数据
 void http_conn::init() {
     // ---------- 这个函数初始化的数据成员大部分是http报文的一些字段
@@ -213,32 +310,97 @@ void http_conn::init() {
 
     m_check_state = CHECK_STATE_REQUESTLINE;    // 初始状态为检查请求行
     m_linger = false;       // 默认不保持链接  Connection : keep-alive保持连接
+    m_status = 0;
 
     m_method = GET;         // 默认请求方式为GET
     m_url = 0;              // 要获取的文件资源 
     m_version = 0;          // http版本号
     m_content_length = 0;   // 请求体body的长度  
+    m_handler = NULL;       // 默认按文件处理
+    m_inline = false;
+    m_file_pending = false;
+    m_upgrade_h2c = false;
+    m_h2_settings = NULL;
+    m_upgrade_ws = false;
+    m_ws_key = NULL;
+    m_upstream = NULL;
+    m_request.header_count = 0;
+    m_request.body = std::string_view();
+    m_response.reset();
+    discard_body();         // 上一个请求没有接收完的请求体（如果有的话）
+    m_chunked = false;      // 默认请求体不是分块传输的
+    m_chunk_state = CHUNK_SIZE;
+    m_chunk_left = 0;
+    m_body_received = 0;
+    m_body_start = 0;
     m_host = 0;             // 主机名
     m_start_line = 0;       // 当前正在解析的行的第一个字符（即该行的起始位置）在所有报文字符中的位置。与m_checked_idx搭配
     m_checked_idx = 0;      // 当前正在分析的字符在读缓冲区中的位置（因为我们解析报文肯定也是一个一个字符往后遍历的）
     m_read_idx = 0;         // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置（这个只用于读取数据，不用于分析数据）
     m_write_idx = 0;        // 写缓冲区中待发送的字节数
-    bzero(m_read_buf, READ_BUFFER_SIZE);    // 清空读缓冲
-    bzero(m_write_buf, READ_BUFFER_SIZE);   // 清空写缓冲
+    m_bytes_to_send = 0;    // 没有要发送的响应
+    m_bytes_have_send = 0;
+    m_from_bundle = false;  // 响应的数据不是来自资源包
+    // 是否跟踪这个请求，跟踪时从这里（连接建立，或者上一个响应发完）开始计时
+    m_traced = tracer::sample();
+    if ( m_traced ) {
+        memset( &m_trace, 0, sizeof( m_trace ) );
+        m_trace.fd = m_sockfd;
+        m_trace.t[ TRACE_ACCEPT ] = tracer::now();
+    }
+    bzero(m_read_buf, m_read_buffer_size);    // 清空读缓冲
+    bzero(m_write_buf, m_write_buffer_size);  // 清空写缓冲
     bzero(m_real_file, FILENAME_LEN);       // 清空目标文件路径
 }
 
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read() {
+    // HTTP/2连接的数据由会话自己读取
+    if ( m_h2 ) {
+        return m_h2->read();
+    }
+    // WebSocket连接的数据由会话自己读取
+    if ( m_ws ) {
+        return m_ws->read();
+    }
+    if ( m_tls ) {
+        // 创建SSL对象失败
+        if ( !m_ssl ) {
+            return false;
+        }
+        // 握手还没有完成，交给工作线程推进握手（握手中的非对称运算比较耗时，不放在主线程中）
+        if ( !SSL_is_init_finished( m_ssl ) ) {
+            return true;
+        }
+    }
     // 如果要读的数据大于缓冲区的大小，返回失败
-    if( m_read_idx >= READ_BUFFER_SIZE ) {
+    if( m_read_idx >= m_read_buffer_size ) {
         return false;
     }
     // 读取到的字节（就是recv函数的返回值）
     int bytes_read = 0;
+    int start_idx = m_read_idx;
     while(true) {
-        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是READ_BUFFER_SIZE - m_read_idx
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        // 读缓冲区满了，先停止读取，等工作线程处理（比如把请求体保存下来）腾出空间后再继续读
+        if ( m_read_idx >= m_read_buffer_size ) {
+            break;
+        }
+        if ( m_ssl ) {
+            // TLS连接：读出解密之后的数据
+            ERR_clear_error();
+            bytes_read = SSL_read( m_ssl, m_read_buf + m_read_idx, m_read_buffer_size - m_read_idx );
+            if ( bytes_read <= 0 ) {
+                int err = SSL_get_error( m_ssl, bytes_read );
+                if ( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ) {
+                    break;
+                }
+                return false;   // 对方关闭连接（close_notify）或者出错
+            }
+            m_read_idx += bytes_read;
+            continue;
+        }
+        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是m_read_buffer_size - m_read_idx
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, m_read_buffer_size - m_read_idx, 0 );
         if (bytes_read == -1) {
             if( errno == EAGAIN || errno == EWOULDBLOCK ) {
                 // 没有数据的话，跳出while循环，读取结束
@@ -251,6 +413,7 @@ bool http_conn::read() {
         // 否则走到这里就是能正确的读到数据，bytes_read > 0
         m_read_idx += bytes_read;
     }
+    WS_PROBE3( read, m_sockfd, m_read_idx - start_idx, m_read_idx );
     return true;
 }
 
@@ -304,6 +467,20 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     // strcasecmp是忽略大小写的比较
     if ( strcasecmp(method, "GET") == 0 ) { // 忽略大小写比较，如果是GET方法
         m_method = GET;
+    } else if ( ( m_upload_dir || !m_router.empty() || !m_proxy_routes.empty() ) && strcasecmp(method, "POST") == 0 ) {
+        // 设置了上传目录或者注册了处理函数时才支持POST和PUT，具体能不能处理要等请求头解析完再判断
+        m_method = POST;
+    } else if ( ( m_upload_dir || !m_router.empty() || !m_proxy_routes.empty() ) && strcasecmp(method, "PUT") == 0 ) {
+        m_method = PUT;
+    } else if ( ( !m_router.empty() || !m_proxy_routes.empty() ) && strcasecmp(method, "DELETE") == 0 ) {
+        m_method = DELETE;
+    } else if ( !m_proxy_routes.empty() && strcasecmp(method, "HEAD") == 0 ) {
+        // 下面这些方法只能转发给上游，请求头解析完之后如果没有匹配反向代理路由，还是回复400
+        m_method = HEAD;
+    } else if ( !m_proxy_routes.empty() && strcasecmp(method, "OPTIONS") == 0 ) {
+        m_method = OPTIONS;
+    } else if ( !m_proxy_routes.empty() && strcasecmp(method, "PATCH") == 0 ) {
+        m_method = PATCH;
     } else {
         return BAD_REQUEST;
     }
@@ -333,6 +510,19 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
         return BAD_REQUEST;
     }
 
+    // 请求视图直接指向读缓冲区中已经分割好的各个字段
+    m_request.method = std::string_view( method );
+    m_request.version = std::string_view( m_version );
+    std::string_view url( m_url );
+    size_t q = url.find( '?' );
+    m_request.path = url.substr( 0, q );
+    m_request.query = q == std::string_view::npos ? std::string_view() : url.substr( q + 1 );
+
+    // 每个请求从这个客户端IP的令牌桶中取一个令牌，取不到时回复429并关闭连接（请求的其余部分不再解析）
+    if ( m_client_slot && !m_limiter.allow_request( m_client_slot ) ) {
+        return TOO_MANY_REQUESTS;
+    }
+
     // 更改检查状态（主状态机状态）为检查请求头状态
     m_check_state = CHECK_STATE_HEADER; 
     return NO_REQUEST;
@@ -340,11 +530,39 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
 
 // 解析HTTP请求的一个头部信息
 http_conn::HTTP_CODE http_conn::parse_headers(char* text) {   
+    // 每个头部字段都记录到请求视图中，交给处理函数使用（只记录位置，不拷贝）
+    const char* colon = strchr( text, ':' );
+    if ( colon && m_request.header_count < request_view::MAX_HEADERS ) {
+        request_view::header& hdr = m_request.headers[ m_request.header_count++ ];
+        hdr.name = std::string_view( text, colon - text );
+        hdr.value = std::string_view( colon + 1 + strspn( colon + 1, " \t" ) );
+    }
+
     // 遇到空行，表示头部字段解析完毕
     if( text[0] == '\0' ) {
-        // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
+        // 匹配反向代理路由的请求（不管什么方法、有没有请求体）都转发给上游，请求体由转发过程边读边发
+        if ( !m_proxy_routes.empty() && ( m_upstream = find_upstream( m_request.path ) ) ) {
+            return PROXY_REQUEST;
+        }
+        // 有注册的处理函数就交给处理函数，否则只有GET（读文件）和设置了上传目录时的POST/PUT（上传）能处理
+        m_handler = m_router.find( m_request.method, m_request.path );
+        if ( !m_handler && m_method != GET && !( m_upload_dir && ( m_method == POST || m_method == PUT ) ) ) {
+            return BAD_REQUEST;
+        }
+        // 注册了WebSocket端点的路径上，GET请求可以升级到WebSocket
+        if ( m_upgrade_ws && m_ws_key && m_method == GET && m_ws_endpoints.count( m_request.path ) ) {
+            return UPGRADE_WS;
+        }
+        // 没有请求体的GET请求可以升级到HTTP/2，这个请求本身作为流1，在HTTP/2中响应
+        if ( m_upgrade_h2c && m_h2_settings && m_method == GET && m_content_length == 0 && !m_chunked ) {
+            return UPGRADE_H2C;
+        }
+        // 如果HTTP请求有消息体，则还需要读取m_content_length字节（或者分块传输）的消息体，
         // 状态机转移到CHECK_STATE_CONTENT状态
-        if ( m_content_length != 0 ) {
+        if ( m_content_length != 0 || m_chunked ) {
+            if ( !begin_body() ) {
+                return BAD_REQUEST;
+            }
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
@@ -367,7 +585,49 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
         text += 15;
         text += strspn( text, " \t" );
         m_content_length = atol(text);
+        if ( m_content_length < 0 || m_content_length > MAX_BODY_SIZE ) {
+            return BAD_REQUEST;
+        }
     } 
+    // Transfer-Encoding字段，只支持chunked
+    else if ( strncasecmp( text, "Transfer-Encoding:", 18 ) == 0 ) {
+        text += 18;
+        text += strspn( text, " \t" );
+        if ( strcasecmp( text, "chunked" ) != 0 ) {
+            return BAD_REQUEST;
+        }
+        m_chunked = true;
+    } 
+    // Upgrade字段，处理升级到h2c和WebSocket
+    else if ( strncasecmp( text, "Upgrade:", 8 ) == 0 ) {
+        text += 8;
+        text += strspn( text, " \t" );
+        if ( m_h2c_enabled && !m_ssl && strcasecmp( text, "h2c" ) == 0 ) {
+            m_upgrade_h2c = true;
+        } else if ( strcasecmp( text, "websocket" ) == 0 ) {
+            m_upgrade_ws = true;
+        }
+    }
+    // Sec-WebSocket-Key字段，升级到WebSocket时用来计算Sec-WebSocket-Accept
+    else if ( strncasecmp( text, "Sec-WebSocket-Key:", 18 ) == 0 ) {
+        text += 18;
+        text += strspn( text, " \t" );
+        m_ws_key = text;
+    }
+    // Sec-WebSocket-Version字段，只支持13（RFC 6455）
+    else if ( strncasecmp( text, "Sec-WebSocket-Version:", 22 ) == 0 ) {
+        text += 22;
+        text += strspn( text, " \t" );
+        if ( strcmp( text, "13" ) != 0 ) {
+            return BAD_REQUEST;
+        }
+    }
+    // HTTP2-Settings字段，升级到h2c时客户端的SETTINGS
+    else if ( strncasecmp( text, "HTTP2-Settings:", 15 ) == 0 ) {
+        text += 15;
+        text += strspn( text, " \t" );
+        m_h2_settings = text;
+    }
     // Host字段
     else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
         // 处理Host头部字段
@@ -383,14 +643,187 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
     return NO_REQUEST;
 }
 
-// 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content( char* text ) {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
-    {
-        text[ m_content_length ] = '\0';
+// 请求头解析完毕，准备接收请求体
+// POST/PUT的请求体保存到上传目录中的一个临时文件里，其他请求的请求体直接丢弃
+bool http_conn::begin_body() {
+    // 请求头之后的读缓冲区空间用来接收请求体，太小的话就没法处理了
+    m_body_start = m_checked_idx;
+    if ( m_read_buffer_size - m_body_start < MIN_BODY_SPACE ) {
+        return false;
+    }
+    // 交给处理函数的请求体要完整地留在读缓冲区中（请求视图直接指向它），所以不能太大，也不支持分块传输
+    if ( m_handler ) {
+        return !m_chunked && m_content_length <= m_read_buffer_size - m_body_start;
+    }
+    if ( m_method != POST && m_method != PUT ) {
+        return true;
+    }
+    // 临时文件的路径保存在m_real_file中（上传请求不会用到m_real_file）
+    int n = snprintf( m_real_file, FILENAME_LEN, "%s/.upload-XXXXXX", m_upload_dir );
+    if ( n >= FILENAME_LEN ) {
+        return false;
+    }
+    m_body_fd = mkstemp( m_real_file );
+    return m_body_fd >= 0;
+}
+
+// 保存一段请求体数据
+bool http_conn::write_body( const char* data, int len ) {
+    if ( m_body_fd < 0 ) {
+        return true;    // 不需要保存的请求体，直接丢弃
+    }
+    while ( len > 0 ) {
+        int n = ::write( m_body_fd, data, len );
+        if ( n < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 丢弃没有接收完的请求体：关闭并删除临时文件
+void http_conn::discard_body() {
+    if ( m_body_fd >= 0 ) {
+        close( m_body_fd );
+        unlink( m_real_file );
+        m_body_fd = -1;
+    }
+}
+
+// 请求体接收完毕，把临时文件改名为正式的文件名，保存在上传目录中
+// 正式的文件名也保存在m_real_file中，用于生成响应
+http_conn::HTTP_CODE http_conn::finish_upload() {
+    // 没有请求体的上传，也创建一个空文件
+    if ( m_body_fd < 0 && !begin_body() ) {
+        return INTERNAL_ERROR;
+    }
+    close( m_body_fd );
+    m_body_fd = -1;
+    static unsigned long upload_count = 0;
+    char path[ FILENAME_LEN ];
+    int n = snprintf( path, FILENAME_LEN, "%s/upload-%ld-%lu", m_upload_dir,
+                      ( long )time( NULL ), __sync_fetch_and_add( &upload_count, 1 ) );
+    if ( n >= FILENAME_LEN || rename( m_real_file, path ) < 0 ) {
+        unlink( m_real_file );
+        return INTERNAL_ERROR;
+    }
+    strcpy( m_real_file, path );
+    return UPLOAD_REQUEST;
+}
+
+// 解析请求体
+// 请求体可能很大（几百MB），不能等它全部读进读缓冲区，所以每次只处理已经读到的部分：
+// 解码（分块传输时）后交给write_body保存，然后把还没处理的字节（比如不完整的块大小行）
+// 移到m_body_start处，腾出读缓冲区让主线程继续读。这样每个连接占用的内存是固定的，
+// 工作线程处理完手头的数据就返回，也不会被一个大的上传长时间占用
+http_conn::HTTP_CODE http_conn::parse_content() {
+    // 交给处理函数的请求体不做处理，等它全部读入读缓冲区即可
+    if ( m_handler ) {
+        if ( m_read_idx - m_body_start < m_content_length ) {
+            return NO_REQUEST;
+        }
+        m_request.body = std::string_view( m_read_buf + m_body_start, m_content_length );
         return GET_REQUEST;
     }
-    return NO_REQUEST;
+
+    bool done = false;
+    m_start_line = m_checked_idx;
+    while ( !done && m_checked_idx < m_read_idx ) {
+        if ( !m_chunked || m_chunk_state == CHUNK_DATA ) {
+            // 请求体数据（或者当前块的数据）
+            long left = m_chunked ? m_chunk_left : m_content_length - m_body_received;
+            int n = m_read_idx - m_checked_idx;
+            if ( n > left ) {
+                n = left;
+            }
+            if ( !write_body( m_read_buf + m_checked_idx, n ) ) {
+                return INTERNAL_ERROR;
+            }
+            m_checked_idx += n;
+            m_start_line = m_checked_idx;
+            m_body_received += n;
+            if ( m_chunked ) {
+                m_chunk_left -= n;
+                if ( m_chunk_left == 0 ) {
+                    m_chunk_state = CHUNK_DATA_END;
+                }
+            } else {
+                done = m_body_received >= m_content_length;
+            }
+            continue;
+        }
+
+        // 分块传输中的块大小行、块数据后面的\r\n，以及尾部的头部字段，都是按行解析的
+        LINE_STATE line_state = parse_line();
+        if ( line_state == LINE_BAD ) {
+            return BAD_REQUEST;
+        } else if ( line_state == LINE_OPEN ) {
+            // 行不完整，下次从行首重新解析；一行就占满了读缓冲区的话，说明请求有问题
+            if ( m_read_idx - m_start_line >= m_read_buffer_size - m_body_start ) {
+                return BAD_REQUEST;
+            }
+            m_checked_idx = m_start_line;
+            break;
+        }
+        char* text = get_line();
+        m_start_line = m_checked_idx;
+        switch ( m_chunk_state ) {
+            case CHUNK_SIZE: {
+                // 块大小是十六进制数，后面可能有";"开头的扩展，忽略
+                // 最多15位（和proxy.cpp中的body_scanner一样），累加时不会溢出；
+                // 和已经接收的字节数比较时用减法，m_body_received + size本身也不会溢出
+                long size = 0;
+                int digits = 0;
+                for ( ; isxdigit( ( unsigned char )text[ digits ] ); ++digits ) {
+                    if ( digits >= 15 ) {
+                        return BAD_REQUEST;
+                    }
+                    char c = text[ digits ];
+                    size = size * 16 + ( isdigit( ( unsigned char )c ) ? c - '0' : tolower( c ) - 'a' + 10 );
+                }
+                char next = text[ digits ];
+                if ( digits == 0 || ( next != '\0' && next != ';' && next != ' ' && next != '\t' ) ||
+                     size > MAX_BODY_SIZE - m_body_received ) {
+                    return BAD_REQUEST;
+                }
+                m_chunk_left = size;
+                m_chunk_state = size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+                break;
+            }
+            case CHUNK_DATA_END: {
+                if ( text[0] != '\0' ) {
+                    return BAD_REQUEST;
+                }
+                m_chunk_state = CHUNK_SIZE;
+                break;
+            }
+            case CHUNK_TRAILER: {
+                // 尾部的头部字段直接忽略，遇到空行表示请求体结束
+                if ( text[0] == '\0' ) {
+                    m_chunk_state = CHUNK_DONE;
+                    done = true;
+                }
+                break;
+            }
+            default:
+                return INTERNAL_ERROR;
+        }
+    }
+
+    // 已经处理过的数据不再需要了，把剩下的数据移到m_body_start处
+    int left = m_read_idx - m_start_line;
+    if ( m_start_line > m_body_start ) {
+        memmove( m_read_buf + m_body_start, m_read_buf + m_start_line, left );
+    }
+    m_read_idx = m_body_start + left;
+    m_checked_idx = m_body_start;
+    m_start_line = m_body_start;
+    return done ? GET_REQUEST : NO_REQUEST;
 }
 
 // 主状态机，解析请求
@@ -404,6 +837,18 @@ http_conn::HTTP_CODE http_conn::process_read() {
     // 2 或者解析到了完整的一行数据
     while (((m_check_state == CHECK_STATE_CONTENT) && (line_state == LINE_OK))
                 || ((line_state = parse_line()) == LINE_OK)) {
+        // 请求体不是按行解析的，单独处理
+        if ( m_check_state == CHECK_STATE_CONTENT ) {
+            ret = parse_content();
+            if ( ret == GET_REQUEST ) {
+                // 请求体接收完毕，那么就由do_request具体进行处理
+                return do_request();
+            } else if ( ret != NO_REQUEST ) {
+                return ret;
+            }
+            break;
+        }
+
         // 获取一行数据，一行一行地解析，所以while循环每一次需要一行一行地获取数据，用自定义的get_line函数
         text = get_line();
         // m_checked_idx当前正在分析的字符在读缓冲区中的位置（因为我们解析报文肯定也是一个一个字符往后遍历的）
@@ -415,9 +860,10 @@ http_conn::HTTP_CODE http_conn::process_read() {
             case CHECK_STATE_REQUESTLINE: {
                 // 解析请求行
                 ret = parse_request_line( text );
-                if ( ret == BAD_REQUEST ) { // 如果检测到语法错误，直接结束
-                    return BAD_REQUEST;
+                if ( ret == BAD_REQUEST || ret == TOO_MANY_REQUESTS ) { // 如果检测到语法错误或者超过了速率限制，直接结束
+                    return ret;
                 }
+                m_headers_start = m_checked_idx;
                 break;
             }
             case CHECK_STATE_HEADER: {
@@ -428,19 +874,11 @@ http_conn::HTTP_CODE http_conn::process_read() {
                 } else if ( ret == GET_REQUEST ) {
                     // 如果是一个正确的GET请求，那么就由do_request具体进行解析
                     return do_request();
+                } else if ( ret == UPGRADE_H2C || ret == UPGRADE_WS || ret == PROXY_REQUEST ) {
+                    return ret;
                 }
                 break;
             }
-            case CHECK_STATE_CONTENT: {
-                // 解析请求体
-                ret = parse_content( text );
-                if ( ret == GET_REQUEST ) {
-                    // 如果是一个正确的GET请求，那么就由do_request具体进行解析
-                    return do_request();
-                }
-                line_state = LINE_OPEN;
-                break;
-            }
             default: {
                 // 否则读取失败
                 return INTERNAL_ERROR;
@@ -455,6 +893,26 @@ http_conn::HTTP_CODE http_conn::process_read() {
 // 映射到内存地址m_file_address处，并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
+    WS_PROBE3( request, m_sockfd, m_method, m_url );
+    // 有注册的处理函数时，由处理函数生成响应
+    if ( m_handler ) {
+        return do_handler();
+    }
+
+    // POST/PUT：请求体已经保存在临时文件中了，移到上传目录中即可
+    if ( m_method == POST || m_method == PUT ) {
+        return finish_upload();
+    }
+
+    // 开启了资源包时，直接在资源包中查找，不需要拼接路径，也不访问文件系统
+    if ( m_bundle ) {
+        if ( !m_bundle->find( m_url, strlen( m_url ), m_asset ) ) {
+            return NO_RESOURCE;
+        }
+        m_from_bundle = true;
+        return FILE_REQUEST;
+    }
+
     // 资源路径
     // "/home/ljchen/webserver/resources"
     strcpy( m_real_file, doc_root );
@@ -462,8 +920,38 @@ http_conn::HTTP_CODE http_conn::do_request()
     // 拼接资源路径和要请求的文件名（即m_url）得到真正的要请求的文件路径
     // FILENAME_LEN指的是一个文件名能有的最大长度
     strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
+
+    // 先查文件缓存，命中的话直接使用缓存中的内容，不需要再访问磁盘
+    // （加入缓存之前已经做过下面的权限和目录检查了；文件变了的话缓存项会被删除，这里就不会命中）
+    // 在主线程中处理时不重新检查缓存项和不存在的记录（都要stat），需要检查时和没有命中一样处理
+    m_file_ref = NULL;
+    if ( m_file_cache.lookup( m_real_file, m_file_address, m_file_stat, m_file_ref, !m_inline ) ) {
+        return FILE_REQUEST;
+    }
+
+    // 最近确认过不存在的路径，直接回复404
+    if ( m_file_cache.is_missing( m_real_file, !m_inline ) ) {
+        return NO_RESOURCE;
+    }
+
+    // 没有命中缓存，需要访问磁盘（stat、open、mmap都可能因为磁盘慢而阻塞）
+    // 开启了I/O线程池时，这部分工作交给I/O线程池去做，工作线程不在磁盘上阻塞；主线程则一定不自己做
+    if ( m_io_pool || m_inline ) {
+        return FILE_PENDING;
+    }
+    return do_file_io();
+}
+
+// 访问磁盘上的目标文件：获取文件状态、检查权限、打开文件并映射到内存
+// 开启了I/O线程池时由I/O线程调用，否则由工作线程在do_request中直接调用
+http_conn::HTTP_CODE http_conn::do_file_io()
+{
     // 获取m_real_file文件的相关的状态信息，-1失败，0成功
     if ( stat( m_real_file, &m_file_stat ) < 0 ) {
+        // 文件不存在，记下来，之后对它的请求就不用再stat了
+        if ( errno == ENOENT || errno == ENOTDIR ) {
+            m_file_cache.insert_missing( m_real_file );
+        }
         return NO_RESOURCE;
     }
 
@@ -479,23 +967,59 @@ http_conn::HTTP_CODE http_conn::do_request()
 
     // 以只读方式打开文件
     int fd = open( m_real_file, O_RDONLY );
+    if ( fd < 0 ) {
+        return NO_RESOURCE;
+    }
     // 创建内存映射，把文件映射到内存当中
     // 第一个参数为NULL表示让操作系统为我们指定内存映射区的位置，我们自己无需指定
     // PROT_READ表示只读权限
     // MAP_PRIVATE表示内存映射区的文件与磁盘上的文件不同步（就是内存映射区的文件改变了，磁盘文件不会改变）
     // fd需要操作的/映射的文件的文件描述符
     // 最后一个参数为0表示从内存映射区从文件开始位置偏移0开始映射（一般为0就行，即映射整个文件）
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    // 不大的文件加上MAP_POPULATE，在这里就把文件内容读进内存并建立好页表，
+    // 否则之后主线程在write()中第一次writev这段内存时会发生缺页，在磁盘上阻塞整个事件循环；
+    // 大文件则只是提示内核提前异步读入
+    int flags = MAP_PRIVATE;
+    if ( m_file_stat.st_size <= PREFAULT_SIZE ) {
+        flags |= MAP_POPULATE;
+    }
+    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, flags, fd, 0 );
+    if ( m_file_address != MAP_FAILED && m_file_stat.st_size > PREFAULT_SIZE ) {
+        madvise( m_file_address, m_file_stat.st_size, MADV_WILLNEED );
+    }
     close( fd );
+    // 小文件加入缓存，之后对它的请求就可以在主线程中直接处理了
+    m_file_cache.insert( m_real_file, m_file_address, m_file_stat, &m_file_ref );
     return FILE_REQUEST;
 }
 
+// 调用注册的处理函数生成响应
+// 处理函数抛出的异常不能让工作线程退出，统一回复500
+http_conn::HTTP_CODE http_conn::do_handler() {
+    try {
+        ( *m_handler )( m_request, m_response );
+    } catch ( const std::exception& e ) {
+        printf( "handler for %s threw: %s\n", m_url, e.what() );
+        return INTERNAL_ERROR;
+    } catch ( ... ) {
+        printf( "handler for %s threw an unknown exception\n", m_url );
+        return INTERNAL_ERROR;
+    }
+    return HANDLER_REQUEST;
+}
+
 // 对内存映射区执行munmap操作（释放内存映射区的资源）
 void http_conn::unmap() {
     if( m_file_address )
     {
-        munmap( m_file_address, m_file_stat.st_size );
+        // 属于文件缓存的内容由缓存统一管理，这里只是不再引用它
+        if( m_file_ref ) {
+            m_file_cache.release( m_file_ref );
+        } else {
+            munmap( m_file_address, m_file_stat.st_size );
+        }
         m_file_address = 0;
+        m_file_ref = NULL;
     }
 }
 
@@ -504,21 +1028,39 @@ void http_conn::unmap() {
 // 实际上更确切的来说是一个send函数
 bool http_conn::write()
 {
+    // HTTP/2连接：继续发送会话输出队列中的数据
+    if ( m_h2 ) {
+        return m_h2->flush() && rearm_h2();
+    }
+    // WebSocket连接：继续发送会话输出队列中的数据
+    if ( m_ws ) {
+        return m_ws->write();
+    }
+    // TLS握手时socket写缓冲区满了，继续发送握手消息
+    if ( m_ssl && !SSL_is_init_finished( m_ssl ) ) {
+        bool want_write = false;
+        if ( tls_handshake( m_ssl, want_write ) < 0 ) {
+            return false;
+        }
+        modfd( m_epollfd, m_sockfd, want_write ? EPOLLOUT : EPOLLIN );
+        return true;
+    }
+
     int temp = 0;
-    int bytes_have_send = 0;    // 已经发送的字节
-    int bytes_to_send = m_write_idx;// 将要发送的字节 （m_write_idx）写缓冲区中待发送的字节数
     
-    if ( bytes_to_send == 0 ) {
+    if ( m_bytes_to_send == 0 ) {
         // 将要发送的字节为0，这一次响应结束。
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
+        // 先init()再注册事件：工作线程调用时，注册之后主线程马上就可能处理这个连接
         init();
+        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
         return true;
     }
 
     while(1) {
         // writev表示分散写（库函数），将分散的多块内存的数据写出去
         // 我们这里其实就是两块分散的内存，一个是m_write_buf，一个是m_file_address
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        // TLS连接要先加密（开启kTLS时由内核加密）
+        temp = m_ssl ? tls_writev( m_ssl, m_iv, m_iv_count ) : writev( m_sockfd, m_iv, m_iv_count );
         if ( temp <= -1 ) {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
@@ -529,9 +1071,16 @@ bool http_conn::write()
             unmap();
             return false;
         }
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if ( bytes_to_send <= bytes_have_send ) {
+        m_bytes_to_send -= temp;
+        m_bytes_have_send += temp;
+        if ( m_bytes_to_send <= 0 ) {
+            WS_PROBE4( response, m_sockfd, m_status, m_bytes_have_send, m_linger );
+            // 响应的最后一个字节发出去了，跟踪的请求到这里结束
+            if ( m_traced ) {
+                trace_mark( TRACE_SENT );
+                tracer::submit( m_trace );
+                m_traced = false;
+            }
             // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
             // 成功写完数据之后，释放内存映射，从新设置检测事件
             unmap();
@@ -540,10 +1089,21 @@ bool http_conn::write()
                 modfd( m_epollfd, m_sockfd, EPOLLIN );
                 return true;
             } else {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
+                // 不保持连接，调用者会关闭连接，不再注册事件（否则主线程可能在连接关闭之前又处理它）
                 return false;
             } 
         }
+        // 只发送了一部分：跳过已经发送完的内存块，调整发送了一部分的内存块的起始位置，下次从没有发送的地方继续
+        for ( int i = 0; i < m_iv_count && temp > 0; ++i ) {
+            if ( ( size_t )temp >= m_iv[i].iov_len ) {
+                temp -= m_iv[i].iov_len;
+                m_iv[i].iov_len = 0;
+            } else {
+                m_iv[i].iov_base = ( char* )m_iv[i].iov_base + temp;
+                m_iv[i].iov_len -= temp;
+                temp = 0;
+            }
+        }
     }
 }
 
@@ -551,7 +1111,7 @@ bool http_conn::write()
 // 就是具体的可变参数操作函数
 // 类似printf
 bool http_conn::add_response( const char* format, ... ) {
-    if( m_write_idx >= WRITE_BUFFER_SIZE ) {
+    if( m_write_idx >= m_write_buffer_size ) {
         // 如果当前要写的数据大于写缓冲区的大小，返回失败
         return false;
     }
@@ -560,8 +1120,8 @@ bool http_conn::add_response( const char* format, ... ) {
     // -----------------------开始
     va_start( arg_list, format ); 
     // vsnprintf()函数，将可变参数格式化输出到一个字符数组
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) ) {
+    int len = vsnprintf( m_write_buf + m_write_idx, m_write_buffer_size - 1 - m_write_idx, format, arg_list );
+    if( len >= ( m_write_buffer_size - 1 - m_write_idx ) ) {
         return false;
     }
     m_write_idx += len;
@@ -572,6 +1132,7 @@ bool http_conn::add_response( const char* format, ... ) {
 
 // 添加响应行（类似：http/1.1 200 OK)
 bool http_conn::add_status_line( int status, const char* title ) {
+    m_status = status;
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 
@@ -580,7 +1141,7 @@ bool http_conn::add_headers(int content_len) {
     add_content_length(content_len);
     add_content_type();
     add_linger();
-    add_blank_line();
+    return add_blank_line();
 }
 
 // 添加响应体（如果请求不到数据，添加的是返回的错误信息）如果能正确请求到数据，就没有这个content字段了
@@ -617,6 +1178,7 @@ bool http_conn::add_content_type() {
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
 bool http_conn::process_write(HTTP_CODE ret) {
+    m_iv_count = 0;
     switch (ret)
     {
         case INTERNAL_ERROR:
@@ -633,13 +1195,61 @@ bool http_conn::process_write(HTTP_CODE ret) {
                 return false;
             }
             break;
-        case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
+        case TOO_MANY_REQUESTS:
+            add_status_line( 429, error_429_title );
+            add_response( "Retry-After: 1\r\n" );
+            add_headers( strlen( error_429_form ) );
+            if ( ! add_content( error_429_form ) ) {
+                return false;
+            }
+            break;
+        case HEADERS_TOO_LARGE:
+            add_status_line( 431, error_431_title );
+            add_headers( strlen( error_431_form ) );
+            if ( ! add_content( error_431_form ) ) {
+                return false;
+            }
+            break;
+        case NO_RESOURCE: {
+            // 直接拷贝事先生成好的404响应（没有经过add_status_line，状态码要自己记下，跟踪点要用）
+            const std::string& resp = m_linger ? not_found_keep_alive : not_found_close;
+            m_status = 404;
+            if ( m_write_idx + ( int )resp.size() > m_write_buffer_size ) {
+                return false;
+            }
+            memcpy( m_write_buf + m_write_idx, resp.data(), resp.size() );
+            m_write_idx += resp.size();
+            break;
+        }
+        case UPLOAD_REQUEST: {
+            // 上传成功，返回保存的文件名和大小
+            char content[ FILENAME_LEN + 64 ];
+            snprintf( content, sizeof( content ), "saved %s (%ld bytes)\n",
+                      strrchr( m_real_file, '/' ) + 1, m_body_received );
+            add_status_line( 201, ok_201_title );
+            add_headers( strlen( content ) );
+            if ( ! add_content( content ) ) {
+                return false;
+            }
+            break;
+        }
+        case HANDLER_REQUEST: {
+            // 处理函数生成的响应：响应行和固定的几个响应头写在写缓冲区中，
+            // 处理函数添加的响应头和响应体的各块内存都直接作为iovec发送，不再拷贝
+            const std::string& extra = m_response.extra_headers();
+            add_status_line( m_response.status_code(), m_response.reason() );
+            add_content_length( m_response.content_length() );
+            add_response( "Content-Type:%s\r\n", m_response.type() );
+            if ( ! add_linger() ) {
                 return false;
             }
+            m_iv[ 0 ].iov_base = m_write_buf;
+            m_iv[ 0 ].iov_len = m_write_idx;
+            m_iv[ 1 ].iov_base = ( void* )extra.data();
+            m_iv[ 1 ].iov_len = extra.size();
+            m_iv_count = 2 + m_response.fill_iov( m_iv + 2 );
             break;
+        }
         case FORBIDDEN_REQUEST:
             add_status_line( 403, error_403_title );
             add_headers(strlen( error_403_form));
@@ -648,6 +1258,20 @@ bool http_conn::process_write(HTTP_CODE ret) {
             }
             break;
         case FILE_REQUEST:
+            if ( m_from_bundle ) {
+                // 资源包中的资源：响应行和Content-Length、Content-Type都是事先生成好的，
+                // 只需要再加上Connection和空行，数据部分直接指向资源包中的文件内容
+                m_status = 200;     // 资源包中事先生成的响应行都是200
+                add_response( "%.*s", m_asset.header_len, m_asset.header );
+                add_linger();
+                add_blank_line();
+                m_iv[ 0 ].iov_base = m_write_buf;
+                m_iv[ 0 ].iov_len = m_write_idx;
+                m_iv[ 1 ].iov_base = ( void* )m_asset.body;
+                m_iv[ 1 ].iov_len = m_asset.body_len;
+                m_iv_count = 2;
+                break;
+            }
             // 如果是正确的数据
             // 数据部分就包括两部分m_write_buf和m_file_address
             // 后续会用到write函数分散写
@@ -658,32 +1282,533 @@ bool http_conn::process_write(HTTP_CODE ret) {
             m_iv[ 1 ].iov_base = m_file_address;
             m_iv[ 1 ].iov_len = m_file_stat.st_size;
             m_iv_count = 2;
-            return true;
+            break;
         default:
             return false;
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
+    // 只有写缓冲区中的内容（错误信息等）
+    if ( m_iv_count == 0 ) {
+        m_iv[ 0 ].iov_base = m_write_buf;
+        m_iv[ 0 ].iov_len = m_write_idx;
+        m_iv_count = 1;
+    }
+    m_bytes_to_send = 0;
+    for ( int i = 0; i < m_iv_count; ++i ) {
+        m_bytes_to_send += m_iv[ i ].iov_len;
+    }
+    m_bytes_have_send = 0;
     return true;
 }
 
 
 // 由线程池中的工作线程调用，这是处理HTTP请求的入口函数，是http_conn类的成员函数
 void http_conn::process() {
+    // 已经切换到HTTP/2的连接，交给会话处理
+    if ( m_h2 ) {
+        if ( !m_h2->process() || !rearm_h2() ) {
+            hand_back();
+        }
+        return;
+    }
+    // 已经切换到WebSocket的连接，交给会话处理
+    if ( m_ws ) {
+        if ( !m_ws->process() ) {
+            hand_back();
+        }
+        return;
+    }
+    // 主线程已经解析完请求，但目标文件需要访问磁盘（见process_inline）：在这里重新查找（过期的缓存项会重新检查），
+    // 还是需要访问磁盘时自己做（I/O线程池没有开启，或者主线程交过去时队列是满的）
+    if ( m_file_pending ) {
+        m_file_pending = false;
+        trace_mark( TRACE_DEQUEUE );
+        HTTP_CODE ret = do_request();
+        if ( ret == FILE_PENDING ) {
+            ret = do_file_io();
+        }
+        finish( ret );
+        return;
+    }
+    // TLS握手还没有完成
+    if ( m_ssl && !SSL_is_init_finished( m_ssl ) ) {
+        bool want_write = false;
+        int ret = tls_handshake( m_ssl, want_write );
+        if ( ret < 0 ) {
+            hand_back();
+            return;
+        }
+        if ( ret == 0 ) {
+            modfd( m_epollfd, m_sockfd, want_write ? EPOLLOUT : EPOLLIN );
+            return;
+        }
+        // 握手完成，客户端通常紧接着就发来了请求，直接读取，不用再等一轮epoll
+        // （EPOLLONESHOT保证此时主线程不会读这个连接）
+        if ( !read() ) {
+            hand_back();
+            return;
+        }
+    }
+    // 客户端直接发送了HTTP/2的连接前言（h2c只用于明文连接）
+    bool partial = false;
+    if ( m_h2c_enabled && !m_ssl && is_h2_preface( partial ) ) {
+        if ( partial ) {
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+        } else {
+            start_h2( false );
+        }
+        return;
+    }
+
+    trace_mark( TRACE_DEQUEUE );
     // 解析HTTP请求
     HTTP_CODE read_ret = process_read();
+    // TLS连接：读缓冲区满的时候，解密好的数据可能还有一部分留在SSL对象中，socket上不会再有可读事件，
+    // 所以处理完读缓冲区中的数据（腾出空间）之后要自己接着读
+    while ( read_ret == NO_REQUEST && m_ssl && SSL_pending( m_ssl ) > 0 ) {
+        if ( !read() ) {
+            hand_back();
+            return;
+        }
+        read_ret = process_read();
+    }
     if ( read_ret == NO_REQUEST ) {
         // 如果请求不完整，需要重新检测该socket上的读事件，然后再读取数据检测
         modfd( m_epollfd, m_sockfd, EPOLLIN );
         return;
     }
-    
+    trace_parsed();
+    if ( read_ret == UPGRADE_H2C ) {
+        start_h2( true );
+        return;
+    }
+    if ( read_ret == UPGRADE_WS ) {
+        start_ws();
+        return;
+    }
+    if ( read_ret == PROXY_REQUEST ) {
+        if ( start_proxy() ) {
+            return;
+        }
+        // 请求体可能还没读完，回复之后关闭连接
+        m_linger = false;
+        read_ret = HEADERS_TOO_LARGE;
+    }
+    if ( read_ret == FILE_PENDING ) {
+        // 需要访问磁盘，交给I/O线程池，由I/O线程完成后生成响应
+        // I/O线程池的队列满了，就只能在这里自己做了
+        if ( m_io_pool->append( &m_io_task ) ) {
+            return;
+        }
+        read_ret = do_file_io();
+    }
+    finish( read_ret );
+}
+
+// 读缓冲区的开头是否是HTTP/2的连接前言，只读到一部分时partial为true
+bool http_conn::is_h2_preface( bool& partial ) {
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    static const int len = sizeof( preface ) - 1;
+    if ( m_check_state != CHECK_STATE_REQUESTLINE || m_checked_idx != 0 || m_read_idx == 0 ) {
+        return false;
+    }
+    int n = m_read_idx < len ? m_read_idx : len;
+    if ( memcmp( m_read_buf, preface, n ) != 0 ) {
+        return false;
+    }
+    partial = m_read_idx < len;
+    return true;
+}
+
+// 把连接切换到HTTP/2，读缓冲区中还没处理的数据（连接前言、升级请求之后的帧）交给会话
+void http_conn::start_h2( bool upgrade ) {
+    m_h2 = new h2_session( m_sockfd, m_client_slot );
+    bool ok;
+    if ( upgrade ) {
+        ok = m_h2->upgrade( "GET", m_url, m_h2_settings )
+             && m_h2->feed( m_read_buf + m_checked_idx, m_read_idx - m_checked_idx );
+    } else {
+        m_h2->start();
+        ok = m_h2->feed( m_read_buf, m_read_idx );
+    }
+    init();
+    if ( !ok || !m_h2->process() || !rearm_h2() ) {
+        hand_back();
+    }
+}
+
+// HTTP/2连接处理完一轮之后重新注册事件：总是要读（对方随时会发新的请求和WINDOW_UPDATE），
+// 输出队列没发完时还要等待可写
+bool http_conn::rearm_h2() {
+    if ( m_h2->finished() ) {
+        return false;
+    }
+    modfd( m_epollfd, m_sockfd, m_h2->want_write() ? ( EPOLLIN | EPOLLOUT ) : EPOLLIN );
+    return true;
+}
+
+// 把连接切换到WebSocket：回复101，之后这个连接的读写都交给会话
+void http_conn::start_ws() {
+    m_ws = new ws_session( m_sockfd, m_epollfd, m_ssl, &m_ws_endpoints.find( m_request.path )->second );
+    m_ws->open( m_ws_key );     // m_ws_key指向读缓冲区，要在init()之前用
+    init();
+    if ( !m_ws->process() ) {
+        hand_back();
+    }
+}
+
+// 广播者（其他线程）可能在工作线程处理WebSocket连接时重新注册了事件，这时主线程收到的事件要忽略，
+// 工作线程处理完之后会重新注册
+bool http_conn::claim_event() {
+    return !m_ws || m_ws->claim();
+}
+
+// 查找url匹配的反向代理上游，多条路由都匹配时取前缀最长的
+upstream* http_conn::find_upstream( std::string_view path ) {
+    upstream* found = NULL;
+    size_t found_len = 0;
+    for ( size_t i = 0; i < m_proxy_routes.size(); ++i ) {
+        const std::string& prefix = m_proxy_routes[i].prefix;
+        if ( path.size() >= prefix.size() && path.compare( 0, prefix.size(), prefix ) == 0
+                && ( !found || prefix.size() > found_len ) ) {
+            found = m_proxy_routes[i].up;
+            found_len = prefix.size();
+        }
+    }
+    return found;
+}
+
+// 工作线程：把解析好的请求改写成发给上游的请求，然后把连接交给主线程
+// 请求行中的url原样转发；逐跳（hop-by-hop）的头部只对客户端到这里的这一段连接有效，不转发；
+// 到上游的连接总是保持连接，另外加上X-Forwarded-For和X-Forwarded-Proto告诉上游客户端的地址和协议
+bool http_conn::start_proxy() {
+    // 逐跳的头部字段不转发；X-Forwarded-For/Proto由我们重新生成，客户端自己带的不转发，否则客户端可以伪造来源地址
+    static const char* const dropped[] = { "Connection", "Keep-Alive", "Proxy-Connection", "Upgrade",
+                                           "TE", "HTTP2-Settings", "Expect", "X-Forwarded-For", "X-Forwarded-Proto" };
+    proxy_request req;
+    req.head.reserve( m_checked_idx + 128 );
+    req.head.append( m_request.method.data(), m_request.method.size() );
+    req.head.append( " " );
+    req.head.append( m_url );   // 包括查询字符串
+    req.head.append( " HTTP/1.1\r\n" );
+    // 头部字段直接从读缓冲区中取（m_request.headers最多只记录MAX_HEADERS个，后面的Cookie等会被漏掉）：
+    // 每一行的\r\n已经被parse_line改成了两个\0，头部字段到空行为止，空行之后的m_checked_idx是请求体的开头
+    int pos = m_headers_start;
+    int end = m_checked_idx - 2;
+    while ( pos < end ) {
+        const char* line = m_read_buf + pos;
+        size_t len = strlen( line );
+        pos += len + 2;
+        const char* colon = ( const char* )memchr( line, ':', len );
+        size_t name_len = colon ? colon - line : len;
+        bool skip = false;
+        for ( size_t j = 0; j < sizeof( dropped ) / sizeof( dropped[0] ); ++j ) {
+            if ( name_len == strlen( dropped[j] ) && strncasecmp( line, dropped[j], name_len ) == 0 ) {
+                skip = true;
+                break;
+            }
+        }
+        if ( !skip ) {
+            req.head.append( line, len );
+            req.head.append( "\r\n" );
+        }
+    }
+    char ip[ INET_ADDRSTRLEN ];
+    inet_ntop( AF_INET, &m_address.sin_addr, ip, sizeof( ip ) );
+    req.head.append( "X-Forwarded-For: " );
+    req.head.append( ip );
+    req.head.append( m_ssl ? "\r\nX-Forwarded-Proto: https\r\n" : "\r\nX-Forwarded-Proto: http\r\n" );
+    req.head.append( "Connection: keep-alive\r\n\r\n" );
+
+    // 读缓冲区中请求头之后的数据是请求体的开头
+    req.body = m_read_buf + m_checked_idx;
+    req.body_len = m_read_idx - m_checked_idx;
+    // 改写后的请求头和已经读到的请求体要一起放进转发缓冲区，读缓冲区调大之后可能放不下
+    if ( req.head.size() + req.body_len > proxy_session::BUFFER_SIZE ) {
+        printf( "proxied request head too large: %zu bytes\n", req.head.size() );
+        return false;
+    }
+    req.content_length = m_content_length;
+    req.chunked = m_chunked;
+    req.head_method = m_method == HEAD;
+    req.keep_alive = m_linger;
+    std::string_view expect = m_request.find_header( "Expect" );
+    req.expect_continue = expect.size() == 12 && strncasecmp( expect.data(), "100-continue", 12 ) == 0;
+
+    m_proxy = new proxy_session( this, m_sockfd, m_epollfd, m_ssl, m_upstream, req );
+    // 之后的转发（包括取上游连接）都在主线程中进行，注册EPOLLOUT让主线程马上开始
+    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+    return true;
+}
+
+// 主线程：推进转发。转发完之后，客户端连接要在它自己的事件中才能切换回普通的请求处理：
+// 同一轮epoll_wait中可能还有这个连接之前的事件没有处理，如果在上游的事件中就切换回去并注册EPOLLIN，
+// 这个旧事件会把连接再交给一次线程池，就可能有两个线程同时处理这个连接
+void http_conn::step_proxy( bool client_event, uint32_t up_events ) {
+    switch ( m_proxy->pump( up_events ) ) {
+        case proxy_session::PROXY_CONTINUE:
+            break;
+        case proxy_session::PROXY_KEEP_ALIVE:
+            if ( !client_event ) {
+                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                break;
+            }
+            delete m_proxy;
+            m_proxy = NULL;
+            init();
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            break;
+        default:
+            close_conn();
+            break;
+    }
+}
+
+bool http_conn::proxy_event( http_conn* users, int fd, uint32_t events ) {
+    if ( m_proxy_routes.empty() ) {
+        return false;
+    }
+    upstream_conn* up = upstream::find( fd );
+    if ( up ) {
+        if ( up->client ) {
+            up->client->step_proxy( false, events );
+        } else {
+            up->owner->idle_event( up, m_epollfd );
+        }
+        return true;
+    }
+    http_conn& conn = users[fd];
+    if ( !conn.m_proxy ) {
+        return false;
+    }
+    if ( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
+        conn.close_conn();
+    } else {
+        conn.step_proxy( true, 0 );
+    }
+    return true;
+}
+
+// 跟踪的请求解析完毕：记下时间，以及请求方法和路径（写出跟踪记录时作为这个请求的名字）
+void http_conn::trace_parsed() {
+    if ( m_traced ) {
+        m_trace.t[ TRACE_PARSED ] = tracer::now();
+        snprintf( m_trace.request, sizeof( m_trace.request ), "%.*s %.*s",
+                  ( int )m_request.method.size(), m_request.method.data(),
+                  ( int )m_request.path.size(), m_request.path.data() );
+    }
+}
+
+// 由I/O线程池中的I/O线程调用，完成do_request中没有做的磁盘访问，然后生成响应
+void http_conn::process_io() {
+    finish( do_file_io() );
+}
+
+// I/O线程池的任务对象，线程池通过它调用对应连接的process_io
+void http_conn::io_task::process() {
+    conn->process_io();
+}
+
+// 请求处理完毕，生成响应并直接尝试发送
+// socket的写缓冲区几乎总是有空间的，以前注册EPOLLOUT之后要等主线程的下一轮epoll_wait才开始发送，
+// 现在工作线程直接writev，发送完之后write()重新注册EPOLLIN；只有写缓冲区满了（EAGAIN）时，
+// write()才注册EPOLLOUT，剩下的部分由主线程发送
+void http_conn::finish( HTTP_CODE read_ret ) {
     // 生成响应
-    bool write_ret = process_write( read_ret );
-    if ( !write_ret ) {
-        close_conn();
+    if ( !process_write( read_ret ) ) {
+        hand_back();
+        return;
+    }
+    trace_mark( TRACE_READY );
+    if ( !write() ) {
+        hand_back();    // 不保持连接，或者发送出错
+    }
+}
+
+// 工作线程不直接关闭连接：关闭之后文件描述符马上就可能被主线程accept的新连接复用，
+// 和这里关闭的后半段（以及m_user_count的更新）同时进行就会出错。所以把连接压入无锁的栈，由主线程关闭。
+// 调用之后工作线程不能再访问这个连接；连接没有注册事件（EPOLLONESHOT），主线程只会在取出它时访问它
+void http_conn::hand_back() {
+    http_conn* head = done_head.value.load( std::memory_order_relaxed );
+    do {
+        m_done_next = head;
+    } while ( !done_head.value.compare_exchange_weak( head, this, std::memory_order_release, std::memory_order_relaxed ) );
+    // 栈原来是空的才需要通知：不为空时已经有通知在路上了，主线程会把整个栈一起取走
+    if ( !head ) {
+        uint64_t one = 1;
+        ::write( m_done_fd, &one, sizeof( one ) );
+    }
+}
+
+bool http_conn::init_done_queue( int epollfd ) {
+    m_done_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( m_done_fd < 0 ) {
+        return false;
+    }
+    addfd( epollfd, m_done_fd, false );
+    return true;
+}
+
+void http_conn::drain_done_queue() {
+    // 先清空eventfd的计数再取栈：取走之后再压入的连接一定会再通知一次
+    uint64_t count;
+    ::read( m_done_fd, &count, sizeof( count ) );
+    http_conn* conn = done_head.value.exchange( NULL, std::memory_order_acquire );
+    while ( conn ) {
+        http_conn* next = conn->m_done_next;
+        conn->close_conn();
+        conn = next;
+    }
+}
+
+// 在不修改读缓冲区的前提下，从一个新请求的请求行中取出url（不以'\0'结尾）
+// 请求行：GET /index.html HTTP/1.1，成功返回true
+// 主线程用它来在交给线程池之前对请求做一些判断
+bool http_conn::peek_url( const char*& url_out, int& len ) {
+    if ( m_check_state != CHECK_STATE_REQUESTLINE || m_checked_idx != 0 ) {
+        return false;
+    }
+    const char* end = m_read_buf + m_read_idx;
+    const char* url = ( const char* )memchr( m_read_buf, ' ', m_read_idx );
+    if ( !url ) {
+        return false;
+    }
+    ++url;
+    if ( end - url > 7 && strncasecmp( url, "http://", 7 ) == 0 ) {
+        url = ( const char* )memchr( url + 7, '/', end - url - 7 );
+        if ( !url ) {
+            return false;
+        }
+    }
+    if ( url >= end || *url != '/' ) {
+        return false;
+    }
+    const char* url_end = url;
+    while ( url_end < end && *url_end != ' ' && *url_end != '\t' && *url_end != '\r' ) {
+        ++url_end;
+    }
+    url_out = url;
+    len = url_end - url;
+    return true;
+}
+
+// 在不修改读缓冲区的前提下，取出目标文件的完整路径（doc_root + url）
+bool http_conn::peek_real_file( char* path ) {
+    const char* url;
+    int url_len;
+    if ( !peek_url( url, url_len ) ) {
+        return false;
+    }
+    // 按照do_request中的方式拼出目标文件的完整路径
+    int len = strlen( doc_root );
+    if ( len + url_len >= FILENAME_LEN ) {
+        return false;
+    }
+    memcpy( path, doc_root, len );
+    memcpy( path + len, url, url_len );
+    path[ len + url_len ] = '\0';
+    return true;
+}
+
+// 判断读到的请求能否直接在主线程中处理
+// 对于一个很小的、目标文件已经被缓存的GET请求，交给线程池（加锁入队、sem_post唤醒工作线程、
+// 工作线程再modfd注册EPOLLOUT）的开销比解析本身还大，所以满足下面的条件时就直接在主线程中处理：
+// 1. 这是一个新的请求，并且一次就读完整了（读缓冲区恰好以空行结束，没有请求体，也没有后续的请求）
+// 2. 是GET请求，目标文件已经在文件缓存中（或者已知不存在），处理过程不会访问磁盘，也就不会阻塞主线程
+// 这里只是检查，不会修改读缓冲区，不满足条件时照常交给线程池处理
+bool http_conn::can_process_inline() {
+    if ( m_read_idx < 4 || strncmp( m_read_buf + m_read_idx - 4, "\r\n\r\n", 4 ) != 0 ) {
+        return false;
+    }
+    if ( strncasecmp( m_read_buf, "GET ", 4 ) != 0 ) {
+        return false;
+    }
+    // 要求升级协议（h2c、WebSocket）的请求交给工作线程，主线程中不切换协议
+    const char* end = m_read_buf + m_read_idx;
+    for ( const char* p = m_read_buf; ( p = ( const char* )memmem( p, end - p, "\r\n", 2 ) ) != NULL; ) {
+        p += 2;
+        if ( end - p >= 8 && strncasecmp( p, "upgrade:", 8 ) == 0 ) {
+            return false;
+        }
+    }
+    // 注册了处理函数的请求交给工作线程（处理函数的耗时无法预估），要转发给上游的请求也交给工作线程
+    if ( !m_router.empty() || !m_proxy_routes.empty() ) {
+        const char* url;
+        int len;
+        if ( !peek_url( url, len ) ) {
+            return false;
+        }
+        std::string_view path( url, len );
+        path = path.substr( 0, path.find( '?' ) );
+        if ( m_router.find( "GET", path ) || find_upstream( path ) ) {
+            return false;
+        }
+    }
+    // 开启了资源包时，所有资源都在内存中，响应不需要访问磁盘（找不到的资源直接回复404）
+    if ( m_bundle ) {
+        const char* url;
+        int len;
+        return peek_url( url, len );
+    }
+    // 目标文件已缓存，或者是最近确认过不存在的路径（直接回复404）
+    char path[ FILENAME_LEN ];
+    return peek_real_file( path ) && ( m_file_cache.contains( path ) || m_file_cache.is_missing( path, false ) );
+}
+
+// 判断请求的优先级类别，主线程在把请求交给线程池之前调用
+// 1. url以配置的前缀开头（比如健康检查 /health）的是高优先级
+// 2. 目标文件比较大（BULK_FILE_SIZE以上）的是大文件下载，优先级最低
+// 3. 其余的（包括无法判断的）都是普通优先级
+int http_conn::priority_class() {
+    const char* url;
+    int url_len;
+    if ( !peek_url( url, url_len ) ) {
+        return PRIO_NORMAL;
+    }
+    for ( size_t i = 0; i < m_priority_prefixes.size(); ++i ) {
+        const std::string& prefix = m_priority_prefixes[i];
+        if ( url_len >= ( int )prefix.size() && strncmp( url, prefix.c_str(), prefix.size() ) == 0 ) {
+            return PRIO_HIGH;
+        }
+    }
+    off_t size = 0;
+    asset_bundle::asset a;
+    char path[ FILENAME_LEN ];
+    if ( m_bundle ) {
+        if ( m_bundle->find( url, url_len, a ) ) {
+            size = a.body_len;
+        }
+    } else if ( peek_real_file( path ) ) {
+        m_file_cache.size_of( path, size );
+    }
+    return size >= BULK_FILE_SIZE ? PRIO_BULK : PRIO_NORMAL;
+}
+
+// 在主线程中直接解析请求并发送响应
+// 和process()做的事情一样，只是生成响应之后不再注册EPOLLOUT等下一轮epoll_wait，而是直接尝试发送，
+// 发送不完时write()会自己注册EPOLLOUT
+http_conn::INLINE_RESULT http_conn::process_inline() {
+    trace_mark( TRACE_DEQUEUE );
+    m_inline = true;
+    HTTP_CODE read_ret = process_read();
+    m_inline = false;
+    if ( read_ret == NO_REQUEST ) {
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return INLINE_DONE;
+    }
+    trace_parsed();
+    if ( read_ret == FILE_PENDING ) {
+        // can_process_inline检查之后缓存项被删除了或者到了要重新检查的时间：主线程不访问磁盘，
+        // 交给I/O线程池，没有开启或者队列满了就交给工作线程池（由process接着访问磁盘）
+        if ( m_io_pool && m_io_pool->append( &m_io_task ) ) {
+            return INLINE_DONE;
+        }
+        m_file_pending = true;
+        return INLINE_DEFER;
+    }
+    if ( !process_write( read_ret ) ) {
+        return INLINE_CLOSE;
     }
-    modfd( m_epollfd, m_sockfd, EPOLLOUT);
+    trace_mark( TRACE_READY );
+    return write() ? INLINE_DONE : INLINE_CLOSE;
 }
@@ -18,21 +18,49 @@
 #include <sys/mman.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
 #include "locker.h"
+#include "threadpool.h"
+#include "file_cache.h"
+#include "asset_bundle.h"
+#include "handler.h"
+#include "h2_session.h"
+#include "tls.h"
+#include "websocket.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "probes.h"
 #include <sys/uio.h>
 
 
+// 独占一个缓存行（64字节）的变量：alignas只保证变量从缓存行的开头开始，
+// 大小也补齐到64字节，链接器才不会把别的变量放到同一个缓存行的后面
+template< typename T >
+struct alignas( 64 ) cacheline_padded {
+    T value;
+};
+
 // http_conn即为任务类对象
 
-class http_conn {
+class alignas( 64 ) http_conn {
 public:
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;  // 写缓冲区的大小
+    static const int BULK_FILE_SIZE = 64 * 1024; // 目标文件达到这个大小的请求被当作大文件下载
+    static const int PREFAULT_SIZE = 4 * 1024 * 1024;   // 不超过这个大小的文件在映射时就读入内存（MAP_POPULATE）
+    static const int MIN_BODY_SPACE = 256;      // 请求头之后至少要留给请求体这么多读缓冲区空间
+    static const long MAX_BODY_SIZE = 1L << 30; // 请求体的最大长度1GB
+
+    // 请求的优先级类别，对应线程池中的类别，数值越小优先级越高
+    enum PRIORITY { PRIO_HIGH = 0, PRIO_NORMAL, PRIO_BULK };
 
     // ------------ 下面的枚举类型定义了HTTP请求方法和服务器处理HTTP请求的可能结果
-    // HTTP请求方法，这里只支持GET
-    enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
+    // HTTP请求方法，这里支持GET，设置了上传目录时的POST、PUT，注册了处理函数时的POST、PUT、DELETE，
+    // 以及配置了反向代理时转发给上游的HEAD、OPTIONS、PATCH
+    enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH};
     // 服务器处理HTTP请求的可能结果，报文解析的结果
     // NO_REQUEST          :   请求不完整，需要继续读取客户数据
     // GET_REQUEST         :   表示获得了一个完成的客户请求
@@ -42,7 +70,15 @@ public:
     // FILE_REQUEST        :   文件请求,获取文件成功
     // INTERNAL_ERROR      :   表示服务器内部错误
     // CLOSED_CONNECTION   :   表示客户端已经关闭连接了
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    // FILE_PENDING        :   目标文件需要访问磁盘才能获取，已交给I/O线程池处理
+    // UPLOAD_REQUEST      :   POST/PUT的请求体已经完整地保存到上传目录中
+    // HANDLER_REQUEST     :   请求已经由注册的处理函数处理，响应保存在m_response中
+    // UPGRADE_H2C         :   请求要求升级到HTTP/2（Upgrade: h2c），之后这个连接由h2_session处理
+    // UPGRADE_WS          :   请求要求升级到WebSocket（Upgrade: websocket），之后这个连接由ws_session处理
+    // PROXY_REQUEST       :   请求匹配了反向代理路由，请求头已经解析完，之后由proxy_session转发给上游
+    // TOO_MANY_REQUESTS   :   这个客户端IP的请求速率超过了限制
+    // HEADERS_TOO_LARGE   :   要转发的请求头太大，放不进转发缓冲区
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, FILE_PENDING, UPLOAD_REQUEST, HANDLER_REQUEST, UPGRADE_H2C, UPGRADE_WS, PROXY_REQUEST, TOO_MANY_REQUESTS, HEADERS_TOO_LARGE };
 
     // ------------ 下面的枚举类型定义了状态机的状态，包括主状态机和从状态机
     // ---------主状态机
@@ -55,16 +91,61 @@ public:
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整（即正在检测行数据，还未遇到\r\n）
     enum LINE_STATE { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    // ---------process_inline的结果
+    // INLINE_DONE    :   已经处理完（或者交给了I/O线程池）
+    // INLINE_CLOSE   :   需要关闭连接
+    // INLINE_DEFER   :   请求已经解析完，但需要访问磁盘，主线程不做，交给工作线程池
+    enum INLINE_RESULT { INLINE_DONE, INLINE_CLOSE, INLINE_DEFER };
+
+    // ---------分块传输（Transfer-Encoding: chunked）的请求体的解析状态
+    // CHUNK_SIZE:当前正在读取块大小所在的行
+    // CHUNK_DATA:当前正在读取块的数据
+    // CHUNK_DATA_END:块的数据读完了，正在读取数据后面的\r\n
+    // CHUNK_TRAILER:读到了大小为0的块，正在读取尾部的头部字段，直到空行
+    // CHUNK_DONE:请求体读取完毕
+    enum CHUNK_STATE { CHUNK_SIZE = 0, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER, CHUNK_DONE };
+
+    // I/O线程池的任务类：线程池调用它的process()，它再调用对应连接的process_io()
+    struct io_task {
+        http_conn* conn;
+        void process();
+    };
 
 public:
     http_conn(){}   // 构造函数，但其实下面的init函数才真正完成http_conn类的具体初始化的工作
     ~http_conn(){}  // 析构函数
 public:
-    void init(int sockfd, const sockaddr_in& addr); // 初始化新接受的连接
+    // 初始化新接受的连接，slot为这个客户端IP的限流槽；
+    // watch为false时先不注册到epoll中（接受连接时马上读取请求，见main函数中的-D/-F），之后由watch()或者modfd注册
+    void init(int sockfd, const sockaddr_in& addr, client_slot* slot = NULL, bool watch = true);
+    void watch();       // 把init时没有注册的连接注册到epoll中，等待可读事件
+    bool has_data() const { return m_read_idx > 0; }     // 读缓冲区中是否已经有数据
     void close_conn();  // 关闭连接
+    void set_buffers( char* read_buf, char* write_buf ) { m_read_buf = read_buf; m_write_buf = write_buf; }    // 启动时设置连接的读写缓冲区
     void process(); // 处理客户端请求，也包括了进行响应等一系列后续动作
     bool read();// 非阻塞读
     bool write();// 非阻塞写
+    bool can_process_inline();  // 判断读到的请求能否直接在主线程中处理（完整的GET请求，且目标文件已被缓存）
+    INLINE_RESULT process_inline();     // 在主线程中直接解析请求并发送响应
+    int priority_class();       // 判断请求的优先级类别（PRIORITY）
+    int incoming_cpu() const { return m_incoming_cpu; }  // 收到该连接数据的CPU，未知时为-1
+    bool claim_event();         // 主线程处理该连接上的事件之前调用，返回false表示忽略这个事件（WebSocket连接正在被工作线程处理）
+    // 主线程收到事件时先调用：fd是上游连接，或者是正在转发的客户端连接时，处理这个事件并返回true
+    static bool proxy_event( http_conn* users, int fd, uint32_t events );
+    static upstream* find_upstream( std::string_view path );    // 查找url匹配的反向代理上游（最长前缀），没有时返回NULL
+    // 创建工作线程交还连接用的eventfd并注册到epoll中（主线程，启动时调用），失败返回false
+    static bool init_done_queue( int epollfd );
+    // 主线程收到m_done_fd的事件时调用：关闭工作线程交还的所有连接
+    static void drain_done_queue();
+    // 被抽样跟踪的请求记下到达某个阶段的时间
+    void trace_mark( TRACE_STAGE stage ) {
+        if ( m_traced ) {
+            m_trace.t[ stage ] = tracer::now();
+            if ( stage == TRACE_DEQUEUE ) {
+                m_trace.worker = tracer::thread_id();
+            }
+        }
+    }
 private:
     void init();    // 初始化连接
     HTTP_CODE process_read();    // 解析HTTP请求
@@ -73,9 +154,27 @@ private:
     // 下面这一组函数被process_read调用以分析HTTP请求
     HTTP_CODE parse_request_line( char* text );     // 解析请求行的具体函数
     HTTP_CODE parse_headers( char* text );          // 解析请求头的具体函数
-    HTTP_CODE parse_content( char* text );          // 解析请求体的具体函数
+    HTTP_CODE parse_content();                      // 解析请求体的具体函数（流式地处理已经读到的部分）
+    bool begin_body();                              // 请求头解析完毕，准备接收请求体
+    bool write_body( const char* data, int len );   // 保存一段请求体数据
+    HTTP_CODE finish_upload();                      // 请求体接收完毕，保存到上传目录中
+    void discard_body();                            // 丢弃没有接收完的请求体
     HTTP_CODE do_request();
+    HTTP_CODE do_handler();                         // 调用注册的处理函数生成响应
+    HTTP_CODE do_file_io();                         // 访问磁盘获取目标文件（stat、open、mmap）
+    void process_io();                              // I/O线程处理入口：访问磁盘，然后生成响应
+    void finish( HTTP_CODE read_ret );              // 生成响应，注册写事件
+    bool is_h2_preface( bool& partial );            // 读缓冲区中是否是HTTP/2的连接前言（partial表示还没读完整）
+    void start_h2( bool upgrade );                  // 把连接切换到HTTP/2
+    bool rearm_h2();                                // HTTP/2连接处理完一轮之后重新注册事件，返回false表示需要关闭连接
+    void start_ws();                                // 把连接切换到WebSocket
+    bool start_proxy();                             // 生成发给上游的请求，把连接交给主线程转发；请求头太大时返回false
+    void trace_parsed();                            // 跟踪的请求解析完毕，记下时间和请求行
+    void hand_back();                               // 工作线程：把需要关闭的连接交还给主线程关闭
+    void step_proxy( bool client_event, uint32_t up_events );  // 主线程：推进转发（client_event表示是这个连接自己的事件）
     char* get_line() { return m_read_buf + m_start_line; }
+    bool peek_url( const char*& url, int& len );    // 不修改读缓冲区，取出请求的url
+    bool peek_real_file( char* path );              // 不修改读缓冲区，取出请求的目标文件的完整路径
     LINE_STATE parse_line();                       // 解析报文的每一行，就是从状态机执行的函数
 
     // 这一组函数被process_write调用以填充HTTP应答。
@@ -91,33 +190,92 @@ private:
 
 public:
     static int m_epollfd;       // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-    static int m_user_count;    // 统计用户的数量
+    // 统计用户的数量。只有主线程读写它（工作线程要关闭的连接都交还给主线程关闭，见hand_back），
+    // 但主线程每次accept和关闭连接都要写它，单独占一个缓存行，免得和工作线程频繁读取的其他静态成员共用缓存行
+    static cacheline_padded< int > m_user_count;
+    static bool m_steering;     // 是否通过SO_INCOMING_CPU记录每个连接的数据是由哪个CPU收到的
+    static file_cache m_file_cache; // 所有连接共享的文件缓存
+    static std::vector< std::string > m_priority_prefixes;   // url以这些前缀开头的请求是高优先级的
+    static threadpool< io_task >* m_io_pool;    // 专门访问磁盘的I/O线程池，为NULL表示不开启
+    static asset_bundle* m_bundle;              // 预先加载到内存中的资源包，为NULL表示不开启
+    static const char* m_upload_dir;            // POST/PUT请求体的上传目录，为NULL表示不支持上传
+    static router m_router;                     // 注册的动态请求处理函数（在main函数中注册）
+    static bool m_h2c_enabled;                  // 是否支持HTTP/2明文连接（h2c）
+    static tls_context* m_tls;                  // TLS上下文，为NULL表示不开启TLS（开启后所有连接都是HTTPS）
+    static std::map< std::string, ws_endpoint, std::less<> > m_ws_endpoints;  // 注册的WebSocket端点：路径 -> 回调
+    static std::vector< proxy_route > m_proxy_routes;   // 反向代理路由（在main函数中配置）
+    static client_limiter m_limiter;            // 按客户端IP限制连接数和请求速率（在main函数中配置）
+    static int m_done_fd;                       // 工作线程交还了需要关闭的连接时，通过这个eventfd通知主线程
+    static int m_read_buffer_size;              // 每个连接的读缓冲区的大小（启动时由配置决定）
+    static int m_write_buffer_size;             // 每个连接的写缓冲区的大小
 
 private:
-    int m_sockfd;           // 该HTTP连接的socket
-    sockaddr_in m_address;  // 对应的socket地址
-    
-    char m_read_buf[ READ_BUFFER_SIZE ];    // 读缓冲区
+    // ---------- 数据成员的布局
+    // users数组中的连接被不同的线程同时访问：主线程读写一个连接的同时，工作线程可能正在处理相邻的连接。
+    // 所以整个对象按缓存行（64字节）对齐，相邻的两个连接不会共用一个缓存行（否则一个线程写自己连接的末尾，
+    // 另一个线程的连接开头所在的缓存行就会失效，即伪共享）。
+    // 对象内部按访问频率排列：每个事件、每个请求都要访问的成员集中在开头的几个缓存行中，
+    // 只在部分请求中才用到的大块成员（文件路径、stat结果、请求视图、响应、跟踪记录等）放在后面，
+    // 处理一个普通的请求只需要把开头的几个缓存行调入缓存。
+
+    // ---------- 热数据1：主线程处理每个事件都要访问的成员（分派事件、读数据、交给线程池），正好一个缓存行
+    alignas( 64 ) int m_sockfd;             // 该HTTP连接的socket
+    int m_incoming_cpu;                     // 网卡把该连接的数据包交给了哪个CPU处理（SO_INCOMING_CPU），-1表示未知
+    char* m_read_buf;                       // 读缓冲区（m_read_buffer_size字节，在main函数中统一分配，见set_buffers）
     int m_read_idx;                         // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置（这个只用于读取数据，不用于分析数据）
     int m_checked_idx;                      // 当前正在分析的字符在读缓冲区中的位置（因为我们解析报文肯定也是一个一个字符往后遍历的）
-    int m_start_line;                       // 当前正在解析的行的第一个字符（即该行的起始位置）在所有报文字符中的位置
-
     CHECK_STATE m_check_state;              // 主状态机当前所处的状态
-    METHOD m_method;                        // 请求方法
+    bool m_traced;                          // 这个请求是否被抽样跟踪
+    SSL* m_ssl;                             // 开启TLS时该连接的SSL对象
+    h2_session* m_h2;                       // 切换到HTTP/2之后的会话，为NULL表示还是HTTP/1.1
+    ws_session* m_ws;                       // 切换到WebSocket之后的会话，为NULL表示不是WebSocket连接
+    proxy_session* m_proxy;                 // 正在进行的转发，为NULL表示没有在转发
 
-    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
+    // ---------- 热数据2：解析请求、生成和发送响应时访问的成员
+    int m_start_line;                       // 当前正在解析的行的第一个字符（即该行的起始位置）在所有报文字符中的位置
+    METHOD m_method;                        // 请求方法
+    int m_status;                           // 响应的状态码（写响应行时记下，用于跟踪点）
     char* m_url;                            // 客户请求的目标文件的文件名
     char* m_version;                        // HTTP协议版本号，我们仅支持HTTP1.0和1.1
     char* m_host;                           // 主机名
-    int m_content_length;                   // HTTP请求的消息总长度
-    bool m_linger;                          // HTTP请求是否要求保持连接，即是否为keep-alive
-
-    char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
+    long m_content_length;                  // HTTP请求的消息总长度
+    const request_handler* m_handler;       // 请求对应的处理函数，没有时为NULL（按文件处理）
+    upstream* m_upstream;                   // 请求匹配的反向代理上游，为NULL表示不转发
+    char* m_write_buf;                      // 写缓冲区（m_write_buffer_size字节）
     int m_write_idx;                        // 写缓冲区中待发送的字节数
+    int m_iv_count;                         // iovector对象有两个数据成员，一个表示内存起始地址，另一个表示该块内存内容的长度
+    int m_bytes_to_send;                    // 响应中还没有发送的字节数
+    int m_bytes_have_send;                  // 响应中已经发送的字节数
     char* m_file_address;                   // 客户请求的目标文件被mmap内存映射到内存中的起始位置
+    file_cache::content* m_file_ref;        // m_file_address属于文件缓存时对缓存内容的引用（用完之后release，不能munmap），否则为NULL
+    bool m_from_bundle;                     // 响应的数据是否来自资源包（此时使用m_asset，而不是m_file_address）
+    bool m_inline;                          // 正在主线程中处理（process_inline），不能有任何可能阻塞的系统调用
+    bool m_file_pending;                    // 主线程解析完请求后发现需要访问磁盘，交给了工作线程（见process）
+    bool m_chunked;                         // 请求体是否为分块传输（Transfer-Encoding: chunked）
+    bool m_upgrade_h2c;                     // 请求中是否有Upgrade: h2c
+    bool m_upgrade_ws;                      // 请求中是否有Upgrade: websocket
+    bool m_linger;                          // HTTP请求是否要求保持连接，即是否为keep-alive
+    struct iovec m_iv[ 2 + response_builder::MAX_SEGMENTS ]; // 我们将采用writev来执行写操作，m_iv_count表示被写内存块的数量
+    asset_bundle::asset m_asset;            // 客户请求的目标资源在资源包中的位置
+
+    // ---------- 冷数据：只在部分请求中（请求体、HTTP/2和WebSocket升级、I/O线程池、跟踪）或者建立连接时才访问的成员
+    sockaddr_in m_address;                  // 对应的socket地址
+    client_slot* m_client_slot;             // 这个客户端IP在限流表中的槽，不限流时为NULL
+    CHUNK_STATE m_chunk_state;              // 分块传输的请求体的解析状态
+    long m_chunk_left;                      // 当前块还没有读取的字节数
+    long m_body_received;                   // 已经接收的请求体的字节数（解码之后）
+    int m_body_start;                       // 请求体在读缓冲区中的起始位置，请求体处理完一部分后，剩下的部分会移到这里
+    int m_headers_start;                    // 第一个头部字段在读缓冲区中的位置（转发给上游时按原样转发所有的头部字段）
+    int m_body_fd;                          // 保存请求体的临时文件，没有时为-1；临时文件的路径保存在m_real_file中
+    char* m_h2_settings;                    // 请求中HTTP2-Settings头部的值
+    char* m_ws_key;                         // 请求中Sec-WebSocket-Key头部的值
+    io_task m_io_task;                      // 交给I/O线程池时使用的任务对象
+    http_conn* m_done_next;                 // 交还给主线程的连接组成的链表
+    request_view m_request;                 // 请求的只读视图（指向读缓冲区），交给处理函数使用
+    response_builder m_response;            // 处理函数生成的响应
     struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int m_iv_count;                         // iovector对象有两个数据成员，一个表示内存起始地址，另一个表示该块内存内容的长度
+    char m_real_file[ FILENAME_LEN ];       // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
+    trace_record m_trace;                   // 跟踪的请求的各阶段时间
 };
 
 #endif
@@ -0,0 +1,138 @@
+#include "lock_stats.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+// 所有锁的统计组成一个链表，只增不减（锁对象销毁后统计保留）
+// 这里不能用locker（locker自己会来查找统计），直接用pthread的互斥锁
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static lock_stat* registry = NULL;
+
+// 时间所在的直方图桶
+static int bucket( uint64_t ns ) {
+    int b = ns ? 64 - __builtin_clzll( ns ) : 0;
+    return b < lock_stat::BUCKETS ? b : lock_stat::BUCKETS - 1;
+}
+
+static void update_max( std::atomic< uint64_t >& max, uint64_t v ) {
+    uint64_t cur = max.load( std::memory_order_relaxed );
+    while( v > cur && !max.compare_exchange_weak( cur, v, std::memory_order_relaxed ) ) {
+    }
+}
+
+void lock_stat::on_acquire( bool was_contended, uint64_t waited ) {
+    acquired.fetch_add( 1, std::memory_order_relaxed );
+    if( was_contended ) {
+        contended.fetch_add( 1, std::memory_order_relaxed );
+        wait_ns.fetch_add( waited, std::memory_order_relaxed );
+        wait_hist[ bucket( waited ) ].fetch_add( 1, std::memory_order_relaxed );
+        update_max( max_wait_ns, waited );
+    }
+}
+
+void lock_stat::on_release( uint64_t held ) {
+    hold_ns.fetch_add( held, std::memory_order_relaxed );
+    hold_hist[ bucket( held ) ].fetch_add( 1, std::memory_order_relaxed );
+    update_max( max_hold_ns, held );
+}
+
+
+bool lock_stats::enabled() {
+#ifdef LOCK_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t lock_stats::now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+lock_stat* lock_stats::find( const char* name, bool is_sem ) {
+    if( !name ) {
+        name = is_sem ? "sem" : "locker";
+    }
+    pthread_mutex_lock( &registry_mutex );
+    lock_stat* s = registry;
+    while( s && !( s->is_sem == is_sem && strncmp( s->name, name, sizeof( s->name ) - 1 ) == 0 ) ) {
+        s = s->next;
+    }
+    if( !s ) {
+        s = new lock_stat();    // 值初始化，计数器都为0
+        strncpy( s->name, name, sizeof( s->name ) - 1 );
+        s->is_sem = is_sem;
+        s->next = registry;
+        registry = s;
+    }
+    pthread_mutex_unlock( &registry_mutex );
+    return s;
+}
+
+// 直方图中第p百分位所在桶的上界（纳秒）
+static uint64_t percentile( const std::atomic< uint64_t >* hist, uint64_t total, double p ) {
+    if( total == 0 ) {
+        return 0;
+    }
+    uint64_t target = ( uint64_t )( total * p );
+    uint64_t seen = 0;
+    for( int i = 0; i < lock_stat::BUCKETS; ++i ) {
+        seen += hist[i].load( std::memory_order_relaxed );
+        if( seen > target ) {
+            return 1ULL << i;
+        }
+    }
+    return 1ULL << ( lock_stat::BUCKETS - 1 );
+}
+
+// 打印一个直方图中不为0的桶
+static void print_hist( FILE* fp, const char* what, const std::atomic< uint64_t >* hist ) {
+    fprintf( fp, "    %s:\n", what );
+    for( int i = 0; i < lock_stat::BUCKETS; ++i ) {
+        uint64_t n = hist[i].load( std::memory_order_relaxed );
+        if( n ) {
+            fprintf( fp, "      [%llu, %llu) ns  %llu\n", i ? 1ULL << ( i - 1 ) : 0ULL, 1ULL << i, ( unsigned long long )n );
+        }
+    }
+}
+
+void lock_stats::dump( FILE* fp ) {
+    if( !enabled() ) {
+        fprintf( fp, "lock stats: not compiled in (build with -DLOCK_STATS)\n" );
+        return;
+    }
+    fprintf( fp, "%-24s %12s %12s %7s %10s %9s %9s %9s %9s %9s %10s %12s\n", "lock", "acquired", "contended", "cont%",
+             "wait_ms", "wait_p50", "wait_p99", "wait_max", "hold_avg", "hold_p99", "hold_max", "posts" );
+    pthread_mutex_lock( &registry_mutex );
+    for( lock_stat* s = registry; s; s = s->next ) {
+        uint64_t acquired = s->acquired.load( std::memory_order_relaxed );
+        uint64_t contended = s->contended.load( std::memory_order_relaxed );
+        // 延迟的单位都是微秒（百分位是直方图桶的上界，精确到2倍）
+        fprintf( fp, "%-24s %12llu %12llu %6.2f%% %10.3f %9.1f %9.1f %9.1f ", s->name,
+                 ( unsigned long long )acquired, ( unsigned long long )contended,
+                 acquired ? 100.0 * contended / acquired : 0.0,
+                 s->wait_ns.load( std::memory_order_relaxed ) / 1e6,
+                 percentile( s->wait_hist, contended, 0.5 ) / 1e3,
+                 percentile( s->wait_hist, contended, 0.99 ) / 1e3,
+                 s->max_wait_ns.load( std::memory_order_relaxed ) / 1e3 );
+        if( s->is_sem ) {
+            fprintf( fp, "%9s %9s %10s %12llu\n", "-", "-", "-", ( unsigned long long )s->posts.load( std::memory_order_relaxed ) );
+        } else {
+            fprintf( fp, "%9.2f %9.1f %10.1f %12s\n", acquired ? s->hold_ns.load( std::memory_order_relaxed ) / 1e3 / acquired : 0.0,
+                     percentile( s->hold_hist, acquired, 0.99 ) / 1e3,
+                     s->max_hold_ns.load( std::memory_order_relaxed ) / 1e3, "-" );
+        }
+    }
+    // 再打印有竞争的锁的等待时间直方图
+    for( lock_stat* s = registry; s; s = s->next ) {
+        if( s->contended.load( std::memory_order_relaxed ) ) {
+            fprintf( fp, "%s\n", s->name );
+            print_hist( fp, s->is_sem ? "blocked" : "wait", s->wait_hist );
+        }
+    }
+    pthread_mutex_unlock( &registry_mutex );
+    fflush( fp );
+}
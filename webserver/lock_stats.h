@@ -0,0 +1,53 @@
+#ifndef LOCK_STATS_H
+#define LOCK_STATS_H
+
+// 锁竞争统计
+// locker和sem只是pthread的简单封装，线程在m_queuelocker等锁上阻塞了多少次、多久以前看不出来，只能猜。
+//
+// 编译时定义LOCK_STATS（g++ -DLOCK_STATS *.cpp ...）后，locker和sem会记录：
+//   locker：加锁次数、其中需要等待的次数（先trylock，失败了才算竞争）、等待时间和持有时间的直方图
+//   sem：   wait的次数、其中需要阻塞的次数、阻塞时间的直方图，以及post的次数
+// 统计按锁的名字汇总（构造时传入，比如所有WebSocket会话的锁都叫ws.session），计数器都是原子变量，不需要额外加锁。
+// 服务器收到SIGUSR2时把所有锁的统计打印到标准输出。
+// 没有定义LOCK_STATS时，locker和sem和原来完全一样，名字被忽略，没有任何开销。
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+
+// 一个名字的锁的统计
+struct lock_stat {
+    static const int BUCKETS = 40;      // 直方图的桶：第i个桶为[2^(i-1), 2^i)纳秒，最后一个桶包括更长的时间
+
+    char name[ 32 ];
+    bool is_sem;                        // 信号量（没有持有时间，多了post的次数）
+    std::atomic< uint64_t > acquired;   // 加锁（信号量：wait成功）的次数
+    std::atomic< uint64_t > contended;  // 需要等待的次数
+    std::atomic< uint64_t > posts;      // 信号量post的次数
+    std::atomic< uint64_t > wait_ns;    // 等待时间的总和
+    std::atomic< uint64_t > hold_ns;    // 持有时间的总和
+    std::atomic< uint64_t > max_wait_ns;
+    std::atomic< uint64_t > max_hold_ns;
+    std::atomic< uint64_t > wait_hist[ BUCKETS ];
+    std::atomic< uint64_t > hold_hist[ BUCKETS ];
+    lock_stat* next;
+
+    // 加锁成功，contended表示等待了waited纳秒
+    void on_acquire( bool contended, uint64_t waited );
+    // 解锁，锁被持有了held纳秒
+    void on_release( uint64_t held );
+    void on_post() { posts.fetch_add( 1, std::memory_order_relaxed ); }
+};
+
+class lock_stats {
+public:
+    // 编译时是否开启了统计
+    static bool enabled();
+    // 查找或者创建名字为name的统计（名字会被复制，超过31个字符的部分截断）
+    static lock_stat* find( const char* name, bool is_sem );
+    // 把所有锁的统计打印到fp
+    static void dump( FILE* fp );
+    static uint64_t now();
+};
+
+#endif
@@ -4,20 +4,30 @@
 // 线程同步机制封装类
 // 用于解决任务队列的同步问题（任务队列是临界区资源）
 // 两个类：互斥锁类，信号量类
+// 编译时定义LOCK_STATS时会统计加锁、等待和持有的时间（见lock_stats.h），构造时传入的名字用于汇总统计
 
 
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include "lock_stats.h"
 
 
 // 互斥锁类
 class locker {
 public:
-    locker() {
+    locker( const char* name = NULL ) {
         if(pthread_mutex_init(&m_mutex, NULL) != 0) { // 互斥锁初始化函数第二个参数为互斥锁的属性，设为NULL为默认互斥锁属性
             throw std::exception();         // 如果初始化失败，那么抛出异常
         }
+#ifdef LOCK_STATS
+        m_stat = lock_stats::find( name, false );
+        m_acquired = 0;
+#else
+        ( void )name;
+#endif
     }
 
     ~locker() {
@@ -26,11 +36,31 @@ public:
 
     // 上锁
     bool lock() {
+#ifdef LOCK_STATS
+        // 先尝试一次，锁被别的线程持有时才算竞争，并统计等待的时间
+        int ret = pthread_mutex_trylock( &m_mutex );
+        bool contended = ret == EBUSY;
+        uint64_t start = 0;
+        if ( contended ) {
+            start = lock_stats::now();
+            ret = pthread_mutex_lock( &m_mutex );
+        }
+        if ( ret != 0 ) {
+            return false;
+        }
+        m_acquired = lock_stats::now();     // 只有持有锁的线程会访问
+        m_stat->on_acquire( contended, m_acquired - start );
+        return true;
+#else
         return pthread_mutex_lock(&m_mutex) == 0; // 返回值为0，说明上锁成功，否则说明上锁失败
+#endif
     }
 
     // 解锁
     bool unlock() {
+#ifdef LOCK_STATS
+        m_stat->on_release( lock_stats::now() - m_acquired );
+#endif
         return pthread_mutex_unlock(&m_mutex) == 0;
     }
 
@@ -42,6 +72,10 @@ public:
 
 private:
     pthread_mutex_t m_mutex; // 只有一个数据成员，即位互斥锁类型的变量
+#ifdef LOCK_STATS
+    lock_stat* m_stat;      // 这把锁的名字对应的统计
+    uint64_t m_acquired;    // 这一次加锁成功的时间
+#endif
 };
 
 
@@ -49,30 +83,90 @@ private:
 class sem {
 public:
     // 两个构造函数，一个无参，一个有参
-    sem() {
+    sem( const char* name = NULL ) {
         if( sem_init( &m_sem, 0, 0 ) != 0 ) {
             throw std::exception();
         }
+        init_stat( name );
     }
     // 有参构造函数，num为信号量初始值
-    sem(int num) {
+    sem( int num, const char* name = NULL ) {
         if( sem_init( &m_sem, 0, num ) != 0 ) {
             throw std::exception();
         }
+        init_stat( name );
     }
     ~sem() {
         sem_destroy( &m_sem );
     }
     // 等待信号量，即P操作
     bool wait() {
+#ifdef LOCK_STATS
+        // 信号量为0时才算阻塞，统计阻塞的时间
+        if ( sem_trywait( &m_sem ) == 0 ) {
+            m_stat->on_acquire( false, 0 );
+            return true;
+        }
+        uint64_t start = lock_stats::now();
+        bool ok = sem_wait( &m_sem ) == 0;
+        if ( ok ) {
+            m_stat->on_acquire( true, lock_stats::now() - start );
+        }
+        return ok;
+#else
         return sem_wait( &m_sem ) == 0;
+#endif
+    }
+    // 带超时的等待，最多等待ms毫秒，超时或出错返回false
+    bool timed_wait( int ms ) {
+#ifdef LOCK_STATS
+        if ( sem_trywait( &m_sem ) == 0 ) {
+            m_stat->on_acquire( false, 0 );
+            return true;
+        }
+        uint64_t start = lock_stats::now();
+#endif
+        struct timespec ts;
+        clock_gettime( CLOCK_REALTIME, &ts );
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += ( ms % 1000 ) * 1000000L;
+        if( ts.tv_nsec >= 1000000000L ) {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000L;
+        }
+#ifdef LOCK_STATS
+        int saved_errno;
+        bool ok = sem_timedwait( &m_sem, &ts ) == 0;
+        saved_errno = errno;    // 调用者要根据errno判断是不是超时
+        if ( ok ) {
+            m_stat->on_acquire( true, lock_stats::now() - start );
+        }
+        errno = saved_errno;
+        return ok;
+#else
+        return sem_timedwait( &m_sem, &ts ) == 0;
+#endif
     }
     // 释放信号量，即V操作
     bool post() {
+#ifdef LOCK_STATS
+        m_stat->on_post();
+#endif
         return sem_post( &m_sem ) == 0;
     }
 private:
+    void init_stat( const char* name ) {
+#ifdef LOCK_STATS
+        m_stat = lock_stats::find( name, true );
+#else
+        ( void )name;
+#endif
+    }
+
     sem_t m_sem;
+#ifdef LOCK_STATS
+    lock_stat* m_stat;
+#endif
 };
 
 #endif
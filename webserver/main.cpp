@@ -8,12 +8,18 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <new>
+#include <vector>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
-
-#define MAX_FD 65536   // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000  // 监听的最大的事件数量
+#include "affinity.h"
+#include "config.h"
+#include "warm_start.h"
 
 // 向epoll中添加文件描述符
 extern void addfd( int epollfd, int fd, bool one_shot );
@@ -21,6 +27,8 @@ extern void addfd( int epollfd, int fd, bool one_shot );
 extern void removefd( int epollfd, int fd );
 // 修改epoll对象中的文件描述符
 //extern void modfd(int epollfd, int fd, int ev);
+// 网站的根目录，定义在http_conn.cpp中
+extern const char* doc_root;
 
 // 添加信号捕捉
 void addsig(int sig, void( handler )(int)){
@@ -32,22 +40,418 @@ void addsig(int sig, void( handler )(int)){
 }
 
 
+// 收到SIGUSR1时写出请求跟踪记录（在主循环中写，信号处理函数中只设置标志）
+static volatile sig_atomic_t dump_trace = 0;
+void on_dump_trace( int ) {
+    dump_trace = 1;
+}
+
+// 收到SIGUSR2时打印线程池的统计（线程数、扩容缩容次数）、大页的使用情况（-H），以及锁竞争统计（编译时定义了LOCK_STATS）
+static volatile sig_atomic_t dump_locks = 0;
+void on_dump_locks( int ) {
+    dump_locks = 1;
+}
+
+// 打印用法
+void usage( const char* prog ) {
+    printf( "please set port: %s [options] port_number\n", prog );
+    printf( "  -C file      read settings (key = value lines) from file\n" );
+    printf( "  -S key=value set one setting: threads, queue_size, read_buffer, write_buffer,\n" );
+    printf( "               max_fd, max_events, doc_root, auto_tune (off/on/calibrate),\n" );
+    printf( "               warm_budget_mb, manifest_interval\n" );
+    printf( "  -t n         number of worker threads (same as -S threads=n)\n" );
+    printf( "  -d dir       document root (same as -S doc_root=dir)\n" );
+    printf( "  -a           pick unset settings from cpus, numa nodes, RLIMIT_NOFILE and memory\n" );
+    printf( "  -A           like -a, and calibrate the thread count with a short loopback benchmark\n" );
+    printf( "  -r cpu       bind the main (epoll) thread to cpu\n" );
+    printf( "  -w cpulist   bind worker threads to cpus, e.g. 0-3,8\n" );
+    printf( "  -s           steer each connection to the cpu that received it (SO_INCOMING_CPU)\n" );
+    printf( "  -f           serve small requests for cached files directly on the main thread\n" );
+    printf( "  -e min-max[,wait_us,idle_ms]\n" );
+    printf( "               elastic thread pool: grow up to max threads when requests queue longer than\n" );
+    printf( "               wait_us (default 1000), retire threads idle for idle_ms (default 30000) down to min;\n" );
+    printf( "               send SIGUSR2 to print the thread count and how often the pool grew and shrank\n" );
+    printf( "  -p prefix    requests whose url starts with prefix get high priority (repeatable)\n" );
+    printf( "  -W h,n,b     scheduling weights of high/normal/bulk priority requests (default 8,4,1)\n" );
+    printf( "  -o n         use n dedicated threads for blocking file system work (stat/open/mmap)\n" );
+    printf( "  -b           pack the document root into memory at startup and serve only from it\n" );
+    printf( "  -B file      serve from a pack file created by -P (mmap'd at startup)\n" );
+    printf( "  -P file      pack the document root into file and exit (no port needed)\n" );
+    printf( "  -u dir       accept POST/PUT uploads, streaming request bodies into files under dir\n" );
+    printf( "  -2           accept HTTP/2 over cleartext (prior knowledge and Upgrade: h2c)\n" );
+    printf( "  -c cert      serve HTTPS with this PEM certificate chain (requires -k)\n" );
+    printf( "  -k key       PEM private key for -c\n" );
+    printf( "  -D secs      TCP_DEFER_ACCEPT: only wake up for a new connection once its request has arrived\n" );
+    printf( "               (or secs have passed), and read and handle the request right after accept\n" );
+    printf( "  -F qlen      enable server-side TCP Fast Open (request data in the SYN), and read right after accept\n" );
+    printf( "  -H           back the connection table, buffers, file cache and asset bundle with 2MB huge pages\n" );
+    printf( "               (reserved pages via MAP_HUGETLB, falling back to transparent huge pages)\n" );
+    printf( "  -M file      keep a manifest of the hottest files in file (saved every manifest_interval seconds)\n" );
+    printf( "               and preload them (up to warm_budget_mb) at startup before accepting connections\n" );
+    printf( "  -L n         allow at most n concurrent connections per client ip\n" );
+    printf( "  -R rate[,burst]\n" );
+    printf( "               allow each client ip rate requests per second, bursts of up to burst (default rate)\n" );
+    printf( "  -T file[,every]\n" );
+    printf( "               trace one in every requests (default 100) and write them to file as\n" );
+    printf( "               Chrome trace event JSON when the server receives SIGUSR1\n" );
+    printf( "  -x prefix=upstream\n" );
+    printf( "               forward requests whose url starts with prefix to upstream (host:port or\n" );
+    printf( "               unix:/path) over pooled keep-alive connections (repeatable)\n" );
+    printf( "  -U path      also listen on a unix domain socket at path, for clients on the same host (repeatable)\n" );
+    printf( "  -E path      register the WebSocket broadcast example at path: every message from one client\n" );
+    printf( "               is sent to all clients connected to path (no authentication, for testing only)\n" );
+    printf( "  -K path      answer GET path with \"ok\" for load balancer health checks\n" );
+}
+
+
+// 创建监听path的Unix域套接字，失败返回-1
+// path上已经有一个socket文件时（上次运行留下的）先删除，是其他文件时不覆盖
+static int listen_unix( const char* path ) {
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    if( strlen( path ) >= sizeof( addr.sun_path ) ) {
+        printf( "unix socket path too long: %s\n", path );
+        return -1;
+    }
+    strcpy( addr.sun_path, path );
+    struct stat st;
+    if( lstat( path, &st ) == 0 ) {
+        if( !S_ISSOCK( st.st_mode ) ) {
+            printf( "%s exists and is not a socket\n", path );
+            return -1;
+        }
+        unlink( path );
+    }
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( fd < 0 ) {
+        printf( "create unix socket failed: %s\n", strerror( errno ) );
+        return -1;
+    }
+    // 连接队列满时，非阻塞的客户端connect会直接失败（EAGAIN），不像TCP那样重传SYN，所以队列设置得大一些
+    if( bind( fd, ( struct sockaddr* )&addr, sizeof( addr ) ) != 0 || listen( fd, SOMAXCONN ) != 0 ) {
+        printf( "listen on %s failed: %s\n", path, strerror( errno ) );
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+// fd是否是Unix域套接字的监听socket
+static bool is_unix_listener( const std::vector< int >& unix_listenfds, int fd ) {
+    for( size_t i = 0; i < unix_listenfds.size(); ++i ) {
+        if( unix_listenfds[i] == fd ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// 连接上读到了请求数据（可读事件，或者接受连接后马上读到的）
+// 完整的小请求且目标文件已缓存时直接在主线程中处理并发送响应，其余的记到ready_conns中，
+// 遍历完本轮的所有事件后一次性交给线程池
+static void on_request_data( http_conn* conn, bool fast_path, http_conn** ready_conns, int* ready_cpus,
+                             int* ready_classes, int& ready ) {
+    conn->trace_mark( TRACE_READ );
+    http_conn::INLINE_RESULT result = http_conn::INLINE_DEFER;
+    if( fast_path && conn->can_process_inline() ) {
+        result = conn->process_inline();
+        if( result == http_conn::INLINE_CLOSE ) {
+            conn->close_conn();
+        }
+    }
+    // 不能在主线程中处理，或者处理到一半发现需要访问磁盘
+    if( result == http_conn::INLINE_DEFER ) {
+        // 先记下来，同时记下该连接的数据是在哪个CPU上收到的
+        ready_conns[ready] = conn;
+        ready_cpus[ready] = conn->incoming_cpu();
+        ready_classes[ready] = conn->priority_class();
+        ++ready;
+    }
+}
+
+
 // main函数
 // 需要在命令行中传入端口号
 int main( int argc, char* argv[] ) {
+
+    // 解析命令行选项
+    int reactor_cpu = -1;               // 主线程绑定的CPU，-1表示不绑定
+    std::vector<int> worker_cpus;       // 工作线程绑定的CPU列表，为空表示不绑定
+    bool steering = false;              // 是否按SO_INCOMING_CPU引导任务
+    bool fast_path = false;             // 是否在主线程中直接处理小请求（不经过线程池）
+    int min_threads = 0;                // 弹性线程池的线程数量下限和上限，都为0表示线程数量固定
+    int max_threads = 0;
+    int target_wait_us = 1000;          // 弹性线程池：任务排队超过这个时间（微秒）时增加线程
+    int idle_timeout_ms = 30000;        // 弹性线程池：线程空闲超过这个时间（毫秒）时退出
+    int weights[ threadpool< http_conn >::PRIORITY_CLASSES ] = { 8, 4, 1 };  // 各优先级类别的调度权重
+    int io_threads = 0;                 // I/O线程池的线程数量，0表示不开启
+    bool pack_at_startup = false;       // 是否在启动时把资源目录打包进内存
+    const char* pack_file = NULL;       // 要加载的资源包文件
+    const char* pack_output = NULL;     // 打包资源目录后要写出的资源包文件
+    const char* cert_file = NULL;       // TLS证书和私钥，都指定时开启TLS
+    const char* key_file = NULL;
+    int max_conns_per_ip = 0;           // 每个客户端IP的连接数上限，0表示不限制
+    int request_rate = 0;               // 每个客户端IP每秒的请求数和突发请求数，0表示不限制
+    int request_burst = 0;
+    int defer_accept = 0;               // TCP_DEFER_ACCEPT的秒数，0表示不开启
+    int fastopen_qlen = 0;              // TCP Fast Open的队列长度，0表示不开启
+    std::vector< const char* > unix_paths;  // 同时监听的Unix域套接字的路径
+    const char* manifest = NULL;        // 热点文件清单，为NULL表示不使用
+    const char* ws_example = NULL;      // WebSocket广播示例的路径，为NULL表示不注册
+    const char* health_path = NULL;     // 健康检查的路径，为NULL表示不注册
+    server_config config;               // 线程数、队列长度、缓冲区大小、最大连接数等（配置文件、命令行、自动调优）
+    int opt;
+    while( ( opt = getopt( argc, argv, "r:w:sfe:p:W:o:bB:P:u:2c:k:x:L:R:T:C:S:t:d:aAD:F:U:HM:E:K:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'C':
+                if( !config.load( optarg ) ) {
+                    return 1;
+                }
+                break;
+            case 'S': {
+                // key=value
+                std::string item( optarg );
+                size_t eq = item.find( '=' );
+                if( eq == std::string::npos || !config.set( item.substr( 0, eq ).c_str(), item.c_str() + eq + 1 ) ) {
+                    printf( "bad setting: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            }
+            case 't':
+                if( !config.set( "threads", optarg ) ) {
+                    return 1;
+                }
+                break;
+            case 'd':
+                if( !config.set( "doc_root", optarg ) ) {
+                    return 1;
+                }
+                break;
+            case 'a':
+                config.set( "auto_tune", "on" );
+                break;
+            case 'A':
+                config.set( "auto_tune", "calibrate" );
+                break;
+            case 'r':
+                reactor_cpu = atoi( optarg );
+                break;
+            case 'w':
+                if( !parse_cpu_list( optarg, worker_cpus ) ) {
+                    printf( "bad cpu list: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 's':
+                steering = true;
+                break;
+            case 'f':
+                fast_path = true;
+                break;
+            case 'e':
+                if( sscanf( optarg, "%d-%d,%d,%d", &min_threads, &max_threads, &target_wait_us, &idle_timeout_ms ) < 2
+                        || min_threads <= 0 || max_threads < min_threads || target_wait_us <= 0 || idle_timeout_ms <= 0 ) {
+                    printf( "bad thread range: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'p':
+                http_conn::m_priority_prefixes.push_back( optarg );
+                break;
+            case 'o':
+                io_threads = atoi( optarg );
+                break;
+            case 'b':
+                pack_at_startup = true;
+                break;
+            case 'B':
+                pack_file = optarg;
+                break;
+            case 'P':
+                pack_output = optarg;
+                break;
+            case 'u':
+                http_conn::m_upload_dir = optarg;
+                break;
+            case '2':
+                http_conn::m_h2c_enabled = true;
+                break;
+            case 'c':
+                cert_file = optarg;
+                break;
+            case 'k':
+                key_file = optarg;
+                break;
+            case 'D':
+                defer_accept = atoi( optarg );
+                if( defer_accept <= 0 ) {
+                    printf( "bad defer accept timeout: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'F':
+                fastopen_qlen = atoi( optarg );
+                if( fastopen_qlen <= 0 ) {
+                    printf( "bad fast open queue length: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'L':
+                max_conns_per_ip = atoi( optarg );
+                if( max_conns_per_ip <= 0 ) {
+                    printf( "bad connection limit: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            case 'R': {
+                int n = sscanf( optarg, "%d,%d", &request_rate, &request_burst );
+                if( n < 1 || request_rate <= 0 || ( n == 2 && request_burst <= 0 ) ) {
+                    printf( "bad request rate: %s\n", optarg );
+                    return 1;
+                }
+                if( n == 1 ) {
+                    request_burst = request_rate;   // 默认允许一秒的量一次性到达
+                }
+                break;
+            }
+            case 'T': {
+                // file[,every]，文件名中不能有逗号
+                static std::string trace_file;
+                const char* comma = strrchr( optarg, ',' );
+                int every = 100;
+                if( comma ) {
+                    every = atoi( comma + 1 );
+                    trace_file.assign( optarg, comma - optarg );
+                } else {
+                    trace_file = optarg;
+                }
+                if( trace_file.empty() || every <= 0 ) {
+                    printf( "bad trace option: %s\n", optarg );
+                    return 1;
+                }
+                tracer::configure( trace_file.c_str(), every );
+                break;
+            }
+            case 'U':
+                unix_paths.push_back( optarg );
+                break;
+            case 'M':
+                manifest = optarg;
+                break;
+            case 'E':
+                if( optarg[0] != '/' ) {
+                    printf( "-E expects a path starting with /\n" );
+                    return 1;
+                }
+                ws_example = optarg;
+                break;
+            case 'K':
+                if( optarg[0] != '/' ) {
+                    printf( "-K expects a path starting with /\n" );
+                    return 1;
+                }
+                health_path = optarg;
+                break;
+            case 'H':
+                // 之后alloc_on_node分配的内存都使用大页，缓存的文件也拷贝到大页中
+                set_huge_pages( true );
+                http_conn::m_file_cache.use_huge_pages();
+                break;
+            case 'x': {
+                // prefix=upstream，启动时就解析好上游地址
+                const char* eq = strchr( optarg, '=' );
+                if( !eq || optarg[0] != '/' ) {
+                    printf( "bad proxy route: %s\n", optarg );
+                    return 1;
+                }
+                try {
+                    proxy_route route;
+                    route.prefix.assign( optarg, eq - optarg );
+                    route.up = new upstream( eq + 1 );
+                    http_conn::m_proxy_routes.push_back( route );
+                } catch( ... ) {
+                    printf( "bad upstream address: %s\n", eq + 1 );
+                    return 1;
+                }
+                break;
+            }
+            case 'W':
+                if( sscanf( optarg, "%d,%d,%d", &weights[0], &weights[1], &weights[2] ) != 3
+                        || weights[0] <= 0 || weights[1] <= 0 || weights[2] <= 0 ) {
+                    printf( "bad weights: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            default:
+                usage( basename(argv[0]) );
+                return 1;
+        }
+    }
     
-    if( argc <= 1 ) {
+    // 确定最终的配置（按需自动调优）并打印出来
+    config.finish( sizeof( http_conn ) );
+    doc_root = config.doc_root();
+    int max_fd = config.get( server_config::MAX_FD );
+    int max_events = config.get( server_config::MAX_EVENTS );
+    http_conn::m_read_buffer_size = config.get( server_config::READ_BUFFER );
+    http_conn::m_write_buffer_size = config.get( server_config::WRITE_BUFFER );
+
+    // 只打包资源目录，生成资源包文件后退出
+    if( pack_output ) {
+        asset_bundle bundle;
+        if( !bundle.build( doc_root ) || !bundle.save( pack_output ) ) {
+            printf( "pack %s into %s failed\n", doc_root, pack_output );
+            return 1;
+        }
+        printf( "packed %u files from %s into %s\n", bundle.count(), doc_root, pack_output );
+        return 0;
+    }
+    
+    if( optind >= argc ) {
         // 提示用户需要传入端口号
-        printf( "please set port: %s port_number\n", basename(argv[0]));
+        usage( basename(argv[0]) );
         return 1;
     }
 
     // 获取端口号，需要将字符串转换为整数
-    int port = atoi( argv[1] );
+    int port = atoi( argv[optind] );
+
+    // 加载证书和私钥，之后所有连接都是HTTPS
+    if( cert_file || key_file ) {
+        if( !cert_file || !key_file ) {
+            usage( basename(argv[0]) );
+            return 1;
+        }
+        try {
+            http_conn::m_tls = new tls_context( cert_file, key_file );
+        } catch( ... ) {
+            printf( "load certificate %s / key %s failed\n", cert_file, key_file );
+            return 1;
+        }
+        printf( "serving HTTPS, kernel TLS offload %s\n",
+                http_conn::m_tls->ktls_supported() ? "used when the kernel supports it" : "not available in this OpenSSL" );
+    }
+
+    // 将主线程绑定到指定的CPU上，并记下该CPU所在的NUMA节点，
+    // 下面所有连接的数据都在这个节点上分配，主线程读写它们时就不会跨节点访问内存了
+    int numa_node = -1;
+    if( reactor_cpu >= 0 ) {
+        if( !bind_thread_to_cpu( pthread_self(), reactor_cpu ) ) {
+            printf( "bind main thread to cpu %d failed\n", reactor_cpu );
+        }
+        numa_node = numa_node_of_cpu( reactor_cpu );
+    }
     // 对SIGPIPE信号进行处理，本来默认操作是终止进程，但现在我们让他设置为SIG_IGN，即忽略该信号
     // 产生SIGPIPE信号的原因：在网络通信时，如果有一端断开连接了，另一端不知道，
     //          此时另一端还往缓冲区中写数据，就会产生SIGPIPE信号'
     addsig( SIGPIPE, SIG_IGN );
+    if( tracer::enabled() ) {
+        addsig( SIGUSR1, on_dump_trace );
+    }
+    addsig( SIGUSR2, on_dump_locks );
 
     // 程序一启动，就要初始化线程池
     // 创建线程池，初始化线程池，就是一个threadpool<http_conn>*类型（指针类型）
@@ -57,14 +461,94 @@ int main( int argc, char* argv[] ) {
     // 插入到请求队列中，然后由工作线程来处理
     threadpool< http_conn >* pool = NULL;
     try {
-        pool = new threadpool<http_conn>;
+        // 弹性线程池从下限个线程开始，按需增加
+        int thread_number = min_threads > 0 ? min_threads : config.get( server_config::THREADS );
+        pool = new threadpool<http_conn>( thread_number, config.get( server_config::QUEUE_SIZE ), worker_cpus,
+                                          min_threads, max_threads, "worker" );
     } catch( ... ) {  // 如果捕捉到异常，就退出程序
         return 1;
     }
+    pool->set_steering( steering );
+    pool->set_elastic_params( target_wait_us, idle_timeout_ms );
+    // 加载资源包，之后所有请求都只从资源包中查找
+    if( pack_file || pack_at_startup ) {
+        http_conn::m_bundle = new asset_bundle;
+        bool ok = pack_file ? http_conn::m_bundle->load( pack_file ) : http_conn::m_bundle->build( doc_root );
+        if( !ok ) {
+            printf( "load asset bundle from %s failed\n", pack_file ? pack_file : doc_root );
+            delete http_conn::m_bundle;
+            delete pool;
+            return 1;
+        }
+        printf( "serving %u files from asset bundle\n", http_conn::m_bundle->count() );
+    }
+    // 创建I/O线程池，请求队列最多1000个任务，满了之后工作线程自己访问磁盘
+    if( io_threads > 0 ) {
+        try {
+            http_conn::m_io_pool = new threadpool< http_conn::io_task >( io_threads, 1000, std::vector< int >(), 0, 0, "io" );
+        } catch( ... ) {
+            delete pool;
+            return 1;
+        }
+    }
+    pool->set_priority_params( weights, 100000 );  // 任务最多被饿100ms
+    http_conn::m_steering = steering;
+    http_conn::m_limiter.configure( max_conns_per_ip, request_rate, request_burst );
+    // 注册动态请求处理函数（必须在开始处理请求之前注册，之后路由表只读）
+    // 健康检查（-K）：负载均衡器可以用它判断服务器是否存活，可以配合 -p 设为高优先级
+    // 注册之后同名的静态文件就访问不到了，而且路由表非空会改变请求行对方法的处理，所以只在明确指定时才注册
+    if( health_path ) {
+        http_conn::m_router.add( "GET", health_path, []( const request_view&, response_builder& resp ) {
+            static const char ok[] = "ok\n";
+            resp.write_ref( ok, sizeof( ok ) - 1 );
+        } );
+    }
+    // WebSocket广播示例（-E）：连接到这个路径的客户端都订阅同一个频道，任何一个客户端发来的消息都广播给所有客户端
+    // 没有任何认证，任何人都可以给所有人发消息，所以只在明确指定时才注册，用于测试
+    static ws_channel ws_broadcast;
+    if( ws_example ) {
+        ws_endpoint& ws = http_conn::m_ws_endpoints[ ws_example ];
+        ws.on_open = []( ws_session& s ) {
+            s.subscribe( ws_broadcast );
+        };
+        ws.on_message = []( ws_session&, std::string_view msg, bool binary ) {
+            ws_broadcast.broadcast( msg, binary );
+        };
+    }
 
     // 创建一个数组用于保存所有的客户端连接信息
     // 这个数组是在我们主线程（即main函数线程中）创建的，只对主线程可见
-    http_conn* users = new http_conn[ MAX_FD ];
+    // 数组的内存在主线程所在的NUMA节点上分配（未绑定CPU时就是普通的分配），然后逐个构造
+    // 读写缓冲区的大小是启动时才确定的，所有连接的缓冲区放在另一块同样在这个节点上分配的内存中
+    // （按页分配，只有用到的连接的缓冲区才会真正占用物理内存）
+    size_t users_size = sizeof( http_conn ) * max_fd;
+    size_t conn_buffer_size = http_conn::m_read_buffer_size + http_conn::m_write_buffer_size;
+    size_t buffers_size = conn_buffer_size * max_fd;
+    void* users_mem = alloc_on_node( users_size, numa_node );
+    char* buffers_mem = static_cast< char* >( alloc_on_node( buffers_size, numa_node ) );
+    if( !users_mem || !buffers_mem ) {
+        printf( "allocate memory for %d connections failed\n", max_fd );
+        delete pool;
+        return 1;
+    }
+    http_conn* users = static_cast< http_conn* >( users_mem );
+    for( int i = 0; i < max_fd; ++i ) {
+        new ( users + i ) http_conn();
+        char* buf = buffers_mem + conn_buffer_size * i;
+        users[i].set_buffers( buf, buf + http_conn::m_read_buffer_size );
+    }
+
+    // 按上次保存的热点文件清单预热文件缓存和页缓存，完成之后才开始监听，重启后的第一批请求就不用等磁盘了
+    // （开启了资源包时所有资源都已经在内存中，不需要清单）
+    if( manifest && http_conn::m_bundle ) {
+        printf( "asset bundle in use, ignoring manifest %s\n", manifest );
+        manifest = NULL;
+    }
+    if( manifest ) {
+        warm_start::preload( manifest, doc_root, http_conn::m_file_cache,
+                             ( size_t )config.get( server_config::WARM_BUDGET_MB ) << 20 );
+    }
+    print_huge_pages();
 
     // -------- 下面的代码就是之前网络通信的代码
 
@@ -83,22 +567,86 @@ int main( int argc, char* argv[] ) {
     // 绑定端口
     ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
 
+    // TCP_DEFER_ACCEPT：三次握手完成后，内核等到客户端发来第一段数据（请求）才让accept返回这个连接，
+    // 超过defer_accept秒还没有数据时也会返回。这样接受连接时请求一般已经到了，可以马上读取
+    if( defer_accept > 0 &&
+        setsockopt( listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof( defer_accept ) ) != 0 ) {
+        printf( "TCP_DEFER_ACCEPT failed: %s\n", strerror( errno ) );
+    }
+    // TCP Fast Open：之前连接过的客户端可以在SYN中带上请求，省去一个往返，accept返回时请求已经在socket中了
+    // 还需要系统开启服务器端的TFO（sysctl net.ipv4.tcp_fastopen的第2位，比如设为3）
+    if( fastopen_qlen > 0 ) {
+        if( setsockopt( listenfd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_qlen, sizeof( fastopen_qlen ) ) != 0 ) {
+            printf( "TCP_FASTOPEN failed: %s\n", strerror( errno ) );
+        }
+        FILE* fp = fopen( "/proc/sys/net/ipv4/tcp_fastopen", "r" );
+        int mode = 0;
+        if( fp ) {
+            if( fscanf( fp, "%d", &mode ) != 1 ) {
+                mode = 0;
+            }
+            fclose( fp );
+            if( !( mode & 2 ) ) {
+                printf( "warning: net.ipv4.tcp_fastopen is %d, server side fast open is disabled by the system\n", mode );
+            }
+        }
+    }
+    // 开启了上面任意一个时，接受连接后马上读取请求，不等下一轮epoll_wait
+    // （TLS连接的握手放在工作线程中，仍然等可读事件）
+    bool read_on_accept = ( defer_accept > 0 || fastopen_qlen > 0 ) && !http_conn::m_tls;
+
     // 设置监听
     // 第二个参数表示的是半连接队列和全连接队列的二者加起来的元素的最大值，
     // 一般不用太大，指定5就行，因为全连接队列不会存太多的，会立即被accept的
     ret = listen( listenfd, 5 );  
 
+    // 本机的客户端（sidecar、健康检查）可以通过Unix域套接字连接，不经过TCP/IP协议栈，
+    // 连接建立之后和TCP连接一样由http_conn处理
+    std::vector< int > unix_listenfds;
+    for( size_t i = 0; i < unix_paths.size(); ++i ) {
+        int fd = listen_unix( unix_paths[i] );
+        if( fd < 0 ) {
+            return 1;
+        }
+        unix_listenfds.push_back( fd );
+    }
+
     // 创建epoll对象，和事件数组（即epoll_event数组）
     // 只应该创建一个epoll对象，多个epoll_event
     // 每个epoll_event对应一个
     int epollfd = epoll_create( 100 );       // epoll对象
-    epoll_event events[ MAX_EVENT_NUMBER ];  // epoll_event数组
+    std::vector< epoll_event > events( max_events );  // epoll_event数组
+    // 每一轮epoll_wait中读到数据、等待交给线程池的连接，及其来源CPU和优先级类别
+    std::vector< http_conn* > ready_conns( max_events );
+    std::vector< int > ready_cpus( max_events );
+    std::vector< int > ready_classes( max_events );
     // 将监听的文件描述符添加到epoll对象中
     // 监听的文件描述符不需要设置oneshot，所以第三个参数为false
     addfd( epollfd, listenfd, false );      // addfd是自己定义的向epoll对象中添加文件描述符的函数
+    for( size_t i = 0; i < unix_listenfds.size(); ++i ) {
+        addfd( epollfd, unix_listenfds[i], false );
+    }
     // 所有socket上的事件都被注册到同一个epoll内核事件中，m_epollfd是静态成员
     // （所有http_conn类的实例共享该静态成员）
     http_conn::m_epollfd = epollfd;
+    // 工作线程发送完响应之后需要关闭的连接，通过eventfd交还给主线程关闭
+    if( !http_conn::init_done_queue( epollfd ) ) {
+        printf( "eventfd failure\n" );
+        return 1;
+    }
+    // 定期保存热点文件清单的定时器，和其他事件一样由epoll通知主线程
+    int manifest_timer = -1;
+    if( manifest ) {
+        manifest_timer = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+        struct itimerspec its;
+        memset( &its, 0, sizeof( its ) );
+        its.it_value.tv_sec = its.it_interval.tv_sec = config.get( server_config::MANIFEST_INTERVAL );
+        if( manifest_timer < 0 || timerfd_settime( manifest_timer, 0, &its, NULL ) != 0 ) {
+            printf( "timerfd failure\n" );
+            return 1;
+        }
+        addfd( epollfd, manifest_timer, false );
+    }
 
 
     // ----------------- 上面通信的准备工作完成
@@ -106,13 +654,35 @@ int main( int argc, char* argv[] ) {
     while(true) {
         
         // events是epoll_wait函数的传出参数，其中存了number个就绪事件
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
+        int number = epoll_wait( epollfd, &events[0], max_events, -1 );
         
         if ( ( number < 0 ) && ( errno != EINTR ) ) {
             // 调用epoll失败
             printf( "epoll failure\n" );
             break;
         }
+        if( dump_trace ) {
+            dump_trace = 0;
+            int n = tracer::dump();
+            if( n < 0 ) {
+                printf( "write trace failed\n" );
+            } else {
+                printf( "wrote %d traced requests\n", n );
+            }
+        }
+        if( dump_locks ) {
+            dump_locks = 0;
+            printf( "worker threads: %d (grew %d times, shrank %d times)\n",
+                    pool->thread_count(), pool->grow_count(), pool->shrink_count() );
+            print_huge_pages();
+            if( lock_stats::enabled() ) {
+                lock_stats::dump( stdout );
+            }
+            fflush( stdout );
+        }
+
+        // 本轮读到数据、需要交给线程池处理的连接，遍历完所有事件后一次性加入请求队列
+        int ready = 0;
 
         // 循环遍历事件数组
         for ( int i = 0; i < number; i++ ) {
@@ -130,19 +700,75 @@ int main( int argc, char* argv[] ) {
                     printf( "errno is: %d\n", errno );
                     continue;
                 } 
-                // 如果连接数满了
-                if( http_conn::m_user_count >= MAX_FD ) {
+                // 如果连接数满了（文件描述符超出users数组时也一样，比如打开的文件、上游连接占用了一些描述符）
+                if( http_conn::m_user_count.value >= max_fd || connfd >= max_fd ) {
                     close(connfd);
                     continue;
                 }
 
+                // 这个客户端IP的连接数到了上限，直接关闭，不让一个客户端占满所有连接
+                client_slot* slot = NULL;
+                if( !http_conn::m_limiter.admit( client_address.sin_addr.s_addr, slot ) ) {
+                    close( connfd );
+                    continue;
+                }
+
                 // 将新连接进来的客户的数据（就是任务）初始化，然后放到users数组中
                 // 为了方便起见，直接让文件描述符的值作为下标
                 // 不可能有两个相同的文件描述符，所以不会冲突
-                users[connfd].init( connfd, client_address);
+                users[connfd].init( connfd, client_address, slot, !read_on_accept );
+                WS_PROBE3( accept, connfd, client_address.sin_addr.s_addr, http_conn::m_user_count.value );
+
+                if( read_on_accept ) {
+                    // 请求多半已经到了（TCP_DEFER_ACCEPT、TFO），直接读取并处理，省去一次epoll_ctl和一轮epoll_wait
+                    if( !users[connfd].read() ) {
+                        users[connfd].close_conn();
+                    } else if( users[connfd].has_data() ) {
+                        on_request_data( users + connfd, fast_path, &ready_conns[0], &ready_cpus[0], &ready_classes[0], ready );
+                    } else {
+                        users[connfd].watch();  // 还没有数据（比如等待超时了），和平常一样等可读事件
+                    }
+                }
+
+            } else if( is_unix_listener( unix_listenfds, sockfd ) ) {
+                // Unix域套接字上的新连接
+                int connfd = accept( sockfd, NULL, NULL );
+                if ( connfd < 0 ) {
+                    printf( "errno is: %d\n", errno );
+                    continue;
+                }
+                if( http_conn::m_user_count.value >= max_fd || connfd >= max_fd ) {
+                    close( connfd );
+                    continue;
+                }
+                // 本机的客户端没有IP地址，按127.0.0.1对待（转发给上游时的X-Forwarded-For），也不按IP限流
+                struct sockaddr_in local_address;
+                memset( &local_address, 0, sizeof( local_address ) );
+                local_address.sin_family = AF_INET;
+                local_address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+                users[connfd].init( connfd, local_address );
+                WS_PROBE3( accept, connfd, local_address.sin_addr.s_addr, http_conn::m_user_count.value );
 
             // --------------- 下面的都是非监听套接字的事件发生的处理
 
+            } else if( sockfd == http_conn::m_done_fd ) {
+                // 工作线程交还了需要关闭的连接
+                http_conn::drain_done_queue();
+
+            } else if( sockfd == manifest_timer ) {
+                // 保存热点文件清单（最多一千多行，主线程中写也很快）
+                uint64_t expirations;
+                if( read( manifest_timer, &expirations, sizeof( expirations ) ) > 0 &&
+                    warm_start::save( manifest, http_conn::m_file_cache ) < 0 ) {
+                    printf( "save manifest %s failed: %s\n", manifest, strerror( errno ) );
+                }
+
+            } else if( http_conn::proxy_event( users, sockfd, events[i].events ) ) {
+                // 反向代理的上游连接，或者正在转发的客户端连接，已经在主线程中处理了
+
+            } else if( !users[sockfd].claim_event() ) {
+                // WebSocket连接正在被工作线程处理（广播时重新注册事件多触发了一次），忽略，工作线程处理完会重新注册
+
             } else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
                 // 如果检测到对方异常断开或者错误等事件
 
@@ -152,7 +778,7 @@ int main( int argc, char* argv[] ) {
                 // 如果该fd是读事件发生
 
                 if(users[sockfd].read()) {  // read函数一次性把数据读完
-                    pool->append(users + sockfd);  // append的形参需要的是指针类型
+                    on_request_data( users + sockfd, fast_path, &ready_conns[0], &ready_cpus[0], &ready_classes[0], ready );
                 } else {
                     // 如果读取失败，相当于出现异常的情况，关闭连接
                     users[sockfd].close_conn();
@@ -181,11 +807,41 @@ int main( int argc, char* argv[] ) {
 
             }
         }
+
+        // 把本轮收集到的任务一次性交给线程池
+        if( ready > 0 ) {
+            for( int j = 0; j < ready; ++j ) {
+                ready_conns[j]->trace_mark( TRACE_ENQUEUE );
+            }
+            int added = pool->append_batch( &ready_conns[0], &ready_cpus[0], &ready_classes[0], ready );
+            // 请求队列已满，剩下的连接无法处理，只能关闭
+            for( int j = added; j < ready; ++j ) {
+                ready_conns[j]->close_conn();
+            }
+        }
     }
     
     close( epollfd );
     close( listenfd );
-    delete [] users;
+    if( manifest ) {
+        warm_start::save( manifest, http_conn::m_file_cache );
+        close( manifest_timer );
+    }
+    for( size_t i = 0; i < unix_listenfds.size(); ++i ) {
+        close( unix_listenfds[i] );
+        unlink( unix_paths[i] );
+    }
+    for( int i = 0; i < max_fd; ++i ) {
+        users[i].~http_conn();
+    }
+    free_on_node( users_mem, users_size );
+    free_on_node( buffers_mem, buffers_size );
     delete pool;
+    delete http_conn::m_io_pool;
+    delete http_conn::m_bundle;
+    delete http_conn::m_tls;
+    for( size_t i = 0; i < http_conn::m_proxy_routes.size(); ++i ) {
+        delete http_conn::m_proxy_routes[i].up;
+    }
     return 0;
 }
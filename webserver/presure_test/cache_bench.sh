@@ -0,0 +1,40 @@
+#!/bin/bash
+# 用webbench压测服务器，同时用perf stat统计服务器进程的缓存和TLB未命中，
+# 用于比较http_conn内存布局修改前后、开启大页（-H）前后的效果
+#
+# 用法：[SERVER_ARGS="服务器选项"] ./cache_bench.sh 服务器程序 [端口] [秒数] [客户端数]
+# 例如比较两个版本：
+#   git stash; g++ *.cpp -o server_old -pthread -lssl -lcrypto; git stash pop
+#   g++ *.cpp -o server -pthread -lssl -lcrypto
+#   presure_test/cache_bench.sh ./server_old
+#   presure_test/cache_bench.sh ./server
+# 比较大页：
+#   presure_test/cache_bench.sh ./server
+#   SERVER_ARGS="-H" presure_test/cache_bench.sh ./server
+# 服务器在webserver目录下运行，资源目录用-d指定为这里的resources；需要安装perf（linux-tools）
+
+SERVER=${1:?usage: $0 server [port] [seconds] [clients]}
+PORT=${2:-10000}
+SECONDS_RUN=${3:-10}
+CLIENTS=${4:-1000}
+DIR=$(cd "$(dirname "$0")" && pwd)
+WEBBENCH=$DIR/webbench-1.5/webbench
+
+if [ ! -x "$WEBBENCH" ]; then
+    make -C "$DIR/webbench-1.5" > /dev/null || exit 1
+fi
+
+"$SERVER" $SERVER_ARGS -d "$DIR/../resources" "$PORT" > /dev/null &
+PID=$!
+sleep 1
+
+# 压测开始之后再附加perf，不统计启动的过程
+"$WEBBENCH" -c "$CLIENTS" -t "$SECONDS_RUN" "http://127.0.0.1:$PORT/index.html" > /tmp/cache_bench_webbench.txt &
+BENCH=$!
+sleep 1
+perf stat -e cache-references,cache-misses,L1-dcache-loads,L1-dcache-load-misses,LLC-load-misses,dTLB-loads,dTLB-load-misses,instructions \
+    -p "$PID" -- sleep $(( SECONDS_RUN - 2 ))
+wait $BENCH
+
+grep -E "Speed|Requests" /tmp/cache_bench_webbench.txt
+kill "$PID"
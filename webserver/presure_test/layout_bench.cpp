@@ -0,0 +1,164 @@
+/*
+ * 比较http_conn的内存布局：处理一个事件、一个请求要访问多少个缓存行，以及在users数组上访问这些成员的耗时
+ * 直接包含服务器的http_conn.h，用的是成员的真实偏移量，所以对着两个版本的头文件分别编译就可以比较
+ *
+ * 编译（在webserver目录下）：g++ -O2 -I. presure_test/layout_bench.cpp -o layout_bench -pthread
+ * 和旧版本比较：
+ *   mkdir /tmp/old && git archive <旧版本> webserver | tar -x -C /tmp/old
+ *   g++ -O2 -I/tmp/old/webserver presure_test/layout_bench.cpp -o layout_bench_old -pthread
+ * 用法：./layout_bench [-n 连接数] [-r 轮数] [-t 线程数]
+ *   单线程：按随机顺序访问users数组中的连接（像主线程依次处理各个连接上的事件），读写每个连接的热数据成员，
+ *          数组远大于缓存，耗时主要取决于每个连接要调入多少个缓存行
+ *   多线程（-t 2以上）：线程i依次写下标模t等于i的连接，相邻的连接由不同的线程写，
+ *          两个连接共用一个缓存行时就会伪共享；需要有多个CPU才能体现出来
+ */
+#include <time.h>
+#include <getopt.h>
+#include <algorithm>
+#include <random>
+#include <thread>
+// http_conn.h包含的其他头文件先包含进来，下面把private改成public只影响http_conn本身
+#include "locker.h"
+#include "threadpool.h"
+#include "file_cache.h"
+#include "asset_bundle.h"
+#include "handler.h"
+#include "h2_session.h"
+#include "tls.h"
+#include "websocket.h"
+#include "proxy.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "probes.h"
+#define private public
+#include "http_conn.h"
+#undef private
+
+struct field {
+    size_t offset;
+};
+
+#define FIELD( m ) { offsetof( http_conn, m ) }
+
+// 主线程处理每个事件都要访问的成员：分派事件、读数据、判断能否直接处理、交给线程池
+static const field event_fields[] = {
+    FIELD( m_sockfd ), FIELD( m_incoming_cpu ), FIELD( m_read_buf ), FIELD( m_read_idx ), FIELD( m_check_state ),
+    FIELD( m_ssl ), FIELD( m_h2 ), FIELD( m_ws ), FIELD( m_proxy ), FIELD( m_traced ),
+};
+
+// 处理一个读文件的GET请求还要访问的成员：解析请求、查找文件、生成和发送响应
+static const field request_fields[] = {
+    FIELD( m_checked_idx ), FIELD( m_start_line ), FIELD( m_method ), FIELD( m_url ), FIELD( m_version ),
+    FIELD( m_linger ), FIELD( m_content_length ), FIELD( m_handler ), FIELD( m_upstream ), FIELD( m_write_buf ),
+    FIELD( m_write_idx ), FIELD( m_iv_count ), FIELD( m_iv ), FIELD( m_bytes_to_send ), FIELD( m_bytes_have_send ),
+    FIELD( m_file_address ), FIELD( m_from_bundle ), FIELD( m_status ), FIELD( m_file_stat ), FIELD( m_real_file ),
+};
+
+static const size_t EVENT_FIELDS = sizeof( event_fields ) / sizeof( event_fields[0] );
+static const size_t REQUEST_FIELDS = sizeof( request_fields ) / sizeof( request_fields[0] );
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 第i个连接访问fields中的成员要用到的缓存行数（对象没有按缓存行对齐时，每个连接的情况不一样）
+static size_t lines_touched( size_t i, const field* fields, size_t n, const field* more, size_t m ) {
+    std::vector< size_t > lines;
+    size_t base = i * sizeof( http_conn );
+    for( size_t k = 0; k < n; ++k ) {
+        lines.push_back( ( base + fields[k].offset ) / 64 );
+    }
+    for( size_t k = 0; k < m; ++k ) {
+        lines.push_back( ( base + more[k].offset ) / 64 );
+    }
+    std::sort( lines.begin(), lines.end() );
+    return std::unique( lines.begin(), lines.end() ) - lines.begin();
+}
+
+// 读写一个连接的热数据成员（每个成员的第一个字节）
+static inline void touch( char* conn, const field* fields, size_t n ) {
+    for( size_t k = 0; k < n; ++k ) {
+        ++*( volatile char* )( conn + fields[k].offset );
+    }
+}
+
+int main( int argc, char* argv[] ) {
+    size_t conns = 65536;
+    int rounds = 20;
+    int threads = 1;
+    int opt;
+    while( ( opt = getopt( argc, argv, "n:r:t:" ) ) != -1 ) {
+        switch( opt ) {
+            case 'n': conns = strtoul( optarg, NULL, 10 ); break;
+            case 'r': rounds = atoi( optarg ); break;
+            case 't': threads = atoi( optarg ); break;
+            default:
+                fprintf( stderr, "usage: %s [-n conns] [-r rounds] [-t threads]\n", argv[0] );
+                return 1;
+        }
+    }
+
+    // 和服务器一样，users数组从页的开头开始
+    size_t bytes = ( conns * sizeof( http_conn ) + 4095 ) & ~( size_t )4095;
+    char* users = ( char* )aligned_alloc( 4096, bytes );
+    memset( users, 0, bytes );
+
+    double event_lines = 0, request_lines = 0;
+    for( size_t i = 0; i < conns; ++i ) {
+        event_lines += lines_touched( i, event_fields, EVENT_FIELDS, NULL, 0 );
+        request_lines += lines_touched( i, event_fields, EVENT_FIELDS, request_fields, REQUEST_FIELDS );
+    }
+    printf( "sizeof(http_conn) = %zu (%sa multiple of 64)\n", sizeof( http_conn ),
+            sizeof( http_conn ) % 64 ? "not " : "" );
+    printf( "cache lines per event: %.2f, per request: %.2f\n", event_lines / conns, request_lines / conns );
+
+    // 单线程：随机顺序访问
+    std::vector< unsigned > order( conns );
+    for( size_t i = 0; i < conns; ++i ) {
+        order[i] = i;
+    }
+    std::shuffle( order.begin(), order.end(), std::mt19937( 1 ) );
+    double start = now_sec();
+    for( int r = 0; r < rounds; ++r ) {
+        for( size_t i = 0; i < conns; ++i ) {
+            touch( users + order[i] * sizeof( http_conn ), event_fields, EVENT_FIELDS );
+        }
+    }
+    double elapsed = now_sec() - start;
+    printf( "event fields, random order: %.1f ns per connection\n", elapsed * 1e9 / ( conns * rounds ) );
+    start = now_sec();
+    for( int r = 0; r < rounds; ++r ) {
+        for( size_t i = 0; i < conns; ++i ) {
+            char* conn = users + order[i] * sizeof( http_conn );
+            touch( conn, event_fields, EVENT_FIELDS );
+            touch( conn, request_fields, REQUEST_FIELDS );
+        }
+    }
+    elapsed = now_sec() - start;
+    printf( "request fields, random order: %.1f ns per connection\n", elapsed * 1e9 / ( conns * rounds ) );
+
+    // 多线程：相邻的连接由不同的线程写
+    if( threads > 1 ) {
+        std::vector< std::thread > workers;
+        start = now_sec();
+        for( int t = 0; t < threads; ++t ) {
+            workers.push_back( std::thread( [=]() {
+                for( int r = 0; r < rounds * 10; ++r ) {
+                    for( size_t i = t; i < conns; i += threads ) {
+                        touch( users + i * sizeof( http_conn ), event_fields, EVENT_FIELDS );
+                    }
+                }
+            } ) );
+        }
+        for( size_t t = 0; t < workers.size(); ++t ) {
+            workers[t].join();
+        }
+        elapsed = now_sec() - start;
+        printf( "%d threads on adjacent connections: %.1f ns per connection\n", threads,
+                elapsed * 1e9 / ( conns * rounds * 10 ) );
+    }
+    free( users );
+    return 0;
+}
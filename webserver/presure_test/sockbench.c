@@ -0,0 +1,178 @@
+/*
+ * 比较回环TCP和Unix域套接字的吞吐量
+ * 每个线程保持一个长连接，不停地发送同一个GET请求并读完响应，统计每秒完成的请求数
+ *
+ * 编译：gcc -O2 sockbench.c -o sockbench -pthread
+ * 用法：./sockbench [-c 连接数] [-t 秒数] (-p 端口 | -u socket路径) [url]
+ * 例如（服务器以 ./server -U /tmp/webserver.sock 10000 启动）：
+ *   ./sockbench -c 32 -t 10 -p 10000 /index.html
+ *   ./sockbench -c 32 -t 10 -u /tmp/webserver.sock /index.html
+ */
+#define _GNU_SOURCE     /* strcasestr */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static int port = 0;
+static const char *unix_path = NULL;
+static char request[512];
+static volatile int stop = 0;
+
+struct result {
+    long requests;
+    long bytes;
+    long errors;
+};
+
+static int connect_server(void)
+{
+    int fd;
+    if (unix_path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+    } else {
+        struct sockaddr_in addr;
+        int one = 1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            return fd;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+/* 读完一个响应（响应头 + Content-Length字节的响应体），返回读到的字节数，出错返回-1 */
+static long read_response(int fd, char *buf, int size)
+{
+    int len = 0;
+    char *end = NULL;
+    long body, total;
+    while (!end) {
+        int n;
+        if (len == size)
+            return -1;
+        n = read(fd, buf + len, size - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+        buf[len < size ? len : size - 1] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    {
+        char *cl = strcasestr(buf, "\r\nContent-Length:");
+        if (!cl || end < cl)
+            return -1;
+        body = atol(cl + 17);
+    }
+    total = (end + 4 - buf) + body;
+    while (len < total) {
+        int n = read(fd, buf, size < total - len ? size : total - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+    }
+    return total;
+}
+
+static void *worker(void *arg)
+{
+    struct result *r = arg;
+    char buf[65536];
+    int fd = connect_server();
+    int reqlen = strlen(request);
+    while (!stop) {
+        long n;
+        if (fd < 0) {
+            r->errors++;
+            fd = connect_server();
+            continue;
+        }
+        if (write(fd, request, reqlen) != reqlen || (n = read_response(fd, buf, sizeof(buf))) < 0) {
+            r->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        r->requests++;
+        r->bytes += n;
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: sockbench [-c clients] [-t seconds] (-p port | -u unix_socket_path) [url]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    int clients = 16, seconds = 10, opt, i;
+    const char *url = "/index.html";
+    pthread_t *threads;
+    struct result *results;
+    struct result sum = {0, 0, 0};
+    struct timespec start, end;
+    double elapsed;
+
+    while ((opt = getopt(argc, argv, "c:t:p:u:")) != -1) {
+        switch (opt) {
+        case 'c': clients = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        case 'u': unix_path = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind < argc)
+        url = argv[optind];
+    if (clients <= 0 || seconds <= 0 || (!port && !unix_path))
+        usage();
+    snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n", url);
+
+    threads = calloc(clients, sizeof(pthread_t));
+    results = calloc(clients, sizeof(struct result));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < clients; i++)
+        pthread_create(&threads[i], NULL, worker, &results[i]);
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        sum.requests += results[i].requests;
+        sum.bytes += results[i].bytes;
+        sum.errors += results[i].errors;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%s %s, %d clients, %.1f s\n", unix_path ? "unix" : "tcp", unix_path ? unix_path : "127.0.0.1", clients, elapsed);
+    printf("requests: %ld (%.0f req/s), %.2f MB/s, errors: %ld\n", sum.requests, sum.requests / elapsed,
+           sum.bytes / elapsed / 1048576, sum.errors);
+    free(threads);
+    free(results);
+    return 0;
+}
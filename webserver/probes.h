@@ -0,0 +1,73 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// 静态跟踪点（USDT）
+// 在热路径的几个边界上放一条nop指令，并在ELF的.note.stapsdt段中记下它的地址、名字和参数所在的位置（寄存器或者内存），
+// 格式和systemtap的<sys/sdt.h>相同，所以不用重新编译、不用加日志，就可以用bpftrace或者perf观察正在运行的服务器：
+//   bpftrace -l 'usdt:./server:*'                  列出所有跟踪点
+//   bpftrace bpftrace/latency.bt                   请求延迟的直方图（脚本在bpftrace目录下）
+//   perf buildid-cache --add ./server && perf record -e 'sdt_webserver:*' -p 进程号
+// 没有附加跟踪程序时跟踪点只是一条nop，参数也只是已经在寄存器中的值，几乎没有开销。
+// 只支持x86-64和aarch64，其他平台（或者编译时定义了NO_PROBES）跟踪点为空。
+//
+// 跟踪点（提供者都是webserver，参数都是64位有符号整数）：
+//   accept(fd, ip, user_count)                 主线程接受了一个连接，ip为网络字节序的IPv4地址
+//   read(fd, bytes, buffered)                  主线程读完一次数据，bytes为这次读到的字节数，buffered为读缓冲区中的字节数
+//   enqueue(request, class, depth)             任务加入请求队列，depth为加入后队列中的任务数
+//   dequeue(request, class, wait_us, depth)    工作线程取出任务，wait_us为在队列中等待的时间
+//   request(fd, method, url)                   do_request开始处理一个完整的请求，url是字符串指针（bpftrace中用str(arg2)读取）
+//   response(fd, status, bytes, keep_alive)    响应的最后一个字节发出去了
+//   close(fd)                                  连接关闭
+
+#include <stdint.h>
+
+#if !defined( NO_PROBES ) && ( defined( __x86_64__ ) || defined( __aarch64__ ) )
+
+// 跟踪点的nop和它的说明（note）。参数的位置由编译器填进"-8@%0"这样的格式中，-8表示8字节的有符号整数
+// _.stapsdt.base用于跟踪工具计算预链接（prelink）之后的地址偏移，整个程序只需要一个
+#define WS_PROBE_( name, args, ... )                                                \
+    __asm__ __volatile__( "990: nop\n"                                              \
+                          ".pushsection .note.stapsdt,\"?\",\"note\"\n"             \
+                          ".balign 4\n"                                             \
+                          ".4byte 992f-991f, 994f-993f, 3\n"                        \
+                          "991: .asciz \"stapsdt\"\n"                               \
+                          "992: .balign 4\n"                                        \
+                          "993: .8byte 990b\n"                                      \
+                          ".8byte _.stapsdt.base\n"                                 \
+                          ".8byte 0\n"                                              \
+                          ".asciz \"webserver\"\n"                                  \
+                          ".asciz \"" #name "\"\n"                                  \
+                          ".asciz \"" args "\"\n"                                   \
+                          "994: .balign 4\n"                                        \
+                          ".popsection\n"                                           \
+                          ".ifndef _.stapsdt.base\n"                                \
+                          ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+                          ".weak _.stapsdt.base\n"                                  \
+                          ".hidden _.stapsdt.base\n"                                \
+                          "_.stapsdt.base: .space 1\n"                              \
+                          ".size _.stapsdt.base, 1\n"                               \
+                          ".popsection\n"                                           \
+                          ".endif\n"                                                \
+                          :: __VA_ARGS__ )
+
+#define WS_PROBE_ARG_( a ) "nor"( ( int64_t )( a ) )
+
+#define WS_PROBE1( name, a1 ) \
+    WS_PROBE_( name, "-8@%0", WS_PROBE_ARG_( a1 ) )
+#define WS_PROBE2( name, a1, a2 ) \
+    WS_PROBE_( name, "-8@%0 -8@%1", WS_PROBE_ARG_( a1 ), WS_PROBE_ARG_( a2 ) )
+#define WS_PROBE3( name, a1, a2, a3 ) \
+    WS_PROBE_( name, "-8@%0 -8@%1 -8@%2", WS_PROBE_ARG_( a1 ), WS_PROBE_ARG_( a2 ), WS_PROBE_ARG_( a3 ) )
+#define WS_PROBE4( name, a1, a2, a3, a4 ) \
+    WS_PROBE_( name, "-8@%0 -8@%1 -8@%2 -8@%3", WS_PROBE_ARG_( a1 ), WS_PROBE_ARG_( a2 ), WS_PROBE_ARG_( a3 ), WS_PROBE_ARG_( a4 ) )
+
+#else
+
+#define WS_PROBE1( name, a1 ) do {} while ( 0 )
+#define WS_PROBE2( name, a1, a2 ) do {} while ( 0 )
+#define WS_PROBE3( name, a1, a2, a3 ) do {} while ( 0 )
+#define WS_PROBE4( name, a1, a2, a3, a4 ) do {} while ( 0 )
+
+#endif
+
+#endif
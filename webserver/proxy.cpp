@@ -0,0 +1,766 @@
+#include "proxy.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <exception>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+// 定义在http_conn.cpp中
+extern void modfd( int epollfd, int fd, int ev );
+extern void removefd( int epollfd, int fd );
+
+// 按socket索引的上游连接表（只由主线程访问），主循环用它区分上游连接和客户端连接
+static std::vector< upstream_conn* > upstream_conns;
+
+// 上游连接失败时回复给客户端的响应
+static const char bad_gateway_response[] =
+    "HTTP/1.1 502 Bad Gateway\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 12\r\n"
+    "Connection: close\r\n\r\n"
+    "Bad Gateway\n";
+
+// 客户端请求头中有Expect: 100-continue时，先替上游回复，客户端收到之后才会发送请求体
+static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+// 上游响应头的一行是否是name字段，是的话value指向字段的值
+static bool header_is( const char* line, size_t len, const char* name, const char*& value ) {
+    size_t n = strlen( name );
+    if( len <= n || line[n] != ':' || strncasecmp( line, name, n ) != 0 ) {
+        return false;
+    }
+    value = line + n + 1;
+    while( *value == ' ' || *value == '\t' ) {
+        ++value;
+    }
+    return true;
+}
+
+// 在[p, end)中忽略大小写查找word
+static bool contains_word( const char* p, const char* end, const char* word ) {
+    size_t n = strlen( word );
+    for( ; p + n <= end; ++p ) {
+        if( strncasecmp( p, word, n ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+upstream::upstream( const char* addr ) : m_addr_len( 0 ), m_name( addr ) {
+    memset( &m_addr, 0, sizeof( m_addr ) );
+    if( strncmp( addr, "unix:", 5 ) == 0 ) {
+        sockaddr_un* un = ( sockaddr_un* )&m_addr;
+        const char* path = addr + 5;
+        if( path[0] == '\0' || strlen( path ) >= sizeof( un->sun_path ) ) {
+            throw std::exception();
+        }
+        un->sun_family = AF_UNIX;
+        strcpy( un->sun_path, path );
+        m_addr_len = sizeof( sockaddr_un );
+        return;
+    }
+
+    // host:port，IPv6地址写成[::1]:port
+    const char* colon = strrchr( addr, ':' );
+    if( !colon || colon[1] == '\0' ) {
+        throw std::exception();
+    }
+    std::string host( addr, colon - addr );
+    if( host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']' ) {
+        host = host.substr( 1, host.size() - 2 );
+    }
+    addrinfo hints;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res = NULL;
+    if( getaddrinfo( host.empty() ? "127.0.0.1" : host.c_str(), colon + 1, &hints, &res ) != 0 || !res ) {
+        throw std::exception();
+    }
+    memcpy( &m_addr, res->ai_addr, res->ai_addrlen );
+    m_addr_len = res->ai_addrlen;
+    freeaddrinfo( res );
+}
+
+upstream::~upstream() {
+    for( size_t i = 0; i < m_idle.size(); ++i ) {
+        upstream_conns[ m_idle[i]->fd ] = NULL;
+        close( m_idle[i]->fd );
+        delete m_idle[i];
+    }
+}
+
+upstream_conn* upstream::find( int fd ) {
+    return fd >= 0 && ( size_t )fd < upstream_conns.size() ? upstream_conns[fd] : NULL;
+}
+
+upstream_conn* upstream::acquire( int epollfd ) {
+    while( !m_idle.empty() ) {
+        upstream_conn* conn = m_idle.back();
+        m_idle.pop_back();
+        // 空闲期间上游可能已经关闭了连接，只是事件还没来得及处理，先看一眼
+        char c;
+        ssize_t n = recv( conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+        if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+            conn->reused = true;
+            return conn;
+        }
+        discard( conn, epollfd );
+    }
+    return connect_new( epollfd );
+}
+
+upstream_conn* upstream::connect_new( int epollfd ) {
+    int fd = socket( m_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 ) {
+        return NULL;
+    }
+    if( m_addr.ss_family != AF_UNIX ) {
+        // 请求头和请求体往往分几次写出，不要等前一个包的ACK
+        int on = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    }
+    int ret = connect( fd, ( sockaddr* )&m_addr, m_addr_len );
+    if( ret < 0 && errno != EINPROGRESS ) {
+        printf( "connect to upstream %s failed: %s\n", m_name.c_str(), strerror( errno ) );
+        close( fd );
+        return NULL;
+    }
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    if( epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event ) != 0 ) {
+        close( fd );
+        return NULL;
+    }
+
+    upstream_conn* conn = new upstream_conn;
+    conn->fd = fd;
+    conn->owner = this;
+    conn->client = NULL;
+    conn->reused = false;
+    conn->connecting = ret < 0;
+    if( ( size_t )fd >= upstream_conns.size() ) {
+        upstream_conns.resize( fd + 1, NULL );
+    }
+    upstream_conns[fd] = conn;
+    return conn;
+}
+
+int upstream::check_connect( upstream_conn* conn ) {
+    if( !conn->connecting ) {
+        return 1;
+    }
+    // 再调用一次connect：已经连上时返回EISCONN，还在连接时返回EALREADY，失败时返回具体的错误
+    if( connect( conn->fd, ( sockaddr* )&m_addr, m_addr_len ) == 0 || errno == EISCONN ) {
+        conn->connecting = false;
+        return 1;
+    }
+    if( errno == EALREADY || errno == EINPROGRESS ) {
+        return 0;
+    }
+    printf( "connect to upstream %s failed: %s\n", m_name.c_str(), strerror( errno ) );
+    return -1;
+}
+
+void upstream::release( upstream_conn* conn, int epollfd ) {
+    if( m_idle.size() >= MAX_IDLE ) {
+        discard( conn, epollfd );
+        return;
+    }
+    conn->client = NULL;
+    m_idle.push_back( conn );
+    // 空闲时只关心上游关闭连接
+    modfd( epollfd, conn->fd, EPOLLIN );
+}
+
+void upstream::discard( upstream_conn* conn, int epollfd ) {
+    for( size_t i = 0; i < m_idle.size(); ++i ) {
+        if( m_idle[i] == conn ) {
+            m_idle[i] = m_idle.back();
+            m_idle.pop_back();
+            break;
+        }
+    }
+    upstream_conns[ conn->fd ] = NULL;
+    removefd( epollfd, conn->fd );
+    delete conn;
+}
+
+void upstream::idle_event( upstream_conn* conn, int epollfd ) {
+    // 同一轮epoll_wait中，这个连接可能刚刚转发完放回池中，事件是之前注册的，这时连接其实没有问题
+    char c;
+    ssize_t n = recv( conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+    if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+        modfd( epollfd, conn->fd, EPOLLIN );
+        return;
+    }
+    discard( conn, epollfd );
+}
+
+
+void proxy_session::buffer::consume( size_t n ) {
+    start += n;
+    if( start == end ) {
+        start = end = 0;
+    }
+}
+
+void proxy_session::buffer::compact() {
+    if( start > 0 ) {
+        memmove( &data[0], &data[0] + start, end - start );
+        end -= start;
+        start = 0;
+    }
+}
+
+bool proxy_session::buffer::append( const char* p, size_t n ) {
+    if( space() < n ) {
+        compact();
+        if( space() < n ) {
+            return false;
+        }
+    }
+    memcpy( tail(), p, n );
+    end += n;
+    return true;
+}
+
+
+void proxy_session::body_scanner::reset( MODE mode, uint64_t length ) {
+    m_mode = mode;
+    m_left = length;
+    m_digits = 0;
+    switch( mode ) {
+        case NONE:
+            m_state = DONE;
+            break;
+        case LENGTH:
+            m_state = length == 0 ? DONE : BODY;
+            break;
+        case CHUNKED:
+            m_state = CHUNK_SIZE;
+            break;
+        default:
+            m_state = BODY;
+            break;
+    }
+}
+
+// 块大小所在的行结束了：大小为0的块后面是尾部字段，直到空行
+void proxy_session::body_scanner::end_size_line() {
+    if( m_digits == 0 ) {
+        m_state = FAILED;
+    } else {
+        m_state = m_left == 0 ? TRAILER_START : CHUNK_DATA;
+    }
+}
+
+size_t proxy_session::body_scanner::consume( const char* data, size_t len ) {
+    size_t i = 0;
+    while( i < len && m_state != DONE && m_state != FAILED ) {
+        if( m_state == BODY || m_state == CHUNK_DATA ) {
+            if( m_mode == UNTIL_CLOSE ) {
+                return len;
+            }
+            // 数据部分整段跳过，不逐个字节检查
+            size_t n = len - i < m_left ? len - i : m_left;
+            i += n;
+            m_left -= n;
+            if( m_left == 0 ) {
+                m_state = m_state == BODY ? DONE : CHUNK_DATA_END;
+            }
+            continue;
+        }
+        char c = data[i++];
+        switch( m_state ) {
+            case CHUNK_SIZE:
+                if( isxdigit( ( unsigned char )c ) ) {
+                    if( m_digits >= 15 ) {
+                        m_state = FAILED;
+                        break;
+                    }
+                    m_left = m_left * 16 + ( isdigit( ( unsigned char )c ) ? c - '0' : ( tolower( c ) - 'a' + 10 ) );
+                    ++m_digits;
+                } else if( c == '\n' ) {
+                    end_size_line();
+                } else if( m_digits > 0 && ( c == ';' || c == ' ' || c == '\t' || c == '\r' ) ) {
+                    m_state = CHUNK_EXT;    // 块扩展，忽略到行尾
+                } else {
+                    m_state = FAILED;
+                }
+                break;
+            case CHUNK_EXT:
+                if( c == '\n' ) {
+                    end_size_line();
+                }
+                break;
+            case CHUNK_DATA_END:
+                if( c == '\n' ) {
+                    m_state = CHUNK_SIZE;
+                    m_left = 0;
+                    m_digits = 0;
+                } else if( c != '\r' ) {
+                    m_state = FAILED;
+                }
+                break;
+            case TRAILER_START:
+                if( c == '\n' ) {
+                    m_state = DONE;
+                } else if( c != '\r' ) {
+                    m_state = TRAILER_LINE;
+                }
+                break;
+            case TRAILER_LINE:
+                if( c == '\n' ) {
+                    m_state = TRAILER_START;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return i;
+}
+
+
+proxy_session::proxy_session( http_conn* client, int sockfd, int epollfd, SSL* ssl, upstream* up, const proxy_request& req )
+    : m_client( client ), m_sockfd( sockfd ), m_epollfd( epollfd ), m_ssl( ssl ), m_upstream( up ), m_up( NULL ),
+      m_head_method( req.head_method ), m_req_done( false ), m_resp_started( false ), m_head_sent( false ),
+      m_resp_done( false ), m_up_reusable( true ), m_client_close( !req.keep_alive ), m_finished( false ) {
+    if( req.chunked ) {
+        m_req_body.reset( body_scanner::CHUNKED );
+    } else {
+        m_req_body.reset( req.content_length > 0 ? body_scanner::LENGTH : body_scanner::NONE, req.content_length );
+    }
+    // 请求头和读缓冲区中已经读到的请求体（start_proxy已经检查过两者加起来放得下）
+    if( !m_to_up.append( req.head.data(), req.head.size() ) || m_to_up.space() < req.body_len ) {
+        m_client_close = true;
+        m_finished = true;
+        return;
+    }
+    memcpy( m_to_up.tail(), req.body, req.body_len );
+    if( !take_request( req.body_len ) ) {
+        // 分块传输的格式不对，直接关闭连接
+        m_client_close = true;
+        m_finished = true;
+        return;
+    }
+    if( m_req_done ) {
+        // 请求已经完整了，留一份，复用的长连接恰好被上游关闭时可以换个连接重发
+        m_replay.assign( m_to_up.head(), m_to_up.size() );
+    } else if( req.expect_continue ) {
+        m_to_client.append( continue_response, sizeof( continue_response ) - 1 );
+    }
+}
+
+proxy_session::~proxy_session() {
+    if( m_up ) {
+        m_upstream->discard( m_up, m_epollfd );
+    }
+}
+
+bool proxy_session::connect_upstream( bool fresh ) {
+    m_up = fresh ? m_upstream->connect_new( m_epollfd ) : m_upstream->acquire( m_epollfd );
+    if( !m_up ) {
+        return false;
+    }
+    m_up->client = m_client;
+    return true;
+}
+
+void proxy_session::bad_gateway() {
+    printf( "upstream %s unavailable\n", m_upstream->name() );
+    m_to_client.append( bad_gateway_response, sizeof( bad_gateway_response ) - 1 );
+    m_req_done = true;
+    m_resp_done = true;
+    m_client_close = true;
+    m_head_sent = true;
+}
+
+bool proxy_session::upstream_failed() {
+    bool reused = m_up && m_up->reused;
+    if( m_up ) {
+        m_upstream->discard( m_up, m_epollfd );
+        m_up = NULL;
+    }
+    // 复用的长连接在收到响应之前就断了，通常是上游刚好关闭了这个空闲连接，换一个新连接重发
+    if( reused && !m_resp_started && !m_replay.empty() ) {
+        m_to_up.start = m_to_up.end = 0;
+        m_to_up.append( m_replay.data(), m_replay.size() );
+        if( connect_upstream( true ) ) {
+            return true;
+        }
+    }
+    // 响应已经开始发给客户端了，只能关闭连接
+    if( m_head_sent ) {
+        return false;
+    }
+    bad_gateway();
+    return true;
+}
+
+bool proxy_session::take_request( size_t n ) {
+    size_t used = m_req_body.consume( m_to_up.tail(), n );
+    if( m_req_body.failed() ) {
+        return false;
+    }
+    // 请求体后面还有数据（流水线请求），转发完这个请求之后关闭连接
+    if( used < n ) {
+        m_client_close = true;
+    }
+    m_to_up.end += used;
+    if( m_req_body.done() ) {
+        m_req_done = true;
+    }
+    return true;
+}
+
+ssize_t proxy_session::read_client( char* buf, size_t len ) {
+    if( m_ssl ) {
+        ERR_clear_error();
+        int n = SSL_read( m_ssl, buf, len );
+        if( n > 0 ) {
+            return n;
+        }
+        int err = SSL_get_error( m_ssl, n );
+        return ( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ) ? 0 : -1;
+    }
+    ssize_t n = recv( m_sockfd, buf, len, 0 );
+    if( n > 0 ) {
+        return n;
+    }
+    return ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) ? 0 : -1;
+}
+
+ssize_t proxy_session::write_client( const char* buf, size_t len ) {
+    ssize_t n;
+    if( m_ssl ) {
+        iovec iov;
+        iov.iov_base = ( void* )buf;
+        iov.iov_len = len;
+        n = tls_writev( m_ssl, &iov, 1 );
+    } else {
+        n = send( m_sockfd, buf, len, MSG_NOSIGNAL );
+    }
+    if( n >= 0 ) {
+        return n;
+    }
+    return ( errno == EAGAIN || errno == EWOULDBLOCK ) ? 0 : -1;
+}
+
+// 响应头还没收完时，发给客户端的缓冲区要能放下改写之后的整个响应头，留出一些余量
+bool proxy_session::can_read_upstream() const {
+    if( !m_up || m_up->connecting || m_resp_done ) {
+        return false;
+    }
+    if( !m_head_sent ) {
+        return m_to_client.room() > m_head.size() + 256;
+    }
+    return m_to_client.room() > 0;
+}
+
+int proxy_session::parse_response_head() {
+    while( true ) {
+        size_t end = m_head.find( "\r\n\r\n" );
+        if( end == std::string::npos ) {
+            return m_head.size() > MAX_RESPONSE_HEAD ? -1 : 0;
+        }
+        end += 4;
+        // 状态行：HTTP/1.1 200 OK
+        if( m_head.size() < 12 || m_head.compare( 0, 7, "HTTP/1." ) != 0 ) {
+            return -1;
+        }
+        int status = atoi( m_head.c_str() + 9 );
+        if( status < 100 || status > 999 || status == 101 ) {
+            return -1;
+        }
+        // 1xx的临时响应原样转发，接着解析后面的最终响应
+        if( status < 200 ) {
+            if( !m_to_client.append( m_head.data(), end ) ) {
+                return -1;
+            }
+            m_head.erase( 0, end );
+            continue;
+        }
+        if( m_head.compare( 0, 8, "HTTP/1.0" ) == 0 ) {
+            m_up_reusable = false;
+        }
+
+        // 逐个字段检查，去掉逐跳的Connection、Keep-Alive，按客户端连接的情况重新加上Connection
+        const char* p = m_head.data();
+        const char* line_end = strstr( p, "\r\n" );
+        std::string out( p, line_end + 2 - p );
+        bool chunked = false;
+        bool has_length = false;
+        long long length = 0;
+        p = line_end + 2;
+        while( p < m_head.data() + end - 2 ) {
+            line_end = strstr( p, "\r\n" );
+            size_t len = line_end - p;
+            const char* value;
+            if( header_is( p, len, "Connection", value ) ) {
+                if( contains_word( value, line_end, "close" ) ) {
+                    m_up_reusable = false;
+                }
+            } else if( header_is( p, len, "Keep-Alive", value ) || header_is( p, len, "Proxy-Connection", value ) ) {
+            } else {
+                if( header_is( p, len, "Transfer-Encoding", value ) ) {
+                    chunked = contains_word( value, line_end, "chunked" );
+                } else if( header_is( p, len, "Content-Length", value ) ) {
+                    has_length = true;
+                    length = strtoll( value, NULL, 10 );
+                    if( length < 0 ) {
+                        return -1;
+                    }
+                }
+                out.append( p, len + 2 );
+            }
+            p = line_end + 2;
+        }
+
+        if( m_head_method || status == 204 || status == 304 ) {
+            m_resp_body.reset( body_scanner::NONE );
+        } else if( chunked ) {
+            m_resp_body.reset( body_scanner::CHUNKED );
+        } else if( has_length ) {
+            m_resp_body.reset( body_scanner::LENGTH, length );
+        } else {
+            // 没有长度，只能读到上游关闭连接为止，客户端也只能通过关闭连接知道响应结束了
+            m_resp_body.reset( body_scanner::UNTIL_CLOSE );
+            m_up_reusable = false;
+            m_client_close = true;
+        }
+        out.append( m_client_close ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n" );
+        if( !m_to_client.append( out.data(), out.size() ) ) {
+            return -1;
+        }
+        m_head_sent = true;
+
+        // 和响应头一起读到的响应体
+        const char* body = m_head.data() + end;
+        size_t body_len = m_head.size() - end;
+        size_t used = m_resp_body.consume( body, body_len );
+        if( m_resp_body.failed() ) {
+            return -1;
+        }
+        if( used < body_len ) {
+            m_up_reusable = false;  // 响应之后还有多余的数据，这个连接不能再用了
+        }
+        if( !m_to_client.append( body, used ) ) {
+            return -1;
+        }
+        if( m_resp_body.done() ) {
+            m_resp_done = true;
+        }
+        m_head.clear();
+        return 1;
+    }
+}
+
+bool proxy_session::read_upstream( bool& progress ) {
+    if( !m_head_sent ) {
+        // 响应头先收到m_head中，解析、改写之后再放进发给客户端的缓冲区
+        char buf[ 4096 ];
+        size_t want = m_to_client.room() - m_head.size() - 256;
+        if( want > sizeof( buf ) ) {
+            want = sizeof( buf );
+        }
+        ssize_t n = recv( m_up->fd, buf, want, 0 );
+        if( n > 0 ) {
+            m_resp_started = true;
+            progress = true;
+            m_head.append( buf, n );
+            if( parse_response_head() < 0 ) {
+                printf( "bad response from upstream %s\n", m_upstream->name() );
+                return upstream_failed();
+            }
+            return true;
+        }
+        if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+            return true;
+        }
+        progress = true;
+        return upstream_failed();
+    }
+
+    if( m_to_client.space() == 0 ) {
+        m_to_client.compact();
+    }
+    ssize_t n = recv( m_up->fd, m_to_client.tail(), m_to_client.space(), 0 );
+    if( n > 0 ) {
+        progress = true;
+        size_t used = m_resp_body.consume( m_to_client.tail(), n );
+        if( m_resp_body.failed() ) {
+            printf( "bad response from upstream %s\n", m_upstream->name() );
+            return false;
+        }
+        if( ( size_t )n > used ) {
+            m_up_reusable = false;
+        }
+        m_to_client.end += used;
+        if( m_resp_body.done() ) {
+            m_resp_done = true;
+        }
+        return true;
+    }
+    if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+        return true;
+    }
+    progress = true;
+    // 上游关闭了连接：没有长度的响应到这里就结束了，否则响应不完整，只能关闭客户端连接
+    if( n == 0 && m_resp_body.until_close() ) {
+        m_resp_done = true;
+        m_up_reusable = false;
+        return true;
+    }
+    return false;
+}
+
+proxy_session::STATUS proxy_session::pump( uint32_t up_events ) {
+    if( m_finished ) {
+        return m_client_close ? PROXY_CLOSE : PROXY_KEEP_ALIVE;
+    }
+    // 第一次调用：取一个上游连接
+    if( !m_up && !m_resp_done && !connect_upstream( false ) ) {
+        bad_gateway();
+    }
+    // 上游连接出错了，但是缓冲区满了暂时不读上游（读的时候才会发现错误），
+    // 这时不处理的话，重新注册之后错误事件会一直触发
+    if( m_up && ( up_events & ( EPOLLERR | EPOLLHUP ) ) && !m_up->connecting && !can_read_upstream() ) {
+        if( !upstream_failed() ) {
+            return PROXY_CLOSE;
+        }
+    }
+
+    bool progress = true;
+    while( progress ) {
+        progress = false;
+
+        if( m_up && m_up->connecting ) {
+            int ret = m_upstream->check_connect( m_up );
+            if( ret < 0 ) {
+                if( !upstream_failed() ) {
+                    return PROXY_CLOSE;
+                }
+                progress = true;
+                continue;
+            }
+        }
+
+        // 客户端 -> 缓冲区
+        if( !m_req_done && m_to_up.room() > 0 ) {
+            if( m_to_up.space() == 0 ) {
+                m_to_up.compact();
+            }
+            ssize_t n = read_client( m_to_up.tail(), m_to_up.space() );
+            if( n < 0 ) {
+                return PROXY_CLOSE;
+            }
+            if( n > 0 ) {
+                if( !take_request( n ) ) {
+                    return PROXY_CLOSE;
+                }
+                progress = true;
+            }
+        }
+
+        // 缓冲区 -> 上游
+        if( m_up && !m_up->connecting && m_to_up.size() > 0 ) {
+            ssize_t n = send( m_up->fd, m_to_up.head(), m_to_up.size(), MSG_NOSIGNAL );
+            if( n > 0 ) {
+                m_to_up.consume( n );
+                progress = true;
+            } else if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                if( !upstream_failed() ) {
+                    return PROXY_CLOSE;
+                }
+                progress = true;
+                continue;
+            }
+        }
+
+        // 上游 -> 缓冲区
+        if( can_read_upstream() && !read_upstream( progress ) ) {
+            return PROXY_CLOSE;
+        }
+
+        // 缓冲区 -> 客户端
+        if( m_to_client.size() > 0 ) {
+            ssize_t n = write_client( m_to_client.head(), m_to_client.size() );
+            if( n < 0 ) {
+                return PROXY_CLOSE;
+            }
+            if( n > 0 ) {
+                m_to_client.consume( n );
+                progress = true;
+            }
+        }
+    }
+
+    // 响应已经从上游读完了，不用等客户端收完，上游连接马上就可以给别的请求用
+    if( m_resp_done && m_up ) {
+        release_upstream();
+    }
+    if( m_resp_done && m_to_client.size() == 0 ) {
+        // 上游没等请求体发完就回复了（比如请求体太大），连接上剩下的请求体没法解析，只能关闭
+        if( !m_req_done ) {
+            m_client_close = true;
+        }
+        m_finished = true;
+        return m_client_close ? PROXY_CLOSE : PROXY_KEEP_ALIVE;
+    }
+    arm();
+    return PROXY_CONTINUE;
+}
+
+// 响应读完了：请求也完整地发给了上游时，上游连接放回连接池，否则关闭
+void proxy_session::release_upstream() {
+    if( m_up_reusable && m_req_done && m_to_up.size() == 0 && !m_up->connecting ) {
+        m_upstream->release( m_up, m_epollfd );
+    } else {
+        m_upstream->discard( m_up, m_epollfd );
+    }
+    m_up = NULL;
+}
+
+// 按两个缓冲区的情况重新注册两个socket上的事件：缓冲区满了就不再读对应的一端
+void proxy_session::arm() {
+    int ev = 0;
+    if( !m_req_done && m_to_up.room() > 0 ) {
+        ev |= EPOLLIN;
+    }
+    if( m_to_client.size() > 0 ) {
+        ev |= EPOLLOUT;
+    }
+    modfd( m_epollfd, m_sockfd, ev );
+    if( m_up ) {
+        int up_ev = 0;
+        if( m_up->connecting || m_to_up.size() > 0 ) {
+            up_ev |= EPOLLOUT;
+        }
+        if( can_read_upstream() ) {
+            up_ev |= EPOLLIN;
+        }
+        // 上游连接不关心EPOLLRDHUP：上游发完响应就关闭连接时，要等缓冲区有空间了再读到连接关闭，
+        // 注册了EPOLLRDHUP的话，在这之前每次重新注册都会立刻再触发
+        epoll_event event;
+        event.data.fd = m_up->fd;
+        event.events = up_ev | EPOLLET | EPOLLONESHOT;
+        epoll_ctl( m_epollfd, EPOLL_CTL_MOD, m_up->fd, &event );
+    }
+}
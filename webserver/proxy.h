@@ -0,0 +1,192 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+// 反向代理
+// 应用后端和静态文件放在同一个服务器后面：url以某个前缀开头的请求（-x prefix=upstream）转发给本机的上游服务器，
+// 其余的请求还是由do_request()读文件处理。
+//
+// 以前每个请求都要和上游重新建立一次连接（TCP握手，上游还要accept一次），
+// 现在每个上游有一个空闲长连接池，响应转发完之后连接放回池中，下一个请求直接复用。
+//
+// 上游连接和客户端连接注册在同一个epoll中，由主线程统一处理：
+//   工作线程：解析请求头，改写成发给上游的请求头（proxy_request），创建proxy_session，注册EPOLLOUT把连接交给主线程
+//   主线程：  取一个上游连接，之后客户端和上游两个socket上的所有事件都由proxy_session::pump()处理，
+//            请求体和响应在两个定长的缓冲区中边收边转发，缓冲区满了就暂停读取对应的一端（背压），
+//            不会因为一端快一端慢而把整个请求或响应缓存在内存中
+// 转发过程中的状态只由主线程访问，不需要加锁。
+//
+// 上游只支持HTTP/1.1（明文TCP或者Unix域套接字），响应的结束由Content-Length、分块传输或者上游关闭连接判断，
+// 按连接关闭判断结束的响应转发完之后，上游连接和客户端连接都要关闭。
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include <openssl/ssl.h>
+
+class http_conn;
+class upstream;
+
+// 一个到上游的连接
+struct upstream_conn {
+    int fd;
+    upstream* owner;            // 所属的上游
+    http_conn* client;          // 正在为哪个客户端连接转发，为NULL表示在连接池中空闲
+    bool reused;                // 是否是从连接池中取出的长连接（而不是新建立的连接）
+    bool connecting;            // 非阻塞的connect还没有完成
+};
+
+// 上游服务器和它的空闲长连接池（只由主线程访问）
+class upstream {
+public:
+    static const size_t MAX_IDLE = 32;      // 每个上游最多保留多少个空闲的长连接
+
+public:
+    // addr为 host:port 或者 unix:/path，解析失败时抛出异常
+    explicit upstream( const char* addr );
+    ~upstream();
+
+    const char* name() const { return m_name.c_str(); }
+
+    // 取一个连接：优先复用空闲的长连接，没有时发起新的非阻塞连接；失败时返回NULL
+    upstream_conn* acquire( int epollfd );
+    // 发起一个新的非阻塞连接（不复用空闲连接），失败时返回NULL
+    upstream_conn* connect_new( int epollfd );
+    // 检查非阻塞的connect是否完成：返回1表示已连接，0表示还在连接，-1表示连接失败
+    int check_connect( upstream_conn* conn );
+    // 响应转发完了，连接还可以复用，放回连接池（池满时关闭）
+    void release( upstream_conn* conn, int epollfd );
+    // 关闭连接（出错、上游不保持连接，或者没有完整地转发完一个请求）
+    void discard( upstream_conn* conn, int epollfd );
+    // 空闲连接上有事件：通常是上游关闭了连接，关闭它
+    void idle_event( upstream_conn* conn, int epollfd );
+
+    // 按socket查找上游连接，不是上游连接时返回NULL
+    static upstream_conn* find( int fd );
+
+private:
+    sockaddr_storage m_addr;
+    socklen_t m_addr_len;
+    std::string m_name;
+    std::vector< upstream_conn* > m_idle;   // 空闲的长连接，后放回的先取出（更不容易已经被上游关闭）
+};
+
+// 一条反向代理路由：url以prefix开头的请求转发给up
+struct proxy_route {
+    std::string prefix;
+    upstream* up;
+};
+
+// 发给上游的请求，由工作线程根据解析好的请求生成
+struct proxy_request {
+    std::string head;           // 改写之后的请求行和请求头（包括最后的空行）
+    const char* body;           // 读缓冲区中已经读到的请求体的开头
+    size_t body_len;
+    long content_length;        // 请求体的长度（不是分块传输时）
+    bool chunked;               // 请求体是分块传输的
+    bool head_method;           // HEAD请求，响应没有响应体
+    bool keep_alive;            // 客户端要求保持连接
+    bool expect_continue;       // 客户端在等100 Continue之后才发送请求体
+};
+
+// 一次转发：一个客户端请求和它的响应
+class proxy_session {
+public:
+    static const size_t BUFFER_SIZE = 64 * 1024;        // 每个方向的转发缓冲区大小
+    static const size_t MAX_RESPONSE_HEAD = 16 * 1024;  // 上游响应头的最大长度
+
+    // pump()的结果
+    // PROXY_CONTINUE   :   还在转发，已经重新注册了两个socket上的事件
+    // PROXY_KEEP_ALIVE :   响应已经发完，客户端连接可以接着处理下一个请求
+    // PROXY_CLOSE      :   需要关闭客户端连接
+    enum STATUS { PROXY_CONTINUE, PROXY_KEEP_ALIVE, PROXY_CLOSE };
+
+public:
+    proxy_session( http_conn* client, int sockfd, int epollfd, SSL* ssl, upstream* up, const proxy_request& req );
+    ~proxy_session();   // 还没转发完时关闭上游连接
+
+    // 主线程调用（客户端或者上游的socket上有事件，up_events是上游socket上的事件）：
+    // 尽量在两端之间转发数据，直到两端都需要等待
+    STATUS pump( uint32_t up_events = 0 );
+
+private:
+    // 定长缓冲区：从尾部写入，从头部取出
+    struct buffer {
+        std::vector< char > data;
+        size_t start;
+        size_t end;
+
+        buffer() : data( BUFFER_SIZE ), start( 0 ), end( 0 ) {}
+        char* head() { return &data[0] + start; }
+        char* tail() { return &data[0] + end; }
+        size_t size() const { return end - start; }
+        size_t space() const { return BUFFER_SIZE - end; }
+        size_t room() const { return BUFFER_SIZE - size(); }   // 把数据移到开头之后的可用空间
+        void consume( size_t n );
+        void compact();
+        bool append( const char* p, size_t n );    // 放不下时什么也不拷贝，返回false
+    };
+
+    // 不解码、只找出HTTP消息体的结束位置（Content-Length、分块传输或者直到连接关闭），数据原样转发
+    class body_scanner {
+    public:
+        enum MODE { NONE, LENGTH, CHUNKED, UNTIL_CLOSE };
+        void reset( MODE mode, uint64_t length = 0 );
+        // 扫描一段数据，返回属于消息体的字节数（小于len表示消息体在中间结束了）
+        size_t consume( const char* data, size_t len );
+        bool done() const { return m_state == DONE; }
+        bool failed() const { return m_state == FAILED; }
+        bool until_close() const { return m_mode == UNTIL_CLOSE; }
+    private:
+        enum STATE { BODY, CHUNK_SIZE, CHUNK_EXT, CHUNK_DATA, CHUNK_DATA_END, TRAILER_START, TRAILER_LINE, DONE, FAILED };
+        void end_size_line();
+        MODE m_mode;
+        STATE m_state;
+        uint64_t m_left;        // 消息体或者当前块还剩下的字节数
+        int m_digits;           // 块大小的十六进制位数
+    };
+
+    bool connect_upstream( bool fresh );
+    // 上游连接出错：能重发时换一个新连接重发，响应还没开始发给客户端时回复502，返回false表示只能关闭客户端连接
+    bool upstream_failed();
+    void bad_gateway();
+    // 读到m_to_up尾部的n字节请求数据，交给请求体扫描，返回false表示请求体格式错误
+    bool take_request( size_t n );
+    // 读上游的响应，返回false表示需要关闭客户端连接
+    bool read_upstream( bool& progress );
+    // 解析m_head中的响应头：返回1表示解析完了，0表示还不完整，-1表示出错
+    int parse_response_head();
+    bool can_read_upstream() const;
+    ssize_t read_client( char* buf, size_t len );
+    ssize_t write_client( const char* buf, size_t len );
+    void release_upstream();
+    void arm();
+
+private:
+    http_conn* m_client;
+    int m_sockfd;
+    int m_epollfd;
+    SSL* m_ssl;                 // 客户端连接的SSL对象（属于http_conn），为NULL表示明文
+    upstream* m_upstream;
+    upstream_conn* m_up;        // 当前使用的上游连接
+
+    buffer m_to_up;             // 客户端 -> 上游
+    buffer m_to_client;         // 上游 -> 客户端
+    std::string m_replay;       // 完整的请求（复用的长连接失败时用来重发），请求体没有一次读完时为空
+    std::string m_head;         // 正在接收的上游响应头
+    body_scanner m_req_body;
+    body_scanner m_resp_body;
+
+    bool m_head_method;
+    bool m_req_done;            // 请求已经完整地读完了
+    bool m_resp_started;        // 已经从上游收到了响应的数据
+    bool m_head_sent;           // 响应头已经放进了发给客户端的缓冲区
+    bool m_resp_done;           // 响应已经完整地读完了
+    bool m_up_reusable;         // 上游连接转发完之后可以放回连接池
+    bool m_client_close;        // 转发完之后关闭客户端连接
+    bool m_finished;
+};
+
+#endif
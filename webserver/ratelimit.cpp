@@ -0,0 +1,129 @@
+#include "ratelimit.h"
+
+#include <time.h>
+
+// 粗粒度的单调时钟（几毫秒的精度，读取只需要几纳秒），用于限速足够了
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    return ( int64_t )ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+client_limiter::client_limiter()
+    : m_enabled( false ), m_max_conns( 0 ), m_interval( 0 ), m_tolerance( 0 ), m_last_age( 0 ), m_age_shard( 0 ) {
+    for( int i = 0; i < SHARDS; ++i ) {
+        for( int j = 0; j < SLOTS_PER_SHARD; ++j ) {
+            m_slots[i][j].ip.store( EMPTY, std::memory_order_relaxed );
+            m_slots[i][j].conns.store( 0, std::memory_order_relaxed );
+            m_slots[i][j].tat.store( 0, std::memory_order_relaxed );
+        }
+    }
+}
+
+void client_limiter::configure( int max_conns, int rate, int burst ) {
+    m_max_conns = max_conns > 0 ? max_conns : 0;
+    m_interval = rate > 0 ? 1000000000LL / rate : 0;
+    if( burst < 1 ) {
+        burst = 1;
+    }
+    // 同一时刻到达的burst个请求：第k个请求时tat比当前时间提前了(k-1)个间隔
+    m_tolerance = m_interval * ( burst - 1 );
+    m_enabled = m_max_conns > 0 || m_interval > 0;
+}
+
+client_slot* client_limiter::find_or_insert( uint32_t ip ) {
+    uint32_t h = ip * 0x9e3779b1u;     // 乘法哈希，让相邻的地址分散开
+    client_slot* shard = m_slots[ h >> 26 ];    // 高6位选择分片
+    int start = ( h >> 18 ) & ( SLOTS_PER_SHARD - 1 );
+    client_slot* reuse = NULL;
+    for( int i = 0; i < SLOTS_PER_SHARD; ++i ) {
+        client_slot* s = &shard[ ( start + i ) & ( SLOTS_PER_SHARD - 1 ) ];
+        uint32_t key = s->ip.load( std::memory_order_relaxed );
+        if( key == ip ) {
+            return s;
+        }
+        if( key == DELETED ) {
+            // 已回收的槽不能结束查找（后面可能还有这个IP），记下来，找不到时复用
+            if( !reuse ) {
+                reuse = s;
+            }
+            continue;
+        }
+        if( key == EMPTY ) {
+            if( !reuse ) {
+                reuse = s;
+            }
+            break;
+        }
+    }
+    if( !reuse ) {
+        return NULL;
+    }
+    // 只有主线程修改槽的IP，槽交给连接之前就初始化好了
+    reuse->conns.store( 0, std::memory_order_relaxed );
+    reuse->tat.store( 0, std::memory_order_relaxed );
+    reuse->ip.store( ip, std::memory_order_relaxed );
+    return reuse;
+}
+
+void client_limiter::age( int64_t now ) {
+    if( now - m_last_age < AGE_INTERVAL ) {
+        return;
+    }
+    m_last_age = now;
+    client_slot* shard = m_slots[ m_age_shard ];
+    m_age_shard = ( m_age_shard + 1 ) % SHARDS;
+    for( int i = 0; i < SLOTS_PER_SHARD; ++i ) {
+        client_slot* s = &shard[i];
+        uint32_t key = s->ip.load( std::memory_order_relaxed );
+        if( key == EMPTY || key == DELETED ) {
+            continue;
+        }
+        // 没有连接的IP不会再有线程访问它的槽（连接数只由主线程增加）；令牌桶还没恢复满的先留着，
+        // 否则这个IP断开重连就能绕过速率限制
+        if( s->conns.load( std::memory_order_acquire ) == 0 && s->tat.load( std::memory_order_relaxed ) <= now ) {
+            s->ip.store( DELETED, std::memory_order_relaxed );
+        }
+    }
+}
+
+bool client_limiter::admit( uint32_t ip, client_slot*& slot ) {
+    slot = NULL;
+    if( !m_enabled ) {
+        return true;
+    }
+    age( now_ns() );
+    client_slot* s = find_or_insert( ip );
+    if( !s ) {
+        return true;    // 表满了，不限制这个连接
+    }
+    if( m_max_conns > 0 && s->conns.load( std::memory_order_relaxed ) >= m_max_conns ) {
+        return false;
+    }
+    s->conns.fetch_add( 1, std::memory_order_relaxed );
+    slot = s;
+    return true;
+}
+
+void client_limiter::release( client_slot* slot ) {
+    // release：老化时看到连接数为0，这个连接对槽的所有访问都已经结束了
+    slot->conns.fetch_sub( 1, std::memory_order_release );
+}
+
+bool client_limiter::allow_request( client_slot* slot ) {
+    if( m_interval == 0 ) {
+        return true;
+    }
+    int64_t now = now_ns();
+    int64_t tat = slot->tat.load( std::memory_order_relaxed );
+    while( true ) {
+        int64_t base = tat > now ? tat : now;
+        if( base - now > m_tolerance ) {
+            return false;   // 桶中没有令牌了
+        }
+        if( slot->tat.compare_exchange_weak( tat, base + m_interval, std::memory_order_relaxed ) ) {
+            return true;
+        }
+    }
+}
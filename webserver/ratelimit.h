@@ -0,0 +1,69 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+// 按客户端IP限制连接数和请求速率
+// 以前只检查全局的连接数（m_user_count >= MAX_FD），一个客户端就可以占满所有连接。
+//
+// 每个IP在一张表中占一个槽，槽中记录这个IP当前的连接数和请求速率的令牌桶：
+//   accept时（主线程）：查找或者插入这个IP的槽，连接数达到上限时拒绝连接，否则连接数加1，槽的指针交给http_conn保存
+//   解析请求行、HTTP/2的每个新流（工作线程或者主线程）：通过保存的槽指针从令牌桶中取一个令牌，取不到时回复429
+//   关闭连接时（主线程，工作线程通过hand_back把要关闭的连接交还给主线程）：连接数减1
+// 插入、老化（回收没有连接、令牌桶已经满了的槽）只由主线程进行，工作线程只通过连接保存的槽指针更新槽中的原子变量，
+// 有连接的槽不会被回收，所以工作线程不需要查表，也不需要加锁。
+//
+// 令牌桶用GCRA（通用信元速率算法）实现，和令牌桶等价，但只需要一个原子变量：
+// 记录“理论上下一个请求到达的时间”（tat），每个请求把它往后推一个间隔，
+// tat超过当前时间的部分就是桶中已经用掉的令牌，超过容量时拒绝；一次CAS就能完成取令牌，不需要加锁。
+//
+// 表分成若干个分片，IP的哈希值决定分片，在分片内线性探测；老化每次只扫描一个分片，不会让主线程停顿太久。
+
+#include <stdint.h>
+#include <atomic>
+
+// 一个客户端IP的槽
+struct client_slot {
+    std::atomic< uint32_t > ip;         // IPv4地址（网络字节序），EMPTY表示空槽，DELETED表示已回收
+    std::atomic< int32_t > conns;       // 当前的连接数
+    std::atomic< int64_t > tat;         // 令牌桶：理论上下一个请求到达的时间（纳秒）
+};
+
+class client_limiter {
+public:
+    static const int SHARDS = 64;               // 分片的数量
+    static const int SLOTS_PER_SHARD = 256;     // 每个分片的槽数（总共可以同时跟踪16384个IP）
+    static const int64_t AGE_INTERVAL = 1000000000LL;   // 每隔多久（纳秒）老化一个分片
+
+public:
+    client_limiter();
+
+    // 设置限制：每个IP最多max_conns个连接（0表示不限制），每秒最多rate个请求，最多允许burst个突发请求（rate为0表示不限制）
+    void configure( int max_conns, int rate, int burst );
+    bool enabled() const { return m_enabled; }
+
+    // 主线程，accept之后调用：连接数没有超过上限时返回true，slot为这个IP的槽（表满了时为NULL，不限制这个连接）
+    bool admit( uint32_t ip, client_slot*& slot );
+    // 连接关闭时调用（主线程）
+    void release( client_slot* slot );
+    // 解析到一个新请求时调用（任何线程）：取一个令牌，超过速率限制时返回false
+    bool allow_request( client_slot* slot );
+
+private:
+    // 查找或者插入ip的槽（主线程），分片满了时返回NULL
+    client_slot* find_or_insert( uint32_t ip );
+    // 老化一个分片（主线程）：回收没有连接、令牌桶已经满了的槽
+    void age( int64_t now );
+
+private:
+    static const uint32_t EMPTY = 0;            // 0.0.0.0和255.255.255.255不会是TCP客户端的地址
+    static const uint32_t DELETED = 0xffffffffu;
+
+    client_slot m_slots[ SHARDS ][ SLOTS_PER_SHARD ];
+    bool m_enabled;
+    int m_max_conns;
+    int64_t m_interval;         // 两个请求之间的间隔（纳秒），0表示不限制速率
+    int64_t m_tolerance;        // 允许提前的时间（纳秒），即突发请求的容量
+    int64_t m_last_age;         // 上次老化的时间（主线程）
+    int m_age_shard;            // 下次老化的分片（主线程）
+};
+
+#endif
@@ -2,19 +2,67 @@
 #define THREADPOOL_H
 
 #include <list>
+#include <vector>
+#include <string>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
 #include "locker.h"
+#include "affinity.h"
+#include "probes.h"
 
 // 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类，使其更为通用
 template<typename T>
 class threadpool {
 public:
+    // 任务的优先级类别数量，类别0优先级最高
+    // 每个类别有自己的请求队列，工作线程按各类别的权重轮流从中取任务（加权公平调度），
+    // 这样对延迟敏感的小请求不会排在大文件下载的后面，而大文件下载也不会被饿死
+    static const int PRIORITY_CLASSES = 3;
+
     /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量*/
-    threadpool(int thread_number = 8, int max_requests = 10000); // 构造函数，含有默认实际参
+    /*cpus是工作线程要绑定的CPU列表，第i个线程绑定到cpus[i % cpus.size()]上，为空则不绑定*/
+    /*min_threads和max_threads是线程数量的上下限，都为0时线程数量固定为thread_number；
+      否则线程池是弹性的：任务在队列中等待太久时增加线程，线程空闲太久时退出，线程数量始终在[min_threads, max_threads]之间*/
+    threadpool(int thread_number = 8, int max_requests = 10000,
+               const std::vector<int>& cpus = std::vector<int>(),
+               int min_threads = 0, int max_threads = 0,
+               const char* name = "threadpool"); // 构造函数，含有默认实际参，name用于锁竞争统计（LOCK_STATS）中区分不同的线程池
     ~threadpool();
-    bool append(T* request); // 向请求队列中添加任务的方法成员
+    // 向请求队列中添加任务的方法成员
+    // cpu是处理该任务最合适的CPU（比如收到该连接数据的网卡队列所在的CPU），-1表示没有偏好
+    // cls是任务的优先级类别，取值为[0, PRIORITY_CLASSES)
+    bool append(T* request, int cpu = -1, int cls = 1);
+    // 批量添加任务：一次epoll_wait返回的所有任务只加一次锁，并且只唤醒需要的工作线程
+    // cpus、classes可以为NULL（分别表示没有偏好的CPU、类别1），
+    // 返回成功加入队列的任务数量，超出队列上限的任务（从第返回值个开始）不会被加入
+    int append_batch(T** requests, const int* cpus, const int* classes, int count);
+    // 开启/关闭按CPU引导任务：开启后工作线程取任务时，会优先取cpu与自己所在CPU相同的任务
+    void set_steering(bool on) { m_steering = on; }
+    // 设置弹性线程池的参数：任务在队列中等待超过target_wait_us微秒时增加线程，
+    // 线程空闲超过idle_timeout_ms毫秒时退出
+    void set_elastic_params(int target_wait_us, int idle_timeout_ms) {
+        m_target_wait_us = target_wait_us;
+        m_idle_timeout_ms = idle_timeout_ms;
+    }
+    // 设置各优先级类别的权重（PRIORITY_CLASSES个正整数），以及防饿死的时间：
+    // 任何类别的队头任务等待超过starvation_us微秒时，不管权重先处理它
+    void set_priority_params(const int* weights, int starvation_us) {
+        m_queuelocker.lock();
+        for ( int i = 0; i < PRIORITY_CLASSES; ++i ) {
+            m_weight[i] = weights[i] > 0 ? weights[i] : 1;
+            m_current[i] = 0;
+        }
+        m_starvation_us = starvation_us;
+        m_queuelocker.unlock();
+    }
+    // 当前的线程数量，以及线程池扩容、缩容的次数
+    int thread_count() { m_queuelocker.lock(); int n = m_thread_number; m_queuelocker.unlock(); return n; }
+    int grow_count() { m_queuelocker.lock(); int n = m_grow_count; m_queuelocker.unlock(); return n; }
+    int shrink_count() { m_queuelocker.lock(); int n = m_shrink_count; m_queuelocker.unlock(); return n; }
 
 private:
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
@@ -23,70 +71,211 @@ private:
     static void* worker(void* arg);
     // run函数，工作线程实际执行的代码
     void run();
+    // 创建一个工作线程，保存在m_threads的一个空位中（调用时需持有m_queuelocker）
+    bool spawn_worker();
+    // 任务等待太久并且没有空闲线程时增加一个线程（调用时需持有m_queuelocker），返回是否增加了线程
+    bool maybe_grow(long long now, long long waited);
+    // 等待信号量失败（超时或被信号中断）之后的处理，返回true表示该线程应当退出
+    bool on_wait_failed(bool timed_out);
+    // 把任务放入对应类别的队列（调用时需持有m_queuelocker）
+    void enqueue(T* request, int cpu, int cls, long long now);
+    // 选出下一个要处理的任务所在的类别（调用时需持有m_queuelocker，且队列不为空）
+    int pick_class(long long now);
+    // 所有队列中等待最久的任务进入队列的时间（调用时需持有m_queuelocker，且队列不为空）
+    long long oldest_enqueue_us();
+    // 当前时间，单位为微秒（单调时钟）
+    static long long now_us();
 
 private:
-    // 线程的数量
+    // 请求队列中的元素：任务本身，处理它最合适的CPU，以及它进入队列的时间
+    struct task {
+        T* request;
+        int cpu;
+        long long enqueue_us;
+    };
+
+    // 按CPU引导任务时，工作线程最多往队列里看多少个任务，
+    // 看的太多会延长持锁时间，也会让队尾的任务等太久
+    static const int STEER_SCAN_DEPTH = 8;
+
+    // 线程的数量（弹性线程池中是当前存活的线程数量，由m_queuelocker保护）
     int m_thread_number;  
+
+    // 线程数量的上下限
+    int m_min_threads;
+    int m_max_threads;
     
     // 线程池容器，是一个数组就行了，这个就是我们的线程池
-    // 描述线程池的数组，大小为m_thread_number    
+    // 描述线程池的数组，大小为m_max_threads，值为0的位置表示空位（该线程已经退出或还没有创建）
     pthread_t * m_threads;
 
+    // 工作线程要绑定的CPU列表，以及一共创建过多少个线程（用来给新线程分配CPU）
+    std::vector<int> m_cpus;
+    int m_spawned;
+
+    // 弹性线程池的参数：任务排队时间的目标值（微秒），线程最长空闲时间（毫秒）
+    int m_target_wait_us;
+    int m_idle_timeout_ms;
+    // 上一次增加线程的时间，两次增加线程之间至少间隔m_target_wait_us，避免一下子创建太多线程
+    long long m_last_grow_us;
+    // 扩容、缩容的次数
+    int m_grow_count;
+    int m_shrink_count;
+
     // 请求队列中最多允许的、等待处理的请求的数量  
     int m_max_requests; 
     
-    // 请求队列/工作队列，用容器list
+    // 请求队列/工作队列，用容器list，每个优先级类别一个
     // 是所有线程共享的，是临界区资源
-    std::list<T*> m_workqueue;  
+    std::list<task> m_workqueue[PRIORITY_CLASSES];  
+    // 所有队列中的任务总数
+    int m_queued;
+
+    // 加权轮询的状态：各类别的权重，以及当前值（平滑加权轮询算法，每次选当前值最大的类别）
+    int m_weight[PRIORITY_CLASSES];
+    int m_current[PRIORITY_CLASSES];
+    // 防饿死的时间（微秒）
+    int m_starvation_us;
 
     // 保护请求队列的互斥锁（用到的即为locker.h中定义的互斥锁类locker）
     locker m_queuelocker;   
 
-    // 信号量，用来判断是否有任务需要处理
-    // 它的值即为任务请求队列中现有的任务数量
+    // 信号量，用来唤醒空闲的工作线程
+    // 工作线程被唤醒后会一直处理任务，直到请求队列为空才重新等待，
+    // 所以它的值不再等于队列中的任务数量，而是等于已经发出、还没被消费的唤醒次数
     sem m_queuestat;
 
+    // 正在等待信号量（或即将等待）、并且还没有被分配唤醒的空闲工作线程数量，由m_queuelocker保护
+    // 添加任务时最多只唤醒这么多个线程，其余的任务由正在工作的线程处理完手头的任务后接着处理
+    int m_idle;
+
     // 是否结束线程的标志，
     // 线程池不终止，线程池里的线程就不会终止（叫池子麻）；线程池一旦终止，线程池里的线程也要终止      
     bool m_stop;                    
+
+    // 是否按CPU引导任务
+    bool m_steering;
 };
 
 // 构造函数
 template< typename T >
-threadpool< T >::threadpool(int thread_number, int max_requests) : 
-        m_thread_number(thread_number), m_max_requests(max_requests), 
-        m_stop(false), m_threads(NULL) {
+threadpool< T >::threadpool(int thread_number, int max_requests, const std::vector<int>& cpus,
+                            int min_threads, int max_threads, const char* name) : 
+        m_thread_number(0), m_min_threads(min_threads), m_max_threads(max_threads),
+        m_threads(NULL), m_cpus(cpus), m_spawned(0),
+        m_target_wait_us(1000), m_idle_timeout_ms(30000), m_last_grow_us(0),
+        m_grow_count(0), m_shrink_count(0), m_max_requests(max_requests), m_queued(0), m_starvation_us(100000),
+        m_queuelocker( ( std::string( name ) + ".queue" ).c_str() ),
+        m_queuestat( ( std::string( name ) + ".wakeup" ).c_str() ),
+        m_idle(0), m_stop(false), m_steering(false) {
+
+    // 默认权重：高优先级 8，普通 4，大文件 1
+    static const int default_weights[3] = { 8, 4, 1 };
+    for ( int i = 0; i < PRIORITY_CLASSES; ++i ) {
+        m_weight[i] = i < 3 ? default_weights[i] : 1;
+        m_current[i] = 0;
+    }
 
     if((thread_number <= 0) || (max_requests <= 0) ) { // 如果传递来的是负数，抛出异常
         throw std::exception();
     }
+    // 没有指定上下限时，线程数量固定为thread_number
+    if( m_min_threads == 0 && m_max_threads == 0 ) {
+        m_min_threads = m_max_threads = thread_number;
+    }
+    if( m_min_threads <= 0 || m_max_threads < m_min_threads ) {
+        throw std::exception();
+    }
+    // 初始线程数量限制在上下限之间
+    if( thread_number < m_min_threads ) {
+        thread_number = m_min_threads;
+    } else if( thread_number > m_max_threads ) {
+        thread_number = m_max_threads;
+    }
 
-    // 通过new动态创建线程池
-    m_threads = new pthread_t[m_thread_number];
+    // 通过new动态创建线程池，按最大线程数量分配
+    m_threads = new pthread_t[m_max_threads];
     if(!m_threads) { // 如果创建不成功，抛出异常
         throw std::exception();
     }
+    for ( int i = 0; i < m_max_threads; ++i ) {
+        m_threads[i] = 0;
+    }
 
     // 创建thread_number 个线程
-    // 并将他们设置为线程分离（使得当线程终止时，自动释放资源，无需再由父线程回收资源）
+    // 新创建的线程会先去锁m_queuelocker，所以这里也持有这把锁，等所有线程都创建完再让它们开始工作
+    m_queuelocker.lock();
     for ( int i = 0; i < thread_number; ++i ) {
         printf( "create the %dth thread\n", i);
-        if(pthread_create(m_threads + i, NULL, worker, this ) != 0) {
-            // 线程创建函数：
-            // 第一个参数为创建的线程要保存到那里，应传入指针类型
-            // 第二个参数为线程属性，默认为NULL即可
-            // 第三个参数为子线程要执行的代码，即回调函数，线程会跑到回调函数处执行代码，
-            //     worker函数指针的类型为 void* worker(void* arg);
-            // 第四个参数为需要传递给worker的实参arg（是一个指针类型）
-            delete [] m_threads;        // 如果创建第i个线程失败，释放资源并抛出异常
-            throw std::exception();
+        if( !spawn_worker() ) {
+            m_queuelocker.unlock();
+            throw std::exception();     // 如果创建第i个线程失败，抛出异常（已经创建的线程是分离的，不会阻塞进程退出）
         }
-        
-        if( pthread_detach( m_threads[i] ) ) {
-            delete [] m_threads;        // 如果分离第i个线程失败，释放资源并抛出异常
-            throw std::exception();
+    }
+    m_queuelocker.unlock();
+}
+
+// 创建一个工作线程，调用时需持有m_queuelocker
+// 并将它设置为线程分离（使得当线程终止时，自动释放资源，无需再由父线程回收资源）
+template< typename T >
+bool threadpool< T >::spawn_worker() {
+    int slot = 0;
+    while ( slot < m_max_threads && m_threads[slot] != 0 ) {
+        ++slot;
+    }
+    if ( slot == m_max_threads ) {
+        return false;
+    }
+    if(pthread_create(m_threads + slot, NULL, worker, this ) != 0) {
+        // 线程创建函数：
+        // 第一个参数为创建的线程要保存到那里，应传入指针类型
+        // 第二个参数为线程属性，默认为NULL即可
+        // 第三个参数为子线程要执行的代码，即回调函数，线程会跑到回调函数处执行代码，
+        //     worker函数指针的类型为 void* worker(void* arg);
+        // 第四个参数为需要传递给worker的实参arg（是一个指针类型）
+        m_threads[slot] = 0;
+        return false;
+    }
+
+    // 将新线程绑定到对应的CPU上，绑定失败不影响线程池的正常工作
+    if( !m_cpus.empty() ) {
+        int cpu = m_cpus[ m_spawned % m_cpus.size() ];
+        if( !bind_thread_to_cpu( m_threads[slot], cpu ) ) {
+            printf( "bind the %dth thread to cpu %d failed\n", m_spawned, cpu );
         }
     }
+    ++m_spawned;
+    // 线程已经在运行了，不管分离成功与否都要计数（分离失败只是线程退出时资源不会自动回收）
+    ++m_thread_number;
+
+    if( pthread_detach( m_threads[slot] ) ) {
+        printf( "detach the %dth thread failed\n", m_spawned );
+    }
+    return true;
+}
+
+// 当前时间，单位为微秒
+template< typename T >
+long long threadpool< T >::now_us() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// 任务等待太久并且没有空闲线程时增加一个线程，调用时需持有m_queuelocker
+// waited是队列中（最老的）任务已经等待的时间
+template< typename T >
+bool threadpool< T >::maybe_grow( long long now, long long waited ) {
+    if ( m_thread_number >= m_max_threads || m_idle > 0 || waited <= m_target_wait_us
+            || now - m_last_grow_us <= m_target_wait_us ) {
+        return false;
+    }
+    if ( !spawn_worker() ) {
+        return false;
+    }
+    m_last_grow_us = now;
+    ++m_grow_count;
+    return true;
 }
 
 // 析构函数
@@ -98,21 +287,125 @@ threadpool< T >::~threadpool() {
 
 // 向请求队列中添加任务
 template< typename T >
-bool threadpool< T >::append( T* request )
+bool threadpool< T >::append( T* request, int cpu, int cls )
 {
     // 操作工作队列时一定要加锁，因为它被所有线程共享。
     m_queuelocker.lock();
-    if ( m_workqueue.size() > m_max_requests ) { 
+    if ( m_queued > m_max_requests ) { 
         // 如果超出请求队列限定的任务数量最大值，函数返回false，添加任务失败
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back(request);
+    long long now = now_us();
+    enqueue( request, cpu, cls, now );
+    // 有空闲线程时才需要唤醒，所有线程都在忙时，它们处理完手头的任务后自然会来取这个任务
+    bool wake = m_idle > 0;
+    if ( wake ) {
+        --m_idle;
+    }
+    // 所有线程都在忙，并且队头的任务已经等了太久（比如线程都阻塞在磁盘上了），就增加一个线程
+    bool grown = maybe_grow( now, now - oldest_enqueue_us() );
+    int threads = m_thread_number;
     m_queuelocker.unlock();
-    m_queuestat.post();   // V操作，相当于向任务队列中增加了一个proudct（任务），通知工作线程（消费者）去消费
+    if ( wake ) {
+        m_queuestat.post();   // V操作，通知一个空闲的工作线程（消费者）去消费
+    }
+    if ( grown ) {
+        printf( "threadpool grow to %d threads\n", threads );
+    }
     return true;
 }
 
+// 批量添加任务
+template< typename T >
+int threadpool< T >::append_batch( T** requests, const int* cpus, const int* classes, int count )
+{
+    // 所有任务只加一次锁
+    long long now = now_us();
+    m_queuelocker.lock();
+    int added = 0;
+    for ( ; added < count && m_queued <= m_max_requests; ++added ) {
+        enqueue( requests[added], cpus ? cpus[added] : -1, classes ? classes[added] : 1, now );
+    }
+    // 最多唤醒added个空闲线程，空闲线程不够时剩下的任务由忙碌的线程接着处理
+    int wake = added < m_idle ? added : m_idle;
+    m_idle -= wake;
+    bool grown = m_queued > 0 && maybe_grow( now, now - oldest_enqueue_us() );
+    int threads = m_thread_number;
+    m_queuelocker.unlock();
+    for ( int i = 0; i < wake; ++i ) {
+        m_queuestat.post();
+    }
+    if ( grown ) {
+        printf( "threadpool grow to %d threads\n", threads );
+    }
+    return added;
+}
+
+// 把任务放入对应类别的队列，调用时需持有m_queuelocker
+template< typename T >
+void threadpool< T >::enqueue( T* request, int cpu, int cls, long long now )
+{
+    if ( cls < 0 || cls >= PRIORITY_CLASSES ) {
+        cls = 1;
+    }
+    task t;
+    t.request = request;
+    t.cpu = cpu;
+    t.enqueue_us = now;
+    m_workqueue[cls].push_back(t);
+    ++m_queued;
+    WS_PROBE3( enqueue, request, cls, m_queued );
+}
+
+// 选出下一个要处理的任务所在的类别，调用时需持有m_queuelocker，且队列不为空
+template< typename T >
+int threadpool< T >::pick_class( long long now )
+{
+    // 防饿死：有类别的队头任务等待太久了，就先处理等待最久的那个
+    int oldest = -1;
+    for ( int i = 0; i < PRIORITY_CLASSES; ++i ) {
+        if ( !m_workqueue[i].empty() && now - m_workqueue[i].front().enqueue_us > m_starvation_us
+                && ( oldest < 0 || m_workqueue[i].front().enqueue_us < m_workqueue[oldest].front().enqueue_us ) ) {
+            oldest = i;
+        }
+    }
+    if ( oldest >= 0 ) {
+        return oldest;
+    }
+
+    // 平滑加权轮询：每个非空类别的当前值加上自己的权重，选当前值最大的类别，
+    // 然后把它的当前值减去所有非空类别的权重之和。这样在一段时间内，
+    // 各类别被选中的次数和权重成正比，并且不会连续地只选同一个类别
+    int best = -1;
+    int total = 0;
+    for ( int i = 0; i < PRIORITY_CLASSES; ++i ) {
+        if ( m_workqueue[i].empty() ) {
+            continue;
+        }
+        m_current[i] += m_weight[i];
+        total += m_weight[i];
+        if ( best < 0 || m_current[i] > m_current[best] ) {
+            best = i;
+        }
+    }
+    m_current[best] -= total;
+    return best;
+}
+
+// 所有队列中等待最久的任务进入队列的时间，调用时需持有m_queuelocker，且队列不为空
+template< typename T >
+long long threadpool< T >::oldest_enqueue_us()
+{
+    long long oldest = 0;
+    for ( int i = 0; i < PRIORITY_CLASSES; ++i ) {
+        if ( !m_workqueue[i].empty() && ( oldest == 0 || m_workqueue[i].front().enqueue_us < oldest ) ) {
+            oldest = m_workqueue[i].front().enqueue_us;
+        }
+    }
+    return oldest;
+}
+
 // 回调函数worker代码
 template< typename T >
 void* threadpool< T >::worker( void* arg )
@@ -127,16 +420,50 @@ template< typename T >
 void threadpool< T >::run() {
 
     while (!m_stop) {
-        m_queuestat.wait();         // P操作，工作线程消费一个product（任务）去处理，无任务要处理时，会在此处阻塞
         m_queuelocker.lock();       // 由于要操作队列，所以要先对队列上锁
-        if ( m_workqueue.empty() ) {
+        if ( m_queued == 0 ) {
+            // 队列为空，登记为空闲线程后等待被唤醒
+            // 登记和检查队列是在同一把锁下完成的，所以不会错过之后添加的任务
+            ++m_idle;
             m_queuelocker.unlock();
-            continue;
+            // P操作，无任务要处理时，会在此处阻塞，直到添加任务的线程唤醒它
+            // 弹性线程池中最多等待m_idle_timeout_ms，超时后多余的线程退出
+            bool elastic = m_min_threads < m_max_threads;
+            bool woken = elastic ? m_queuestat.timed_wait( m_idle_timeout_ms ) : m_queuestat.wait();
+            if ( !woken && on_wait_failed( elastic && errno == ETIMEDOUT ) ) {
+                return;             // 空闲太久，线程退出
+            }
+            continue;               // 被唤醒后重新检查队列（任务可能已经被其他正在工作的线程取走了）
         }
         // 走到这里，说明请求队列中有任务，可以进行处理
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();     // 取出任务
+        // 先按权重选出一个类别，然后默认取该类别队头的任务；
+        // 开启了按CPU引导时，在该队列前面的几个任务中优先取属于本CPU的任务
+        long long now = now_us();
+        int cls = pick_class( now );
+        std::list<task>& queue = m_workqueue[ cls ];
+        typename std::list<task>::iterator it = queue.begin();
+        if ( m_steering ) {
+            int my_cpu = sched_getcpu();
+            typename std::list<task>::iterator cur = queue.begin();
+            for ( int n = 0; n < STEER_SCAN_DEPTH && cur != queue.end(); ++n, ++cur ) {
+                if ( cur->cpu == my_cpu ) {
+                    it = cur;
+                    break;
+                }
+            }
+        }
+        T* request = it->request;
+        long long waited = now - it->enqueue_us;
+        queue.erase(it);             // 取出任务
+        --m_queued;
+        WS_PROBE4( dequeue, request, cls, waited, m_queued );
+        // 该任务在队列中等得太久，并且没有空闲线程，就增加一个线程
+        bool grown = maybe_grow( now, waited );
+        int threads = m_thread_number;
         m_queuelocker.unlock();      // 解锁，释放临界区资源
+        if ( grown ) {
+            printf( "threadpool grow to %d threads (queue wait %lld us)\n", threads, waited );
+        }
         if ( !request ) {
             continue;
         }
@@ -145,4 +472,40 @@ void threadpool< T >::run() {
 
 }
 
+// 等待信号量失败（超时或被信号中断）之后的处理
+// 线程在等待前已经登记为空闲（m_idle加了1），现在没有被正常唤醒，需要撤销这次登记：
+// 1. m_idle > 0，说明还有没被分配唤醒的空闲登记，直接减掉一个就行（所有登记都是等价的）
+// 2. m_idle == 0，说明所有空闲登记（包括自己的）都已经被添加任务的线程分配了唤醒，
+//    有一次post正在路上，必须把它消费掉，否则之后会有线程被多余地唤醒
+// 超时并且线程数量多于下限时，线程退出（返回true）
+template< typename T >
+bool threadpool< T >::on_wait_failed( bool timed_out ) {
+    m_queuelocker.lock();
+    if ( m_idle == 0 ) {
+        m_queuelocker.unlock();
+        while ( !m_queuestat.wait() ) {
+        }
+        return false;
+    }
+    --m_idle;
+    if ( !timed_out || m_thread_number <= m_min_threads || m_queued > 0 ) {
+        m_queuelocker.unlock();
+        return false;
+    }
+    // 线程退出，腾出它在m_threads中的位置
+    pthread_t self = pthread_self();
+    for ( int i = 0; i < m_max_threads; ++i ) {
+        if ( m_threads[i] != 0 && pthread_equal( m_threads[i], self ) ) {
+            m_threads[i] = 0;
+            break;
+        }
+    }
+    --m_thread_number;
+    ++m_shrink_count;
+    int threads = m_thread_number;
+    m_queuelocker.unlock();
+    printf( "threadpool shrink to %d threads (idle for %d ms)\n", threads, m_idle_timeout_ms );
+    return true;
+}
+
 #endif
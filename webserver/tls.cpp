@@ -0,0 +1,134 @@
+#include "tls.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <exception>
+#include <openssl/err.h>
+
+
+tls_context::tls_context( const char* cert_file, const char* key_file ) : m_ktls( false ) {
+    m_ctx = SSL_CTX_new( TLS_server_method() );
+    if( !m_ctx ) {
+        throw std::exception();
+    }
+    SSL_CTX_set_min_proto_version( m_ctx, TLS1_2_VERSION );
+    if( SSL_CTX_use_certificate_chain_file( m_ctx, cert_file ) != 1
+            || SSL_CTX_use_PrivateKey_file( m_ctx, key_file, SSL_FILETYPE_PEM ) != 1
+            || SSL_CTX_check_private_key( m_ctx ) != 1 ) {
+        ERR_print_errors_fp( stdout );
+        SSL_CTX_free( m_ctx );
+        throw std::exception();
+    }
+
+    // 非阻塞的socket上SSL_write可能只写出一部分，而且重试时我们传入的缓冲区地址每次都不一样（见tls_writev）；
+    // 空闲连接不保留读写缓冲区（每个连接省下30多KB内存）
+    SSL_CTX_set_mode( m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                             | SSL_MODE_RELEASE_BUFFERS );
+    // 不允许客户端发起重新协商，数据传输过程中就不会再出现握手
+    SSL_CTX_set_options( m_ctx, SSL_OP_NO_RENEGOTIATION );
+
+    // 会话恢复：服务器端的会话缓存（TLS1.2的session ID）和会话票据（默认开启，票据密钥属于这个SSL_CTX）
+    static const unsigned char sid_ctx[] = "webserver";
+    SSL_CTX_set_session_id_context( m_ctx, sid_ctx, sizeof( sid_ctx ) - 1 );
+    SSL_CTX_set_session_cache_mode( m_ctx, SSL_SESS_CACHE_SERVER );
+    SSL_CTX_sess_set_cache_size( m_ctx, SESSION_CACHE_SIZE );
+    SSL_CTX_set_timeout( m_ctx, SESSION_TIMEOUT );
+
+    // 内核支持时，握手之后的对称加密交给内核（需要OpenSSL 3.0以上，并且编译时开启了kTLS）
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options( m_ctx, SSL_OP_ENABLE_KTLS );
+    m_ktls = true;
+#endif
+}
+
+tls_context::~tls_context() {
+    SSL_CTX_free( m_ctx );
+}
+
+SSL* tls_context::accept( int sockfd ) {
+    SSL* ssl = SSL_new( m_ctx );
+    if( !ssl ) {
+        return NULL;
+    }
+    if( SSL_set_fd( ssl, sockfd ) != 1 ) {
+        SSL_free( ssl );
+        return NULL;
+    }
+    SSL_set_accept_state( ssl );
+    return ssl;
+}
+
+
+int tls_handshake( SSL* ssl, bool& want_write ) {
+    ERR_clear_error();
+    int ret = SSL_do_handshake( ssl );
+    if( ret == 1 ) {
+        return 1;
+    }
+    switch( SSL_get_error( ssl, ret ) ) {
+        case SSL_ERROR_WANT_READ:
+            want_write = false;
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            want_write = true;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// 没有kTLS时，把iov中的数据按TLS记录的大小拼起来再交给SSL_write：
+// 响应头和响应体的开头合在一个记录里，不会为了几百字节的响应头单独生成一个记录、多一次send。
+// 重试时从同一个位置开始拼出的数据也是相同的，满足OpenSSL对重试的要求
+ssize_t tls_writev( SSL* ssl, const struct iovec* iov, int iovcnt ) {
+    // 内核负责加密，直接writev，文件内容不经过用户态的加密缓冲区
+    if( BIO_get_ktls_send( SSL_get_wbio( ssl ) ) ) {
+        return writev( SSL_get_wfd( ssl ), iov, iovcnt );
+    }
+
+    char record[ tls_context::RECORD_SIZE ];
+    ssize_t total = 0;
+    int i = 0;
+    size_t off = 0;     // iov[i]中已经拼进记录的字节数
+    while( true ) {
+        size_t n = 0;
+        while( i < iovcnt && n < sizeof( record ) ) {
+            size_t left = iov[i].iov_len - off;
+            size_t chunk = left < sizeof( record ) - n ? left : sizeof( record ) - n;
+            memcpy( record + n, ( const char* )iov[i].iov_base + off, chunk );
+            n += chunk;
+            off += chunk;
+            if( off == iov[i].iov_len ) {
+                ++i;
+                off = 0;
+            }
+        }
+        if( n == 0 ) {
+            return total;
+        }
+        ERR_clear_error();
+        int ret = SSL_write( ssl, record, n );
+        if( ret <= 0 ) {
+            int err = SSL_get_error( ssl, ret );
+            if( total > 0 ) {
+                return total;
+            }
+            errno = ( err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ) ? EAGAIN : EIO;
+            return -1;
+        }
+        total += ret;
+        if( ( size_t )ret < n ) {
+            return total;
+        }
+    }
+}
+
+void tls_close( SSL* ssl ) {
+    if( SSL_is_init_finished( ssl ) ) {
+        ERR_clear_error();
+        SSL_shutdown( ssl );
+    }
+    SSL_free( ssl );
+}
@@ -0,0 +1,51 @@
+#ifndef TLS_H
+#define TLS_H
+
+// TLS（HTTPS）支持，基于OpenSSL
+// 以前HTTPS要在前面再放一个TLS代理，多一跳转发，数据也要多拷贝几次；现在服务器自己完成加解密。
+//
+// 所有连接共用一个tls_context（SSL_CTX），其中的会话缓存（session ID）和会话票据（session ticket）的密钥
+// 也就被所有连接、所有线程共享：客户端断开重连时，不管落到哪个工作线程上都可以恢复会话，省掉完整握手中的非对称运算。
+// OpenSSL内部对会话缓存加了锁，这里不需要再加锁。
+//
+// 每个连接一个SSL对象，和socket一样由EPOLLONESHOT保证同一时刻只有一个线程在使用它：
+//   握手由工作线程完成（握手中的非对称运算比较耗时，不放在主线程中）
+//   主线程的read()/write()改用SSL_read和tls_writev收发数据
+// 内核支持kTLS时，握手之后对称加密交给内核完成，发送响应时直接writev，
+// 文件内容从内存映射直接交给内核加密发送，不需要先在用户态加密一遍。
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+class tls_context {
+public:
+    static const long SESSION_CACHE_SIZE = 20480;   // 会话缓存最多保存多少个会话
+    static const long SESSION_TIMEOUT = 300;        // 会话的有效期（秒）
+    static const int RECORD_SIZE = 16384;           // TLS记录的最大长度
+
+public:
+    // 加载证书和私钥（PEM格式），失败时抛出异常
+    tls_context( const char* cert_file, const char* key_file );
+    ~tls_context();
+
+    // 为新接受的连接创建SSL对象（服务器端），失败时返回NULL
+    SSL* accept( int sockfd );
+    // 这个OpenSSL是否支持kTLS（是否真的启用还要看内核，每个连接握手之后才知道）
+    bool ktls_supported() const { return m_ktls; }
+
+private:
+    SSL_CTX* m_ctx;
+    bool m_ktls;
+};
+
+// 非阻塞地推进握手：返回1表示握手完成，0表示需要等待（want_write为true时等待可写，否则等待可读），-1表示失败
+int tls_handshake( SSL* ssl, bool& want_write );
+// 加密发送iov中的数据，返回发送的字节数；一个字节都没发出去时返回-1，errno为EAGAIN表示需要等待可写
+// 没有发完时，下次调用必须从第一个没有发送的字节开始（OpenSSL要求重试时传入相同的数据）
+ssize_t tls_writev( SSL* ssl, const struct iovec* iov, int iovcnt );
+// 发送close_notify（不等待对方回复）并释放SSL对象
+void tls_close( SSL* ssl );
+
+#endif
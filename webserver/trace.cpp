@@ -0,0 +1,165 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <vector>
+#include "locker.h"
+
+const char* tracer::m_file = NULL;
+int tracer::m_every = 1;
+
+// 一个线程的记录缓冲区：环形，满了之后覆盖最旧的记录
+struct trace_buffer {
+    trace_buffer() : lock( "trace.buffer" ) {}
+
+    locker lock;                            // 只有写出时主线程才会来竞争
+    std::vector< trace_record > records;
+    size_t next;                            // 下一个记录写到哪里
+    size_t count;                           // 有效记录的数量
+    int tid;
+};
+
+// 所有线程的缓冲区（线程退出后缓冲区保留，其中的记录照样写出）
+static locker buffers_lock( "trace.buffers" );
+static std::vector< trace_buffer* > buffers;
+static thread_local trace_buffer* my_buffer = NULL;
+static thread_local unsigned int sample_counter = 0;
+
+
+void tracer::configure( const char* file, int every ) {
+    m_file = file;
+    m_every = every > 0 ? every : 1;
+}
+
+bool tracer::sample() {
+    return m_file && sample_counter++ % m_every == 0;
+}
+
+uint64_t tracer::now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int tracer::thread_id() {
+    static thread_local int tid = 0;
+    if( tid == 0 ) {
+        tid = syscall( SYS_gettid );
+    }
+    return tid;
+}
+
+void tracer::submit( const trace_record& rec ) {
+    if( !my_buffer ) {
+        my_buffer = new trace_buffer;
+        my_buffer->records.resize( BUFFER_RECORDS );
+        my_buffer->next = 0;
+        my_buffer->count = 0;
+        my_buffer->tid = thread_id();
+        buffers_lock.lock();
+        buffers.push_back( my_buffer );
+        buffers_lock.unlock();
+    }
+    my_buffer->lock.lock();
+    my_buffer->records[ my_buffer->next ] = rec;
+    my_buffer->next = ( my_buffer->next + 1 ) % BUFFER_RECORDS;
+    if( my_buffer->count < BUFFER_RECORDS ) {
+        ++my_buffer->count;
+    }
+    my_buffer->lock.unlock();
+}
+
+// 写出一段异步事件（开始和结束），同一个请求的各段使用同一个id，在查看器中嵌套显示在同一行
+static void write_span( FILE* fp, bool& first, unsigned long id, const char* name, uint64_t begin, uint64_t end,
+                        const char* args ) {
+    fprintf( fp, "%s\n{\"cat\":\"request\",\"name\":\"%s\",\"ph\":\"b\",\"id\":%lu,\"pid\":1,\"tid\":1,\"ts\":%.3f%s%s}",
+             first ? "" : ",", name, id, begin / 1000.0, args ? ",\"args\":" : "", args ? args : "" );
+    fprintf( fp, ",\n{\"cat\":\"request\",\"name\":\"%s\",\"ph\":\"e\",\"id\":%lu,\"pid\":1,\"tid\":1,\"ts\":%.3f}",
+             name, id, end / 1000.0 );
+    first = false;
+}
+
+// 把请求行中的字符转义成JSON字符串中可以出现的字符
+static void json_escape( const char* in, char* out, size_t size ) {
+    size_t n = 0;
+    for( ; *in && n + 2 < size; ++in ) {
+        unsigned char c = *in;
+        if( c == '"' || c == '\\' ) {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if( c >= 0x20 && c < 0x7f ) {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+}
+
+int tracer::dump() {
+    if( !m_file ) {
+        return -1;
+    }
+    FILE* fp = fopen( m_file, "w" );
+    if( !fp ) {
+        return -1;
+    }
+    // 各段的名字：第i段从第i个时刻到下一个记下了的时刻
+    // wait：等请求的数据；batch：等这一轮epoll_wait的其他事件处理完；queue：在请求队列中排队；
+    // parse：解析请求；handle：访问文件或者调用处理函数、生成响应；send：发送（写缓冲区满时包括等EPOLLOUT）
+    static const char* const phases[ TRACE_STAGES ] = { "wait", "batch", "queue", "parse", "handle", "send", NULL };
+
+    fprintf( fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" );
+    bool first = true;
+    int total = 0;
+    unsigned long id = 0;
+    std::vector< trace_record > records;
+    buffers_lock.lock();
+    for( size_t b = 0; b < buffers.size(); ++b ) {
+        // 先拷贝出来再格式化，不让提交记录的线程等文件I/O
+        trace_buffer* buf = buffers[b];
+        buf->lock.lock();
+        records.clear();
+        size_t start = ( buf->next + BUFFER_RECORDS - buf->count ) % BUFFER_RECORDS;
+        for( size_t i = 0; i < buf->count; ++i ) {
+            records.push_back( buf->records[ ( start + i ) % BUFFER_RECORDS ] );
+        }
+        buf->count = 0;
+        buf->lock.unlock();
+
+        for( size_t i = 0; i < records.size(); ++i ) {
+            const trace_record& rec = records[i];
+            uint64_t begin = rec.t[ TRACE_ACCEPT ] ? rec.t[ TRACE_ACCEPT ] : rec.t[ TRACE_READ ];
+            if( !begin || !rec.t[ TRACE_SENT ] ) {
+                continue;
+            }
+            ++id;
+            char name[ sizeof( rec.request ) * 2 ];
+            json_escape( rec.request, name, sizeof( name ) );
+            char args[ 128 ];
+            snprintf( args, sizeof( args ), "{\"fd\":%d,\"worker\":%d,\"sent_by\":%d}", rec.fd, rec.worker, buf->tid );
+            write_span( fp, first, id, name, begin, rec.t[ TRACE_SENT ], args );
+            // 各个阶段，没有经过的阶段（时间戳为0）跳过，并到前一段中
+            for( int s = TRACE_ACCEPT; s < TRACE_SENT; ++s ) {
+                if( !rec.t[s] ) {
+                    continue;
+                }
+                int e = s + 1;
+                while( e < TRACE_SENT && !rec.t[e] ) {
+                    ++e;
+                }
+                if( rec.t[e] >= rec.t[s] ) {
+                    write_span( fp, first, id, phases[s], rec.t[s], rec.t[e], NULL );
+                }
+            }
+            ++total;
+        }
+    }
+    buffers_lock.unlock();
+    fprintf( fp, "\n]}\n" );
+    if( fclose( fp ) != 0 ) {
+        return -1;
+    }
+    return total;
+}
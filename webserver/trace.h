@@ -0,0 +1,54 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// 请求的生命周期跟踪
+// 慢请求的时间花在哪里（在线程池的请求队列中排队、process_read()解析、还是发送）以前看不出来。
+//
+// 开启后（-T file[,every]），每every个请求抽样一个，在下面几个时刻记下时间戳（记录保存在http_conn中，不需要加锁）：
+//   TRACE_ACCEPT   连接建立（长连接上的后续请求：上一个响应发完，开始等这个请求）
+//   TRACE_READ     主线程读完请求的数据
+//   TRACE_ENQUEUE  主线程把这一轮的任务一起加入请求队列
+//   TRACE_DEQUEUE  工作线程取出任务，开始处理
+//   TRACE_PARSED   请求解析完毕
+//   TRACE_READY    响应生成好，开始发送
+//   TRACE_SENT     响应的最后一个字节发出去
+// 响应发完之后，记录放进当前线程自己的环形缓冲区（每个线程一个，只有写出时才会和主线程竞争它的锁）。
+// 收到SIGUSR1时，主线程把所有线程缓冲区中的记录写成Chrome trace event格式的JSON文件，
+// 可以直接在Perfetto（ui.perfetto.dev）或者chrome://tracing中打开，每个请求一行，分成排队、解析、发送等几段。
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum TRACE_STAGE { TRACE_ACCEPT = 0, TRACE_READ, TRACE_ENQUEUE, TRACE_DEQUEUE, TRACE_PARSED, TRACE_READY, TRACE_SENT, TRACE_STAGES };
+
+// 一个被抽样的请求的记录
+struct trace_record {
+    uint64_t t[ TRACE_STAGES ];     // 各个时刻（CLOCK_MONOTONIC，纳秒），0表示没有经过这个阶段（比如主线程直接处理的请求不排队）
+    int fd;
+    int worker;                     // 处理这个请求的工作线程的线程ID
+    char request[ 64 ];             // 请求方法和url（截断）
+};
+
+class tracer {
+public:
+    static const size_t BUFFER_RECORDS = 4096;  // 每个线程的缓冲区最多保存多少个记录，满了之后覆盖最旧的
+
+public:
+    // 开启跟踪：记录写到file，每every个请求抽样一个
+    static void configure( const char* file, int every );
+    static bool enabled() { return m_file != NULL; }
+    // 新请求开始时调用：是否跟踪这个请求（每个线程自己计数，不需要同步）
+    static bool sample();
+    static uint64_t now();
+    static int thread_id();
+    // 请求完成，把记录放进当前线程的缓冲区
+    static void submit( const trace_record& rec );
+    // 把所有线程缓冲区中的记录写到文件中并清空（主线程收到SIGUSR1时调用），返回写出的请求数，失败时返回-1
+    static int dump();
+
+private:
+    static const char* m_file;
+    static int m_every;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include "warm_start.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+int warm_start::save( const char* manifest, file_cache& cache ) {
+    std::vector< std::pair< std::string, unsigned long > > hot;
+    cache.hottest( MAX_ENTRIES, hot );
+    std::string tmp( manifest );
+    tmp += ".tmp";
+    FILE* fp = fopen( tmp.c_str(), "w" );
+    if( !fp ) {
+        return -1;
+    }
+    fprintf( fp, "# webserver hot files: hits path\n" );
+    int n = 0;
+    for( size_t i = 0; i < hot.size(); ++i ) {
+        if( hot[i].second == 0 || hot[i].first.find( '\n' ) != std::string::npos ) {
+            continue;
+        }
+        fprintf( fp, "%lu %s\n", hot[i].second, hot[i].first.c_str() );
+        ++n;
+    }
+    bool ok = !ferror( fp );
+    if( fclose( fp ) != 0 || !ok || rename( tmp.c_str(), manifest ) != 0 ) {
+        unlink( tmp.c_str() );
+        return -1;
+    }
+    return n;
+}
+
+int warm_start::preload( const char* manifest, const char* doc_root, file_cache& cache, size_t budget ) {
+    FILE* fp = fopen( manifest, "r" );
+    if( !fp ) {
+        if( errno != ENOENT ) {
+            printf( "open manifest %s failed: %s\n", manifest, strerror( errno ) );
+        }
+        return 0;
+    }
+    struct timespec start, end;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    size_t root_len = strlen( doc_root );
+    size_t used = 0;
+    size_t cached_bytes = 0;
+    int files = 0;
+    int cached = 0;
+    bool try_mlock = true;
+    char line[ 4096 ];
+    while( fgets( line, sizeof( line ), fp ) ) {
+        line[ strcspn( line, "\n" ) ] = '\0';
+        if( line[0] == '#' ) {
+            continue;
+        }
+        char* path;
+        unsigned long hits = strtoul( line, &path, 10 );
+        if( path == line || *path != ' ' ) {
+            continue;
+        }
+        ++path;
+        // 只预热资源目录下的文件（资源目录换了，或者清单被改过时不会去读别的文件），检查和do_request相同
+        if( strncmp( path, doc_root, root_len ) != 0 || path[ root_len ] != '/' || strstr( path, "/../" ) ) {
+            continue;
+        }
+        struct stat st;
+        if( stat( path, &st ) < 0 || !S_ISREG( st.st_mode ) || !( st.st_mode & S_IROTH ) || st.st_size <= 0 ) {
+            continue;
+        }
+        // 超出预算的文件跳过，后面更小的文件可能还放得下
+        if( used + st.st_size > budget ) {
+            continue;
+        }
+        int fd = open( path, O_RDONLY );
+        if( fd < 0 ) {
+            continue;
+        }
+        if( st.st_size <= file_cache::MAX_FILE_SIZE ) {
+            // 读入内存并建立好页表，加入文件缓存
+            char* addr = ( char* )mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0 );
+            if( addr == MAP_FAILED ) {
+                close( fd );
+                continue;
+            }
+            if( !cache.insert( path, addr, st ) ) {
+                munmap( addr, st.st_size );     // 缓存满了
+                close( fd );
+                continue;
+            }
+            // 锁在内存中，内存紧张时也不会被换出（受RLIMIT_MEMLOCK限制，失败了就不再尝试）
+            if( try_mlock && mlock( addr, st.st_size ) != 0 ) {
+                printf( "warm start: mlock failed (%s), cached files may be paged out\n", strerror( errno ) );
+                try_mlock = false;
+            }
+            ++cached;
+            cached_bytes += st.st_size;
+        } else {
+            // 大文件不缓存，每个请求都会重新mmap，先读入页缓存，请求时就不用等磁盘了
+            readahead( fd, 0, st.st_size );
+            char* none = NULL;
+            cache.insert( path, none, st );     // 记下大小
+        }
+        close( fd );
+        cache.add_hits( path, ( hits + 1 ) / 2 );
+        used += st.st_size;
+        ++files;
+    }
+    fclose( fp );
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    printf( "warm start: %d files, %.1f MB (%d cached, %.1f MB; %d read ahead) in %.0f ms\n", files,
+            used / 1048576.0, cached, cached_bytes / 1048576.0, files - cached,
+            ( end.tv_sec - start.tv_sec ) * 1e3 + ( end.tv_nsec - start.tv_nsec ) / 1e6 );
+    return files;
+}
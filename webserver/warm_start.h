@@ -0,0 +1,29 @@
+#ifndef WARM_START_H
+#define WARM_START_H
+
+// 热启动：保存热点文件清单，重启时先预热再开始接受连接
+// 服务器刚启动时文件缓存是空的，每个文件的第一个请求都要stat、open、mmap，还要等缺页从磁盘读入，
+// 重启之后的几分钟内延迟的高百分位会明显升高。
+//
+// 运行时定期（manifest_interval秒）把请求次数最多的文件（见file_cache::hottest）写到清单文件中，
+// 每行是“请求次数 文件的完整路径”；下次启动时在监听端口之前按清单从热到冷预热，直到用完预算（warm_budget_mb）：
+//   小文件（file_cache::MAX_FILE_SIZE以内）：mmap(MAP_POPULATE)读入内存并加入文件缓存，尽量mlock住，
+//                                           之后的请求直接命中缓存，也可以在主线程中直接处理（-f）
+//   大文件：readahead读入页缓存，并在文件缓存中记下大小
+// 上次的请求次数减半之后作为这次的初值，新的访问模式很快就能替换掉旧的。
+
+#include <stddef.h>
+#include "file_cache.h"
+
+class warm_start {
+public:
+    static const size_t MAX_ENTRIES = 1024;     // 清单中最多记录多少个文件
+
+    // 把cache中请求最多的文件写到清单manifest中（先写临时文件再改名，不会留下写了一半的清单）
+    // 返回写出的文件数，失败返回-1
+    static int save( const char* manifest, file_cache& cache );
+    // 按清单预热doc_root下的文件，最多预热budget字节，返回预热的文件数（清单不存在时返回0）
+    static int preload( const char* manifest, const char* doc_root, file_cache& cache, size_t budget );
+};
+
+#endif
@@ -0,0 +1,471 @@
+#include "websocket.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <exception>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include "tls.h"
+
+// 定义在http_conn.cpp中
+extern void modfd( int epollfd, int fd, int ev );
+
+
+ws_session::ws_session( int sockfd, int epollfd, SSL* ssl, const ws_endpoint* endpoint )
+    : m_sockfd( sockfd ), m_epollfd( epollfd ), m_ssl( ssl ), m_endpoint( endpoint ), m_lock( "ws.session" ),
+      m_owner( OWNER_WORKER ), m_out_bytes( 0 ), m_closing( false ), m_failed( false ),
+      m_in_len( 0 ), m_message_opcode( 0 ), m_stop_input( false ) {
+}
+
+// 连接关闭：先通知回调，再退订所有频道，退订之后广播者就不会再访问这个会话了
+ws_session::~ws_session() {
+    if( m_endpoint->on_close ) {
+        try {
+            m_endpoint->on_close( *this );
+        } catch( const std::exception& e ) {
+        }
+    }
+    for( size_t i = 0; i < m_channels.size(); ++i ) {
+        m_channels[i]->remove( this );
+    }
+}
+
+void ws_session::open( const char* key ) {
+    std::string resp = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: ";
+    resp += ws_accept_key( key );
+    resp += "\r\n\r\n";
+    send_frame( std::make_shared< const std::string >( std::move( resp ) ) );
+    if( m_endpoint->on_open ) {
+        try {
+            m_endpoint->on_open( *this );
+        } catch( const std::exception& e ) {
+            close( 1011 );
+        }
+    }
+}
+
+bool ws_session::claim() {
+    m_lock.lock();
+    bool ok = m_owner != OWNER_WORKER;
+    if( ok ) {
+        m_owner = OWNER_MAIN;
+    }
+    m_lock.unlock();
+    return ok;
+}
+
+bool ws_session::read() {
+    m_lock.lock();
+    bool ok = read_locked();
+    if( ok ) {
+        m_owner = OWNER_WORKER;
+    }
+    m_lock.unlock();
+    return ok;
+}
+
+// 输入缓冲区最多只需要放下一个最大的帧：帧头最长14字节
+bool ws_session::read_locked() {
+    const size_t max_input = MAX_FRAME_SIZE + 14;
+    while( m_in_len < max_input ) {
+        if( m_in.size() - m_in_len < INPUT_CHUNK ) {
+            size_t size = m_in.size() * 2 > m_in_len + INPUT_CHUNK ? m_in.size() * 2 : m_in_len + INPUT_CHUNK;
+            m_in.resize( size < max_input ? size : max_input );
+        }
+        int n;
+        if( m_ssl ) {
+            ERR_clear_error();
+            n = SSL_read( m_ssl, m_in.data() + m_in_len, m_in.size() - m_in_len );
+            if( n <= 0 ) {
+                int err = SSL_get_error( m_ssl, n );
+                if( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ) {
+                    break;
+                }
+                return false;
+            }
+        } else {
+            n = recv( m_sockfd, m_in.data() + m_in_len, m_in.size() - m_in_len, 0 );
+            if( n == -1 ) {
+                if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                    break;
+                }
+                return false;
+            } else if( n == 0 ) {
+                return false;
+            }
+        }
+        m_in_len += n;
+    }
+    return true;
+}
+
+bool ws_session::process() {
+    parse_input();
+    m_lock.lock();
+    // TLS连接：输入缓冲区满的时候，解密好的数据可能还有一部分留在SSL对象中，socket上不会再有可读事件
+    while( m_ssl && !m_stop_input && !m_failed && SSL_pending( m_ssl ) > 0 ) {
+        if( !read_locked() ) {
+            m_failed = true;
+            break;
+        }
+        m_lock.unlock();
+        parse_input();
+        m_lock.lock();
+    }
+    bool ok = release_locked();
+    m_lock.unlock();
+    return ok;
+}
+
+bool ws_session::write() {
+    m_lock.lock();
+    bool ok = release_locked();
+    m_lock.unlock();
+    return ok;
+}
+
+// 客户端发来的帧：FIN、RSV1~3、操作码，MASK、7位长度，（16位或64位的扩展长度），4字节掩码，数据
+void ws_session::parse_input() {
+    size_t pos = 0;
+    while( !m_stop_input ) {
+        size_t avail = m_in_len - pos;
+        if( avail < 2 ) {
+            break;
+        }
+        const uint8_t* p = ( const uint8_t* )m_in.data() + pos;
+        bool fin = p[0] & 0x80;
+        int opcode = p[0] & 0x0f;
+        // 没有协商任何扩展，RSV必须为0；客户端发送的帧必须加掩码
+        if( ( p[0] & 0x70 ) || !( p[1] & 0x80 ) ) {
+            fail( 1002 );
+            break;
+        }
+        uint64_t len = p[1] & 0x7f;
+        size_t header = 2;
+        if( len == 126 ) {
+            if( avail < 4 ) {
+                break;
+            }
+            len = ( p[2] << 8 ) | p[3];
+            header = 4;
+        } else if( len == 127 ) {
+            if( avail < 10 ) {
+                break;
+            }
+            len = 0;
+            for( int i = 2; i < 10; ++i ) {
+                len = ( len << 8 ) | p[i];
+            }
+            header = 10;
+        }
+        if( len > MAX_FRAME_SIZE ) {
+            fail( 1009 );
+            break;
+        }
+        if( avail < header + 4 + len ) {
+            break;
+        }
+        // 在输入缓冲区中直接去掉掩码
+        const uint8_t* mask = p + header;
+        char* payload = m_in.data() + pos + header + 4;
+        for( size_t i = 0; i < len; ++i ) {
+            payload[i] ^= mask[ i & 3 ];
+        }
+        pos += header + 4 + len;
+        on_frame( opcode, fin, payload, len );
+    }
+    if( m_stop_input ) {
+        pos = m_in_len;
+    }
+    memmove( m_in.data(), m_in.data() + pos, m_in_len - pos );
+    m_in_len -= pos;
+    // 空闲的连接不占用输入缓冲区（订阅者可能有成千上万个，大部分时间都只是在等待推送）
+    if( m_in_len == 0 && m_in.size() > INPUT_CHUNK ) {
+        std::vector< char >().swap( m_in );
+    }
+}
+
+void ws_session::on_frame( int opcode, bool fin, const char* payload, size_t len ) {
+    // 控制帧：不能分片，数据不超过125字节，可以插在分片消息的中间
+    if( opcode & 0x8 ) {
+        if( !fin || len > 125 ) {
+            fail( 1002 );
+            return;
+        }
+        switch( opcode ) {
+            case OP_CLOSE:
+                // 回复close帧（带上对方的状态码），发送完之后关闭连接
+                if( len == 1 ) {
+                    fail( 1002 );
+                    return;
+                }
+                m_stop_input = true;
+                {
+                    ws_frame_ptr frame = ws_make_frame( OP_CLOSE, payload, len < 2 ? len : 2 );
+                    m_lock.lock();
+                    if( !m_closing && !m_failed ) {
+                        enqueue_locked( frame );
+                        m_closing = true;
+                    }
+                    m_lock.unlock();
+                }
+                return;
+            case OP_PING:
+                send_frame( ws_make_frame( OP_PONG, payload, len ) );
+                return;
+            case OP_PONG:
+                return;
+            default:
+                fail( 1002 );
+                return;
+        }
+    }
+
+    if( opcode == OP_CONTINUATION ) {
+        if( m_message_opcode == 0 ) {
+            fail( 1002 );
+            return;
+        }
+    } else if( opcode == OP_TEXT || opcode == OP_BINARY ) {
+        if( m_message_opcode != 0 ) {
+            fail( 1002 );
+            return;
+        }
+        // 没有分片的消息（绝大多数）直接交给回调，数据还在输入缓冲区中，不拷贝
+        if( fin ) {
+            deliver( std::string_view( payload, len ), opcode == OP_BINARY );
+            return;
+        }
+        m_message_opcode = opcode;
+    } else {
+        fail( 1002 );
+        return;
+    }
+    if( m_message.size() + len > MAX_MESSAGE_SIZE ) {
+        fail( 1009 );
+        return;
+    }
+    m_message.append( payload, len );
+    if( fin ) {
+        deliver( m_message, m_message_opcode == OP_BINARY );
+        m_message_opcode = 0;
+        std::string().swap( m_message );
+    }
+}
+
+void ws_session::deliver( std::string_view msg, bool binary ) {
+    if( !m_endpoint->on_message ) {
+        return;
+    }
+    try {
+        m_endpoint->on_message( *this, msg, binary );
+    } catch( const std::exception& e ) {
+        fail( 1011 );
+    }
+}
+
+void ws_session::fail( uint16_t code ) {
+    m_stop_input = true;
+    close( code );
+}
+
+bool ws_session::send( std::string_view msg, bool binary ) {
+    return send_frame( ws_make_frame( binary ? OP_BINARY : OP_TEXT, msg.data(), msg.size() ) );
+}
+
+bool ws_session::send_frame( const ws_frame_ptr& frame ) {
+    m_lock.lock();
+    bool ok = enqueue_locked( frame );
+    m_lock.unlock();
+    return ok;
+}
+
+void ws_session::close( uint16_t code, std::string_view reason ) {
+    std::string payload;
+    payload.push_back( ( char )( code >> 8 ) );
+    payload.push_back( ( char )( code & 0xff ) );
+    payload.append( reason.data(), reason.size() < 123 ? reason.size() : 123 );
+    ws_frame_ptr frame = ws_make_frame( OP_CLOSE, payload.data(), payload.size() );
+    m_lock.lock();
+    if( !m_closing && !m_failed ) {
+        enqueue_locked( frame );
+        m_closing = true;
+    }
+    m_lock.unlock();
+}
+
+// 队列原来是空的就马上尝试发送：socket写缓冲区一般都有空间，广播的帧在广播者的线程中就直接发出去了
+bool ws_session::enqueue_locked( const ws_frame_ptr& frame ) {
+    if( m_closing || m_failed ) {
+        return false;
+    }
+    if( m_out_bytes + frame->size() > MAX_QUEUED ) {
+        // 客户端太慢，积压太多，断开它，不能让它拖累广播
+        m_failed = true;
+        m_out.clear();
+        m_out_bytes = 0;
+        arm_locked();
+        return false;
+    }
+    bool was_empty = m_out.empty();
+    out_item item;
+    item.frame = frame;
+    item.sent = 0;
+    m_out.push_back( item );
+    m_out_bytes += frame->size();
+    if( was_empty && !flush_locked() ) {
+        m_failed = true;
+    }
+    if( m_failed || !m_out.empty() ) {
+        arm_locked();
+    }
+    return !m_failed;
+}
+
+bool ws_session::flush_locked() {
+    while( !m_out.empty() ) {
+        struct iovec iov[ MAX_IOV ];
+        int count = 0;
+        for( std::deque< out_item >::iterator it = m_out.begin(); it != m_out.end() && count < MAX_IOV; ++it, ++count ) {
+            iov[ count ].iov_base = ( void* )( it->frame->data() + it->sent );
+            iov[ count ].iov_len = it->frame->size() - it->sent;
+        }
+        ssize_t n = m_ssl ? tls_writev( m_ssl, iov, count ) : writev( m_sockfd, iov, count );
+        if( n < 0 ) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        m_out_bytes -= n;
+        while( n > 0 ) {
+            out_item& item = m_out.front();
+            size_t left = item.frame->size() - item.sent;
+            if( ( size_t )n < left ) {
+                item.sent += n;
+                break;
+            }
+            n -= left;
+            m_out.pop_front();
+        }
+    }
+    return true;
+}
+
+// 会话空闲（已经注册在epoll中等待事件）时才能重新注册；正在被处理时由处理者处理完之后注册
+void ws_session::arm_locked() {
+    if( m_owner != OWNER_NONE ) {
+        return;
+    }
+    int ev = EPOLLIN;
+    if( m_failed || !m_out.empty() ) {
+        ev |= EPOLLOUT;
+    }
+    modfd( m_epollfd, m_sockfd, ev );
+}
+
+bool ws_session::release_locked() {
+    if( !m_failed && !flush_locked() ) {
+        m_failed = true;
+    }
+    if( finished_locked() ) {
+        return false;
+    }
+    m_owner = OWNER_NONE;
+    arm_locked();
+    return true;
+}
+
+void ws_session::subscribe( ws_channel& channel ) {
+    for( size_t i = 0; i < m_channels.size(); ++i ) {
+        if( m_channels[i] == &channel ) {
+            return;
+        }
+    }
+    channel.add( this );
+    m_channels.push_back( &channel );
+}
+
+void ws_session::unsubscribe( ws_channel& channel ) {
+    for( size_t i = 0; i < m_channels.size(); ++i ) {
+        if( m_channels[i] == &channel ) {
+            channel.remove( this );
+            m_channels.erase( m_channels.begin() + i );
+            return;
+        }
+    }
+}
+
+
+// 帧只编码一次，每个订阅者的输出队列中只是多了一个引用
+size_t ws_channel::broadcast( std::string_view msg, bool binary ) {
+    ws_frame_ptr frame = ws_make_frame( binary ? ws_session::OP_BINARY : ws_session::OP_TEXT, msg.data(), msg.size() );
+    m_lock.lock();
+    for( size_t i = 0; i < m_subscribers.size(); ++i ) {
+        m_subscribers[i]->send_frame( frame );
+    }
+    size_t n = m_subscribers.size();
+    m_lock.unlock();
+    return n;
+}
+
+size_t ws_channel::size() {
+    m_lock.lock();
+    size_t n = m_subscribers.size();
+    m_lock.unlock();
+    return n;
+}
+
+void ws_channel::add( ws_session* s ) {
+    m_lock.lock();
+    m_subscribers.push_back( s );
+    m_lock.unlock();
+}
+
+// 顺序无关紧要，用最后一个填补空位
+void ws_channel::remove( ws_session* s ) {
+    m_lock.lock();
+    for( size_t i = 0; i < m_subscribers.size(); ++i ) {
+        if( m_subscribers[i] == s ) {
+            m_subscribers[i] = m_subscribers.back();
+            m_subscribers.pop_back();
+            break;
+        }
+    }
+    m_lock.unlock();
+}
+
+
+ws_frame_ptr ws_make_frame( int opcode, const char* data, size_t len ) {
+    std::shared_ptr< std::string > frame = std::make_shared< std::string >();
+    frame->reserve( len + 10 );
+    frame->push_back( ( char )( 0x80 | opcode ) );
+    if( len < 126 ) {
+        frame->push_back( ( char )len );
+    } else if( len < 65536 ) {
+        frame->push_back( ( char )126 );
+        frame->push_back( ( char )( len >> 8 ) );
+        frame->push_back( ( char )( len & 0xff ) );
+    } else {
+        frame->push_back( ( char )127 );
+        for( int shift = 56; shift >= 0; shift -= 8 ) {
+            frame->push_back( ( char )( ( ( uint64_t )len >> shift ) & 0xff ) );
+        }
+    }
+    frame->append( data, len );
+    return frame;
+}
+
+// Sec-WebSocket-Accept = base64( SHA1( key + 固定的GUID ) )
+std::string ws_accept_key( const char* key ) {
+    std::string s = key;
+    s += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    unsigned char digest[ SHA_DIGEST_LENGTH ];
+    SHA1( ( const unsigned char* )s.data(), s.size(), digest );
+    char out[ 32 ];
+    EVP_EncodeBlock( ( unsigned char* )out, digest, SHA_DIGEST_LENGTH );
+    return out;
+}
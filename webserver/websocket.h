@@ -0,0 +1,166 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+// WebSocket（RFC 6455）
+// 服务器要主动推送消息时，客户端以前只能不停地发请求轮询，每条消息都要走一遍完整的请求处理流程。
+// WebSocket握手之后连接一直保持，双方随时可以发送消息。
+//
+// 一个连接升级到WebSocket之后（GET请求带Upgrade: websocket，路径上注册了ws_endpoint），
+// http_conn就把读写都交给ws_session，和HTTP/2的处理方式一样：
+//   主线程：read() 把数据读到输入缓冲区；write() 在socket可写时继续发送
+//   工作线程：process() 解析收到的帧，回复ping、close，把完整的消息交给ws_endpoint::on_message
+//
+// 广播：ws_channel是一组订阅者，broadcast()只把消息编码成一个帧（引用计数的共享缓冲区），
+// 然后在调用线程中依次writev给每个订阅者，所有订阅者共用这一份数据，没有逐个拷贝；
+// 发不完的部分留在订阅者的输出队列中，等socket可写时由主线程接着发送。
+//
+// 线程安全：广播可能来自任何线程（通常是处理另一个连接的工作线程），所以每个会话的输出队列由它自己的锁保护。
+// 广播者只有在会话空闲（没有被主线程或者工作线程处理）时才能重新注册EPOLLOUT，否则可能让两个线程同时处理同一个连接，
+// 所以会话记录当前由谁处理（m_owner），由当前的处理者在处理完之后重新注册事件。
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <openssl/ssl.h>
+#include "locker.h"
+
+class ws_session;
+class ws_channel;
+
+// 编码好的帧，由所有要发送它的会话共享
+typedef std::shared_ptr< const std::string > ws_frame_ptr;
+
+// 一个WebSocket端点（路径）的回调，在main函数中注册
+// on_open和on_message在工作线程中调用；on_close在连接关闭时调用，可能在主线程中，不要做耗时的操作
+struct ws_endpoint {
+    std::function< void( ws_session& ) > on_open;                                   // 握手完成
+    std::function< void( ws_session&, std::string_view msg, bool binary ) > on_message;  // 收到一条完整的消息
+    std::function< void( ws_session& ) > on_close;                                  // 连接关闭
+};
+
+class ws_session {
+public:
+    static const int OP_CONTINUATION = 0x0;
+    static const int OP_TEXT = 0x1;
+    static const int OP_BINARY = 0x2;
+    static const int OP_CLOSE = 0x8;
+    static const int OP_PING = 0x9;
+    static const int OP_PONG = 0xa;
+
+    static const size_t MAX_FRAME_SIZE = 64 * 1024;        // 接受的单个帧的最大长度
+    static const size_t MAX_MESSAGE_SIZE = 1024 * 1024;    // 接受的消息（多个分片拼起来）的最大长度
+    static const size_t MAX_QUEUED = 1024 * 1024;          // 输出队列中最多积压多少字节，超过时认为客户端太慢，断开连接
+    static const size_t INPUT_CHUNK = 4096;                // 输入缓冲区每次至少留出的空间
+    static const int MAX_IOV = 64;                         // 每次writev最多的帧数
+
+public:
+    // 会话创建时由工作线程处理（握手请求就是在工作线程中解析的）
+    ws_session( int sockfd, int epollfd, SSL* ssl, const ws_endpoint* endpoint );
+    ~ws_session();
+
+    // 工作线程调用：回复101完成握手，然后调用on_open
+    void open( const char* key );
+
+    // 主线程收到这个连接的事件时先调用：工作线程正在处理这个连接时返回false，这个事件直接忽略
+    // （广播者重新注册事件时可能多触发一次，工作线程处理完之后会重新注册）
+    bool claim();
+    // 主线程调用：读数据到输入缓冲区，对方关闭连接或出错时返回false；返回true之后连接交给工作线程
+    bool read();
+    // 工作线程调用：解析收到的帧，处理完重新注册事件，需要关闭连接时返回false
+    bool process();
+    // 主线程调用：socket可写时继续发送，需要关闭连接时返回false
+    bool write();
+
+    // 给这个客户端发送一条消息，连接已经关闭或者积压太多时返回false
+    // 只能在这个会话的回调中调用（会话随时可能被关闭、释放），要从别的地方发送请通过频道广播
+    bool send( std::string_view msg, bool binary = false );
+    // 发送一个编码好的帧（广播时所有订阅者共用同一个帧）
+    bool send_frame( const ws_frame_ptr& frame );
+    // 发送close帧，发送完之后关闭连接
+    void close( uint16_t code, std::string_view reason = std::string_view() );
+
+    // 订阅和退订频道（只能在这个会话的回调中调用），连接关闭时自动退订所有频道
+    void subscribe( ws_channel& channel );
+    void unsubscribe( ws_channel& channel );
+
+private:
+    enum OWNER { OWNER_NONE = 0, OWNER_MAIN, OWNER_WORKER };
+
+    struct out_item {
+        ws_frame_ptr frame;
+        size_t sent;            // 已经发送的字节数
+    };
+
+    // 读socket，调用者持有m_lock
+    bool read_locked();
+    // 解析输入缓冲区中完整的帧
+    void parse_input();
+    // 处理一个帧，payload已经去掉了掩码
+    void on_frame( int opcode, bool fin, const char* payload, size_t len );
+    // 放入输出队列并尝试发送，调用者持有m_lock
+    bool enqueue_locked( const ws_frame_ptr& frame );
+    // 协议错误：发送带状态码的close帧，不再处理之后收到的数据
+    void fail( uint16_t code );
+    // 把一条完整的消息交给on_message
+    void deliver( std::string_view msg, bool binary );
+    // 尽量发送输出队列中的数据，出错时返回false，调用者持有m_lock
+    bool flush_locked();
+    // 会话空闲时重新注册事件，调用者持有m_lock
+    void arm_locked();
+    // 当前的处理者处理完了：发送输出队列、重新注册事件，需要关闭连接时返回false，调用者持有m_lock
+    bool release_locked();
+    // 是否可以关闭连接了（close帧已经发出去，或者出错了），调用者持有m_lock
+    bool finished_locked() const { return m_failed || ( m_closing && m_out.empty() ); }
+
+private:
+    int m_sockfd;
+    int m_epollfd;
+    SSL* m_ssl;                         // TLS连接的SSL对象（属于http_conn），为NULL表示明文
+    const ws_endpoint* m_endpoint;
+
+    locker m_lock;                      // 保护下面的输出队列、处理者和SSL对象
+    OWNER m_owner;                      // 当前由谁处理这个连接
+    std::deque< out_item > m_out;       // 输出队列
+    size_t m_out_bytes;                 // 输出队列中没有发送的字节数
+    bool m_closing;                     // 已经发送了close帧，不再发送别的帧
+    bool m_failed;                      // 出错了（或者客户端太慢），直接关闭连接
+
+    // 下面的成员只由当前的处理者访问（主线程读、工作线程解析，EPOLLONESHOT和m_owner保证不会同时访问）
+    std::vector< char > m_in;           // 输入缓冲区，按需增长，空闲时释放
+    size_t m_in_len;
+    std::string m_message;              // 正在接收的分片消息
+    int m_message_opcode;               // 分片消息的类型，0表示没有正在接收的分片消息
+    bool m_stop_input;                  // 收到了close帧或者出现了协议错误，忽略之后收到的数据
+    std::vector< ws_channel* > m_channels;  // 订阅的频道
+};
+
+// 频道：一组订阅者，广播的消息发给其中的每一个
+class ws_channel {
+public:
+    ws_channel() : m_lock( "ws.channel" ) {}
+
+    // 把消息编码成一个帧，发给所有订阅者，返回订阅者的数量
+    size_t broadcast( std::string_view msg, bool binary = false );
+    size_t size();
+
+private:
+    friend class ws_session;
+    void add( ws_session* s );
+    void remove( ws_session* s );
+
+private:
+    locker m_lock;
+    std::vector< ws_session* > m_subscribers;   // 广播时顺序遍历，数组比链表、哈希表更快
+};
+
+// 编码一个帧（服务器发送的帧不加掩码）
+ws_frame_ptr ws_make_frame( int opcode, const char* data, size_t len );
+// 根据握手请求中的Sec-WebSocket-Key计算Sec-WebSocket-Accept
+std::string ws_accept_key( const char* key );
+
+#endif